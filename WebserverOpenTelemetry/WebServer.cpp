@@ -1,4 +1,4 @@
-#include <iostream> 
+﻿#include <iostream> 
 #include <string>   
 #include <atomic>   
 #include <thread>  
@@ -11,613 +11,8128 @@
 #include <unordered_map> 
 #include <vector>   
 #include <memory>  
+#include <condition_variable>
+#include <shared_mutex>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <charconv>
+#include <array>
+#include <cctype>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <deque>
+#include <functional>
+#include <new>
+#include <limits>
+#include <tuple>
+#include <memory_resource>
+
+#include <csignal>
+#include <fstream>
+#include <iterator>
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if !defined(_WIN32) && (defined(__GLIBC__) || defined(__APPLE__))
+// backtrace() e dladdr() per la profilazione in-process (/debug/pprof)
+#define OTEL_HAVE_PROFILER
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#define OTEL_RETURN_ADDRESS() __builtin_return_address(0)
+#else
+#define OTEL_RETURN_ADDRESS() nullptr
+#endif
+#ifdef _MSC_VER
+#define OTEL_NOINLINE __declspec(noinline)
+#else
+#define OTEL_NOINLINE __attribute__((noinline))
+#endif
+#ifdef OTEL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef OTEL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Lunghezza della coda di accept del socket in ascolto (httplib usa 5 per default,
+// troppo poco sotto carico). Il kernel la limita comunque a net.core.somaxconn.
+#ifndef CPPHTTPLIB_LISTEN_BACKLOG
+#define CPPHTTPLIB_LISTEN_BACKLOG 1024
+#endif
+
+// Funzionalità selezionate in fase di build (tutte attive per default; la build edge di
+// CMake, -DWEBSERVER_EDGE=ON, le disattiva). Il codice le legge come costanti constexpr
+// (otel::kTracingEnabled, ...): le parti escluse non vengono compilate, senza controlli a runtime.
+#ifndef OTEL_ENABLE_TRACING
+#define OTEL_ENABLE_TRACING 1
+#endif
+#ifndef OTEL_ENABLE_STRING_ATTRIBUTES
+#define OTEL_ENABLE_STRING_ATTRIBUTES 1
+#endif
+#ifndef WEBSERVER_ENABLE_HTML_PAGES
+#define WEBSERVER_ENABLE_HTML_PAGES 1
+#endif
 
 //Includiamo la libreria web server header-only.
 //Assicurati che il file "httplib.h" sia nel percorso di inclusione del tuo compilatore.
 // Link utile: https://github.com/yhirose/cpp-httplib
 #include "httplib.h"
 
-// --- Implementazione Minimale di OpenTelemetry ---
-// NOTA: Questa è una implementazione estremamente semplificata e *custom*
-// del concetto di OpenTelemetry. NON è la libreria ufficiale OpenTelemetry C++.
-// Serve solo a dimostrare i concetti di Span e Metriche logging le informazioni su console.
-// In una vera applicazione, si userebbe l'SDK ufficiale che esporta i dati a un Collector.
-// Link utile (SDK ufficiale OpenTelemetry C++): https://opentelemetry.io/docs/instrumentation/cpp/
+// --- Configurazione ---
+// Tutte le impostazioni hanno il nome della variabile d'ambiente corrispondente (WEBSERVER_*,
+// OTEL_*, LOG_*) e si possono dare in tre modi, con questa precedenza:
+//   1. riga di comando: --port=9090, --threads 16, --otel-traces-sampler=always_off, --reuse-port
+//      (il nome del flag in maiuscolo con '-' -> '_'; senza prefisso OTEL_/LOG_/WEBSERVER_
+//      viene aggiunto WEBSERVER_, quindi --port è WEBSERVER_PORT)
+//   2. variabili d'ambiente
+//   3. file indicato da --config o WEBSERVER_CONFIG_FILE: JSON (.json), YAML (.yaml/.yml, solo
+//      mappe annidate, scalari e liste) oppure righe NOME=valore. Le chiavi annidate vengono
+//      unite con '_': {"otel": {"traces_sampler": "always_off"}} è OTEL_TRACES_SAMPLER.
+// Le impostazioni vengono lette una sola volta all'avvio dai vari *Options::FromEnvironment();
+// i percorsi delle richieste usano solo i valori già convertiti.
+namespace config {
+
+    using Values = std::unordered_map<std::string, std::string>;
+
+    // Nome dell'impostazione per una chiave di file o di flag: maiuscolo, '-' e '.' -> '_'.
+    inline std::string SettingName(std::string_view key) {
+        std::string name(key);
+        for (char& c : name) {
+            c = (c == '-' || c == '.') ? '_' : static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        }
+        return name;
+    }
+
+    inline std::string_view Trim(std::string_view text) {
+        while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) text.remove_prefix(1);
+        while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) text.remove_suffix(1);
+        return text;
+    }
+
+    // Righe NOME=valore; righe vuote e commenti (#) ignorati.
+    inline bool ParseKeyValue(std::string_view text, Values& out, std::string& error) {
+        (void)error;
+        while (!text.empty()) {
+            size_t end = text.find('\n');
+            std::string_view line = Trim(text.substr(0, end));
+            text = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+            if (line.empty() || line.front() == '#') continue;
+            size_t equals = line.find('=');
+            if (equals == std::string_view::npos) continue;
+            out[SettingName(Trim(line.substr(0, equals)))] = std::string(Trim(line.substr(equals + 1)));
+        }
+        return true;
+    }
+
+    // Parser JSON essenziale: oggetti annidati diventano chiavi unite da '_', gli array
+    // valori separati da virgole (es. la lista dei peer), numeri e booleani il loro testo,
+    // null un'impostazione assente.
+    class JsonReader {
+    private:
+        std::string_view text;
+        size_t pos = 0;
+        Values& out;
+        std::string& error;
+
+        void SkipSpace() {
+            while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+        }
+
+        bool Fail(const char* message) {
+            error = std::string(message) + " alla posizione " + std::to_string(pos);
+            return false;
+        }
+
+        bool ReadString(std::string& value) {
+            if (pos >= text.size() || text[pos] != '"') return Fail("attesa una stringa");
+            ++pos;
+            value.clear();
+            while (pos < text.size() && text[pos] != '"') {
+                char c = text[pos++];
+                if (c == '\\' && pos < text.size()) {
+                    char escaped = text[pos++];
+                    switch (escaped) {
+                    case 'n': value += '\n'; break;
+                    case 't': value += '\t'; break;
+                    case 'r': value += '\r'; break;
+                    case 'u': return Fail("sequenze \\u non supportate");
+                    default: value += escaped; break;
+                    }
+                }
+                else {
+                    value += c;
+                }
+            }
+            if (pos >= text.size()) return Fail("stringa non terminata");
+            ++pos;
+            return true;
+        }
+
+        // Scalare o array di scalari nel testo del valore.
+        bool ReadScalar(std::string& value) {
+            SkipSpace();
+            if (pos < text.size() && text[pos] == '"') return ReadString(value);
+            size_t start = pos;
+            while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ']' &&
+                !std::isspace(static_cast<unsigned char>(text[pos]))) ++pos;
+            if (pos == start) return Fail("valore mancante");
+            value.assign(text.substr(start, pos - start));
+            return true;
+        }
+
+        bool ReadValue(const std::string& name) {
+            SkipSpace();
+            if (text.substr(pos, 4) == "null") {
+                pos += 4; // Impostazione assente
+                return true;
+            }
+            if (pos < text.size() && text[pos] == '{') return ReadObject(name + "_");
+            if (pos < text.size() && text[pos] == '[') {
+                ++pos;
+                std::string joined;
+                SkipSpace();
+                while (pos < text.size() && text[pos] != ']') {
+                    std::string item;
+                    if (!ReadScalar(item)) return false;
+                    if (!joined.empty()) joined += ',';
+                    joined += item;
+                    SkipSpace();
+                    if (pos < text.size() && text[pos] == ',') ++pos;
+                    else if (pos < text.size() && text[pos] != ']') return Fail("atteso ',' o ']'");
+                    SkipSpace();
+                }
+                if (pos >= text.size()) return Fail("array non terminato");
+                ++pos;
+                out[name] = std::move(joined);
+                return true;
+            }
+            std::string value;
+            if (!ReadScalar(value)) return false;
+            out[name] = std::move(value);
+            return true;
+        }
+
+    public:
+        JsonReader(std::string_view text, Values& out, std::string& error) : text(text), out(out), error(error) {}
+
+        bool ReadObject(const std::string& prefix) {
+            SkipSpace();
+            if (pos >= text.size() || text[pos] != '{') return Fail("atteso un oggetto");
+            ++pos;
+            SkipSpace();
+            while (pos < text.size() && text[pos] != '}') {
+                std::string key;
+                if (!ReadString(key)) return false;
+                SkipSpace();
+                if (pos >= text.size() || text[pos] != ':') return Fail("atteso ':'");
+                ++pos;
+                if (!ReadValue(prefix + SettingName(key))) return false;
+                SkipSpace();
+                if (pos < text.size() && text[pos] == ',') ++pos;
+                else if (pos < text.size() && text[pos] != '}') return Fail("atteso ',' o '}'");
+                SkipSpace();
+            }
+            if (pos >= text.size()) return Fail("oggetto non terminato");
+            ++pos;
+            return true;
+        }
+    };
+
+    inline bool ParseJson(std::string_view text, Values& out, std::string& error) {
+        return JsonReader(text, out, error).ReadObject("");
+    }
+
+    // Toglie il commento da una riga YAML: '#' a inizio riga o dopo uno spazio, fuori dalle virgolette.
+    inline std::string_view StripYamlComment(std::string_view line) {
+        char quote = 0;
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (quote) {
+                if (c == quote) quote = 0;
+            }
+            else if (c == '"' || c == '\'') {
+                quote = c;
+            }
+            else if (c == '#' && (i == 0 || std::isspace(static_cast<unsigned char>(line[i - 1])))) {
+                return line.substr(0, i);
+            }
+        }
+        return line;
+    }
+
+    // Sottoinsieme di YAML sufficiente per i file di configurazione: mappe annidate per
+    // indentazione, scalari (anche tra virgolette), liste "- valore" o "[a, b]", commenti.
+    // Gli elementi "- valore" appartengono all'ultima chiave senza valore, anche quando sono
+    // indentati come la chiave stessa (stile comune di YAML).
+    inline bool ParseYaml(std::string_view text, Values& out, std::string& error) {
+        auto unquote = [](std::string_view value) {
+            if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') && value.back() == value.front()) {
+                value = value.substr(1, value.size() - 2);
+            }
+            return std::string(value);
+        };
+        std::vector<std::pair<size_t, std::string>> parents; // (indentazione, prefisso)
+        std::string list_owner; // Ultima chiave senza valore, proprietaria delle righe "- valore"
+        size_t list_indent = 0;
+        size_t line_number = 0;
+        while (!text.empty()) {
+            size_t end = text.find('\n');
+            std::string_view line = text.substr(0, end);
+            text = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+            ++line_number;
+            line = StripYamlComment(line);
+            if (Trim(line).empty() || Trim(line) == "---") continue;
+
+            size_t indent = line.find_first_not_of(' ');
+            std::string_view content = Trim(line);
+
+            if (content.front() == '-') {
+                // Elemento di lista: le chiavi padre restano, la riga non apre né chiude mappe
+                if (list_owner.empty() || indent < list_indent) {
+                    error = "riga " + std::to_string(line_number) + ": elemento di lista senza chiave";
+                    return false;
+                }
+                std::string& value = out[list_owner];
+                if (!value.empty()) value += ',';
+                value += unquote(Trim(content.substr(1)));
+                continue;
+            }
+            list_owner.clear();
+            while (!parents.empty() && parents.back().first >= indent) parents.pop_back();
+            const std::string prefix = parents.empty() ? std::string() : parents.back().second;
+            size_t colon = content.find(':');
+            if (colon == std::string_view::npos) {
+                error = "riga " + std::to_string(line_number) + ": attesa 'chiave: valore'";
+                return false;
+            }
+            std::string name = prefix + SettingName(Trim(content.substr(0, colon)));
+            std::string_view value = Trim(content.substr(colon + 1));
+            if (value.empty()) {
+                parents.emplace_back(indent, name + "_");
+                list_owner = name;
+                list_indent = indent;
+                continue;
+            }
+            if (value.front() == '[' && value.back() == ']') {
+                std::string joined;
+                value = value.substr(1, value.size() - 2);
+                while (!value.empty()) {
+                    size_t comma = value.find(',');
+                    std::string_view item = Trim(value.substr(0, comma));
+                    value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+                    if (item.empty()) continue;
+                    if (!joined.empty()) joined += ',';
+                    joined += unquote(item);
+                }
+                out[name] = std::move(joined);
+                continue;
+            }
+            out[name] = unquote(value);
+        }
+        return true;
+    }
+
+    // Legge un file di configurazione nel formato indicato dall'estensione.
+    inline bool LoadFile(const std::string& path, Values& out, std::string& error) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            error = path + ": " + std::strerror(errno);
+            return false;
+        }
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        auto has_extension = [&path](std::string_view extension) {
+            return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+        };
+        bool parsed;
+        if (has_extension(".json")) parsed = ParseJson(text, out, error);
+        else if (has_extension(".yaml") || has_extension(".yml")) parsed = ParseYaml(text, out, error);
+        else parsed = ParseKeyValue(text, out, error);
+        if (!parsed) error = path + ": " + error;
+        return parsed;
+    }
+
+    // Impostazioni del processo. Load() va chiamato una volta all'inizio di main(), prima di
+    // creare altri thread; dopo è di sola lettura e Get() si può chiamare da qualsiasi thread.
+    // Senza Load() (es. nei benchmark) Get() equivale a std::getenv.
+    class Settings {
+    private:
+        Values command_line;
+        Values file;
+        std::string file_path;
+        bool help = false;
+
+        // WEBSERVER_ viene aggiunto ai flag senza uno dei prefissi noti.
+        static std::string FlagSetting(std::string_view flag) {
+            std::string name = SettingName(flag);
+            for (std::string_view prefix : { "WEBSERVER_", "OTEL_", "LOG_" }) {
+                if (name.compare(0, prefix.size(), prefix) == 0) return name;
+            }
+            return "WEBSERVER_" + name;
+        }
+
+    public:
+        static Settings& Instance() {
+            static Settings settings;
+            return settings;
+        }
+
+        // Legge i flag della riga di comando e il file di configurazione. false con l'errore
+        // in `error` se un argomento non è un flag o il file non è leggibile.
+        bool Load(int argc, char** argv, std::string& error) {
+            std::string config_path;
+            for (int i = 1; i < argc; ++i) {
+                std::string_view arg = argv[i];
+                if (arg == "-h" || arg == "--help") {
+                    help = true;
+                    continue;
+                }
+                if (arg.size() <= 2 || arg.substr(0, 2) != "--") {
+                    error = "argomento non riconosciuto: " + std::string(arg);
+                    return false;
+                }
+                arg.remove_prefix(2);
+                std::string value;
+                size_t equals = arg.find('=');
+                if (equals != std::string_view::npos) {
+                    value.assign(arg.substr(equals + 1));
+                    arg = arg.substr(0, equals);
+                }
+                else if (i + 1 < argc && std::string_view(argv[i + 1]).substr(0, 2) != "--") {
+                    value = argv[++i];
+                }
+                else {
+                    value = "1"; // Flag booleano, es. --reuse-port
+                }
+                if (arg == "config") config_path = value;
+                else command_line[FlagSetting(arg)] = std::move(value);
+            }
+            if (config_path.empty()) {
+                if (const char* v = std::getenv("WEBSERVER_CONFIG_FILE")) config_path = v;
+            }
+            if (!config_path.empty() && !LoadFile(config_path, file, error)) return false;
+            file_path = config_path;
+            return true;
+        }
+
+        // Valore dell'impostazione (riga di comando, ambiente, file); nullptr se assente.
+        const char* Get(const char* name) const {
+            auto it = command_line.find(name);
+            if (it != command_line.end()) return it->second.c_str();
+            if (const char* v = std::getenv(name)) return v;
+            it = file.find(name);
+            return it != file.end() ? it->second.c_str() : nullptr;
+        }
+
+        bool HelpRequested() const { return help; }
+        const std::string& FilePath() const { return file_path; }
+
+        static const char* Usage() {
+            return "Uso: webserver [--config FILE] [--nome=valore ...]\n"
+                "  Ogni impostazione WEBSERVER_*, OTEL_* o LOG_* si può passare come flag:\n"
+                "  --port=9090 (WEBSERVER_PORT), --threads=16, --listeners=4, --reuse-port,\n"
+                "  --otel-traces-sampler=traceidratio --otel-traces-sampler-arg=0.1,\n"
+                "  --otel-exporter-otlp-endpoint=http://collector:4318, --log-level=debug.\n"
+                "  Precedenza: riga di comando, ambiente, file (--config o WEBSERVER_CONFIG_FILE;\n"
+                "  JSON, YAML o righe NOME=valore).\n";
+        }
+    };
+
+    // Valore di un'impostazione; vedi Settings::Get.
+    inline const char* Get(const char* name) {
+        return Settings::Instance().Get(name);
+    }
+
+} // namespace config
+
+// --- Implementazione Minimale di OpenTelemetry ---
+// NOTA: Questa è una implementazione estremamente semplificata e *custom*
+// del concetto di OpenTelemetry. NON è la libreria ufficiale OpenTelemetry C++.
+// Serve solo a dimostrare i concetti di Span e Metriche logging le informazioni su console.
+// In una vera applicazione, si userebbe l'SDK ufficiale che esporta i dati a un Collector.
+// Link utile (SDK ufficiale OpenTelemetry C++): https://opentelemetry.io/docs/instrumentation/cpp/
+
+namespace otel {
+
+    // Tracing (span, propagazione, pipeline di export): con 0 gli Span non registrano mai,
+    // il TracerProvider non avvia il proprio thread e metriche ed esemplari restano attivi.
+    constexpr bool kTracingEnabled = OTEL_ENABLE_TRACING != 0;
+    // Attributi stringa degli span (metodo, percorso, IP...): con 0 restano solo quelli numerici.
+    constexpr bool kStringAttributesEnabled = OTEL_ENABLE_STRING_ATTRIBUTES != 0;
+
+    // Dimensione di una cache line: i dati scritti da thread diversi vengono
+    // allineati a questo valore per evitare false sharing.
+    constexpr size_t kCacheLineSize = 64;
+
+    // Identificatori W3C/OTLP: 16 byte per la traccia, 8 per lo span, tenuti inline
+    // (nessuna allocazione). Un ID tutto a zero è considerato non valido.
+    using TraceId = std::array<uint8_t, 16>;
+    using SpanId = std::array<uint8_t, 8>;
+
+    // Generatore pseudo-casuale xoshiro256** (Blackman & Vigna): poche operazioni
+    // su 4 registri a 64 bit, periodo 2^256-1. NON è crittograficamente sicuro,
+    // ma è più che adeguato per ID di tracce che devono solo non collidere.
+    // Link utile: https://prng.di.unimi.it/
+    class Xoshiro256 {
+    private:
+        uint64_t state[4];
+
+        static uint64_t Rotl(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        // splitmix64: espande un seed a 64 bit nei 256 bit di stato
+        static uint64_t SplitMix64(uint64_t& x) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+    public:
+        explicit Xoshiro256(uint64_t seed) {
+            for (auto& word : state) word = SplitMix64(seed);
+        }
+
+        uint64_t Next() {
+            const uint64_t result = Rotl(state[1] * 5, 7) * 9;
+            const uint64_t t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = Rotl(state[3], 45);
+            return result;
+        }
+    };
+
+    template <size_t N>
+    inline bool IsZeroId(const std::array<uint8_t, N>& id) {
+        for (uint8_t byte : id) if (byte != 0) return false;
+        return true;
+    }
+
+    // Generatore di ID per thread: ogni thread ha il proprio Xoshiro256, inizializzato
+    // una sola volta con entropia del sistema operativo (std::random_device), quindi
+    // la generazione non usa lock ed è thread-safe (a differenza di std::rand).
+    class IdGenerator {
+    private:
+        static Xoshiro256& ThreadRng() {
+            thread_local Xoshiro256 rng([] {
+                std::random_device rd;
+                return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+            }());
+            return rng;
+        }
+
+        static void Fill(uint8_t* out, size_t size) {
+            Xoshiro256& rng = ThreadRng();
+            for (size_t i = 0; i < size; i += 8) {
+                uint64_t value = rng.Next();
+                std::memcpy(out + i, &value, std::min<size_t>(8, size - i));
+            }
+        }
+
+    public:
+        // Numero casuale a 64 bit dallo stesso generatore (usato dai sampler).
+        static uint64_t NextRandom() {
+            return ThreadRng().Next();
+        }
+
+        static TraceId NewTraceId() {
+            TraceId id;
+            do { Fill(id.data(), id.size()); } while (IsZeroId(id));
+            return id;
+        }
+
+        static SpanId NewSpanId() {
+            SpanId id;
+            do { Fill(id.data(), id.size()); } while (IsZeroId(id));
+            return id;
+        }
+    };
+
+    // Codifica esadecimale table-driven: una tabella di 256 coppie di caratteri,
+    // un lookup per byte. Usata solo al momento dell'export (console, log, header).
+    inline void AppendHex(std::string& out, const uint8_t* data, size_t size) {
+        static const char kTable[] =
+            "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+            "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+            "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+            "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+            "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+            "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+            "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+            "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+        size_t offset = out.size();
+        out.resize(offset + size * 2);
+        for (size_t i = 0; i < size; ++i) {
+            std::memcpy(&out[offset + i * 2], &kTable[data[i] * 2], 2);
+        }
+    }
+
+    template <size_t N>
+    inline std::string ToHex(const std::array<uint8_t, N>& id) {
+        std::string out;
+        out.reserve(N * 2);
+        AppendHex(out, id.data(), N);
+        return out;
+    }
+
+    // Bit "sampled" del campo trace-flags W3C: se assente la traccia non viene registrata.
+    constexpr uint8_t kTraceFlagSampled = 0x01;
+
+    // Rappresenta il contesto di una traccia e di uno span.
+    // Identifica in modo univoco uno span e la traccia a cui appartiene.
+    class SpanContext {
+    public:
+        TraceId trace_id{};      // Identificatore unico della traccia
+        SpanId span_id{};        // Identificatore unico dello span all'interno della traccia
+        uint8_t trace_flags = 0; // trace-flags W3C (bit 0: sampled)
+        bool is_remote = false;  // true se il contesto arriva da un header di un altro servizio
+        std::string trace_state; // Header tracestate, propagato così com'è (vuoto nel caso comune)
+
+        // Contesto vuoto (non valido): usato per le strutture pre-allocate, non genera ID.
+        SpanContext() = default;
+
+        // Crea un contesto con nuovi ID casuali (pochi nanosecondi, nessuna allocazione).
+        static SpanContext CreateRandom() {
+            SpanContext context;
+            context.trace_id = IdGenerator::NewTraceId();
+            context.span_id = IdGenerator::NewSpanId();
+            context.trace_flags = kTraceFlagSampled;
+            return context;
+        }
+
+        bool IsValid() const { return !IsZeroId(trace_id) && !IsZeroId(span_id); }
+        bool IsSampled() const { return (trace_flags & kTraceFlagSampled) != 0; }
+    };
+
+    // Propagazione del contesto secondo W3C Trace Context:
+    //   traceparent: 00-<trace-id 32 hex>-<parent-id 16 hex>-<trace-flags 2 hex>
+    //   tracestate:  lista vendor-specific, non interpretata ma inoltrata.
+    // Link utile: https://www.w3.org/TR/trace-context/
+    class TraceContext {
+    private:
+        static constexpr size_t kTraceparentSize = 55;
+        static constexpr size_t kMaxTraceStateSize = 512; // Limite minimo garantito dalla specifica
+
+        // Converte una cifra esadecimale minuscola (la specifica non ammette maiuscole).
+        static int HexValue(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            return -1;
+        }
+
+        static bool ParseHex(const char* in, uint8_t* out, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                int high = HexValue(in[i * 2]);
+                int low = HexValue(in[i * 2 + 1]);
+                if (high < 0 || low < 0) return false;
+                out[i] = static_cast<uint8_t>((high << 4) | low);
+            }
+            return true;
+        }
+
+    public:
+        // Estrae il contesto remoto dagli header; restituisce un contesto non valido
+        // (IsValid() == false) se traceparent è assente o malformato.
+        // Lavora direttamente sulla stringa dell'header, senza allocazioni.
+        static SpanContext Extract(const std::string& traceparent, const std::string& tracestate = std::string()) {
+            SpanContext context;
+            // Versioni future possono aggiungere campi in coda: si leggono solo i primi 55 caratteri
+            if (traceparent.size() < kTraceparentSize) return context;
+            const char* p = traceparent.data();
+            uint8_t version;
+            if (!ParseHex(p, &version, 1) || version == 0xff) return context;
+            if (version == 0 && traceparent.size() != kTraceparentSize) return context;
+            if (traceparent.size() > kTraceparentSize && p[kTraceparentSize] != '-') return context;
+            if (p[2] != '-' || p[35] != '-' || p[52] != '-') return context;
+
+            SpanContext parsed;
+            if (!ParseHex(p + 3, parsed.trace_id.data(), parsed.trace_id.size()) ||
+                !ParseHex(p + 36, parsed.span_id.data(), parsed.span_id.size()) ||
+                !ParseHex(p + 53, &parsed.trace_flags, 1) ||
+                !parsed.IsValid()) {
+                return context;
+            }
+            parsed.is_remote = true;
+            if (tracestate.size() <= kMaxTraceStateSize) parsed.trace_state = tracestate;
+            return parsed;
+        }
+
+        // Formatta il contesto come valore dell'header traceparent (versione 00).
+        static std::string Traceparent(const SpanContext& context) {
+            std::string out;
+            out.reserve(kTraceparentSize);
+            out += "00-";
+            AppendHex(out, context.trace_id.data(), context.trace_id.size());
+            out += '-';
+            AppendHex(out, context.span_id.data(), context.span_id.size());
+            out += '-';
+            AppendHex(out, &context.trace_flags, 1);
+            return out;
+        }
+
+        // Inietta il contesto negli header di una richiesta/risposta (qualsiasi tipo con set_header).
+        template <typename Message>
+        static void Inject(const SpanContext& context, Message& message, const char* header = "traceparent") {
+            if (!context.IsValid()) return;
+            message.set_header(header, Traceparent(context));
+            if (!context.trace_state.empty()) message.set_header("tracestate", context.trace_state);
+        }
+    };
+
+    // Ruolo dello span nella traccia (valori dell'enum SpanKind di OTLP).
+    enum class SpanKind : uint8_t {
+        Internal = 1, // Operazione interna al processo (default per gli span figli)
+        Server = 2,   // Gestione di una richiesta in ingresso
+        Client = 3    // Chiamata verso un altro servizio
+    };
+
+    // Stringa con durata statica: un letterale (chiavi e nomi noti a compile time) oppure
+    // una stringa internata con Intern(). Copiarla costa come copiare un puntatore e una
+    // lunghezza; usata per le chiavi degli attributi e i nomi degli span.
+    class StaticString {
+    private:
+        std::string_view text;
+
+        constexpr explicit StaticString(std::string_view t, int) : text(t) {}
+
+    public:
+        constexpr StaticString() = default;
+
+        // Da un letterale stringa: nessuna copia (il letterale vive per tutto il programma).
+        // NON usare con array di caratteri locali.
+        template <size_t N>
+        constexpr StaticString(const char (&literal)[N]) : text(literal, N - 1) {}
+
+        // Interna una stringa dinamica: la copia vive fino alla fine del programma
+        // e le chiamate successive con lo stesso testo restituiscono la stessa copia.
+        // Richiede un lock: da usare all'avvio o comunque fuori dai percorsi caldi.
+        static StaticString Intern(std::string_view value) {
+            static std::mutex mutex;
+            static std::unordered_set<std::string> pool;
+            std::lock_guard<std::mutex> lock(mutex);
+            return StaticString(*pool.emplace(value).first, 0);
+        }
+
+        constexpr std::string_view View() const { return text; }
+        constexpr operator std::string_view() const { return text; }
+    };
+
+    using AttributeKey = StaticString;
+
+    // Valore tipizzato di un attributo (int64, double, bool o stringa), come l'AnyValue di OTLP.
+    // I numeri restano numeri fino all'export; le stringhe brevi (la quasi totalità: metodi,
+    // path, indirizzi IP) vengono copiate in un buffer interno, senza allocazioni.
+    class AttributeValue {
+    public:
+        enum class Type : uint8_t { Int, Double, Bool, String };
+        static constexpr size_t kInlineText = 46;
+
+    private:
+        Type type = Type::Int;
+        uint8_t inline_size = 0;
+        union {
+            int64_t int_value;
+            double double_value;
+            bool bool_value;
+            char inline_text[kInlineText];
+        };
+        std::string long_text; // Solo per le stringhe più lunghe di kInlineText
+
+        void SetText(std::string_view value) {
+            type = Type::String;
+            if (value.size() <= kInlineText) {
+                std::memcpy(inline_text, value.data(), value.size());
+                inline_size = static_cast<uint8_t>(value.size());
+            }
+            else {
+                long_text.assign(value.data(), value.size());
+            }
+        }
+
+    public:
+        AttributeValue() : int_value(0) {}
+        AttributeValue(bool value) : type(Type::Bool), bool_value(value) {}
+        AttributeValue(double value) : type(Type::Double), double_value(value) {}
+        AttributeValue(float value) : type(Type::Double), double_value(value) {}
+        template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+        AttributeValue(T value) : type(Type::Int), int_value(static_cast<int64_t>(value)) {}
+        AttributeValue(std::string_view value) : int_value(0) { SetText(value); }
+        AttributeValue(const std::string& value) : AttributeValue(std::string_view(value)) {}
+        AttributeValue(const char* value) : AttributeValue(std::string_view(value)) {}
+
+        AttributeValue(const AttributeValue&) = default;
+        AttributeValue& operator=(const AttributeValue&) = default;
+        AttributeValue(AttributeValue&&) = default;
+        AttributeValue& operator=(AttributeValue&&) = default;
+
+        Type GetType() const { return type; }
+        int64_t GetInt() const { return int_value; }
+        double GetDouble() const { return double_value; }
+        bool GetBool() const { return bool_value; }
+        std::string_view GetString() const {
+            return inline_size > 0 || long_text.empty() ? std::string_view(inline_text, inline_size) : std::string_view(long_text);
+        }
+
+        // Formattazione testuale, eseguita solo al momento dell'export.
+        void AppendTo(std::string& out) const {
+            char buffer[32];
+            switch (type) {
+            case Type::Int: {
+                auto result = std::to_chars(buffer, buffer + sizeof(buffer), int_value);
+                out.append(buffer, result.ptr);
+                break;
+            }
+            case Type::Double:
+                out.append(buffer, static_cast<size_t>(std::snprintf(buffer, sizeof(buffer), "%.9g", double_value)));
+                break;
+            case Type::Bool:
+                out += bool_value ? "true" : "false";
+                break;
+            case Type::String: {
+                std::string_view text = GetString();
+                out.append(text.data(), text.size());
+                break;
+            }
+            }
+        }
+    };
+
+    // Rappresenta un attributo chiave-valore associato a uno span.
+    struct Attribute {
+        AttributeKey key;
+        AttributeValue value;
+    };
+
+    // Lista di attributi con spazio per kInline elementi all'interno dell'oggetto:
+    // nel caso comune (i 5-6 attributi HTTP degli handler) non serve alcuna allocazione.
+    // Oltre questa soglia gli attributi proseguono in un vector.
+    class AttributeList {
+    public:
+        static constexpr size_t kInline = 8;
+
+    private:
+        std::array<Attribute, kInline> inline_items;
+        size_t inline_count = 0;
+        std::vector<Attribute> overflow;
+
+    public:
+        void Add(AttributeKey key, AttributeValue&& value) {
+            if (inline_count < kInline) {
+                inline_items[inline_count].key = key;
+                inline_items[inline_count].value = std::move(value);
+                ++inline_count;
+            }
+            else {
+                overflow.push_back(Attribute{ key, std::move(value) });
+            }
+        }
+
+        size_t Size() const { return inline_count + overflow.size(); }
+        bool Empty() const { return Size() == 0; }
+
+        void Clear() {
+            inline_count = 0;
+            overflow.clear();
+        }
+
+        template <typename Fn>
+        void ForEach(Fn fn) const {
+            for (size_t i = 0; i < inline_count; ++i) fn(inline_items[i]);
+            for (const auto& attr : overflow) fn(attr);
+        }
+    };
+
+    // Esito dell'operazione rappresentata dallo span (valori dello Status.StatusCode di OTLP).
+    enum class StatusCode : uint8_t {
+        Unset = 0, // Default: nessun esito esplicito
+        Ok = 1,
+        Error = 2  // Lo span è sempre conservato dal tail sampling
+    };
+
+    // Dati immutabili di uno span terminato, consegnati alla pipeline di export.
+    // Lo Span "vivo" appartiene al thread della richiesta; una volta chiamato End()
+    // i suoi dati vengono spostati (non copiati) in questa struttura.
+    struct SpanData {
+        StaticString name;
+        SpanContext context;
+        SpanId parent_span_id{};           // Tutto a zero per gli span radice
+        SpanKind kind = SpanKind::Internal;
+        StatusCode status = StatusCode::Unset;
+        bool local_root = false;           // Primo span della traccia in questo processo (genitore assente o remoto)
+        uint64_t start_time_unix_nano = 0; // Inizio dello span (epoch Unix, ns) per l'export OTLP
+        uint64_t end_time_unix_nano = 0;   // Fine dello span (epoch Unix, ns)
+        std::chrono::nanoseconds duration{ 0 };
+        AttributeList attributes;
+    };
+
+    // Interfaccia di un exporter di span: riceve un batch di span terminati.
+    // Viene invocato SOLO dal thread in background del processor, mai dai thread delle richieste.
+    class SpanExporter {
+    public:
+        virtual ~SpanExporter() = default;
+        // Restituisce false se l'export del batch è fallito.
+        virtual bool Export(const std::vector<SpanData>& batch) = 0;
+    };
+
+    // Exporter che scrive gli span su console (stdout), come faceva in origine Span::End().
+    // L'intero batch viene formattato in un unico buffer e scritto con un solo flush,
+    // invece di due `std::endl` per ogni span.
+    class ConsoleSpanExporter : public SpanExporter {
+    public:
+        bool Export(const std::vector<SpanData>& batch) override {
+            std::string out;
+            out.reserve(batch.size() * 256);
+            for (const auto& span : batch) {
+                // Durata in millisecondi, per mantenere il formato storico dei log
+                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(span.duration).count();
+                out += "[OTEL] Span: ";
+                out += span.name.View();
+                out += ", TraceID: ";
+                AppendHex(out, span.context.trace_id.data(), span.context.trace_id.size());
+                out += ", SpanID: ";
+                AppendHex(out, span.context.span_id.data(), span.context.span_id.size());
+                if (!IsZeroId(span.parent_span_id)) {
+                    out += ", ParentID: ";
+                    AppendHex(out, span.parent_span_id.data(), span.parent_span_id.size());
+                }
+                out += ", Duration: " + std::to_string(duration) + "ms\n";
+
+                out += "[OTEL] Attributes: ";
+                span.attributes.ForEach([&](const Attribute& attr) {
+                    out += attr.key.View();
+                    out += '=';
+                    attr.value.AppendTo(out);
+                    out += ' ';
+                });
+                out += "\n";
+            }
+            std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+            std::cout.flush();
+            return static_cast<bool>(std::cout);
+        }
+    };
+
+    // Exporter che scarta gli span (OTEL_TRACES_EXPORTER=none): contesto e propagazione
+    // restano attivi, ma nulla viene scritto.
+    class NoopSpanExporter : public SpanExporter {
+    public:
+        bool Export(const std::vector<SpanData>&) override { return true; }
+    };
+
+    // Coda limitata lock-free multi-producer/multi-consumer (algoritmo di D. Vyukov).
+    // Ogni cella ha un numero di sequenza che indica se è libera per il produttore
+    // o pronta per il consumatore: push e pop sono un singolo CAS sull'indice, senza mutex.
+    // La capacità viene arrotondata alla potenza di 2 successiva.
+    template <typename T>
+    class BoundedQueue {
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        // Indici su cache line separate per evitare false sharing tra produttori e consumatore
+        alignas(64) std::atomic<size_t> enqueue_pos{ 0 };
+        alignas(64) std::atomic<size_t> dequeue_pos{ 0 };
+        alignas(64) std::unique_ptr<Cell[]> buffer;
+        size_t mask;
+
+        static size_t RoundUpPow2(size_t n) {
+            size_t p = 2;
+            while (p < n) p <<= 1;
+            return p;
+        }
+
+    public:
+        explicit BoundedQueue(size_t capacity)
+            : buffer(new Cell[RoundUpPow2(capacity)]), mask(RoundUpPow2(capacity) - 1) {
+            for (size_t i = 0; i <= mask; ++i) {
+                buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        // Inserisce un elemento; restituisce false (senza bloccare) se la coda è piena.
+        bool TryPush(T&& value) {
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& cell = buffer[pos & mask];
+                size_t seq = cell.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        cell.data = std::move(value);
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false; // Coda piena
+                }
+                else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Estrae un elemento; restituisce false se la coda è vuota.
+        bool TryPop(T& out) {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& cell = buffer[pos & mask];
+                size_t seq = cell.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        out = std::move(cell.data);
+                        cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false; // Coda vuota
+                }
+                else {
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Numero approssimato di elementi in coda (solo a scopo di monitoraggio/soglia).
+        size_t ApproxSize() const {
+            size_t head = dequeue_pos.load(std::memory_order_relaxed);
+            size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+            return tail >= head ? tail - head : 0;
+        }
+
+        size_t Capacity() const { return mask + 1; }
+    };
+
+    // Interfaccia di un processor: riceve ogni span nel momento in cui termina.
+    // OnEnd() viene chiamato sul thread della richiesta, quindi deve essere economico.
+    class SpanProcessor {
+    public:
+        virtual ~SpanProcessor() = default;
+        virtual void OnEnd(SpanData&& span) = 0;
+        virtual void Shutdown() = 0;
+    };
+
+    // Opzioni del tail sampling: disattivato per default.
+    struct TailSamplingOptions {
+        bool enabled = false;
+        std::chrono::nanoseconds latency_threshold = std::chrono::milliseconds(100); // Tracce da conservare se uno span dura almeno tanto
+        bool keep_errors = true;                          // Conserva le tracce con uno span in StatusCode::Error
+        std::chrono::milliseconds decision_wait{ 5000 };  // Attesa massima dello span radice prima di decidere
+        size_t max_pending_traces = 4096;                 // Tracce in attesa oltre le quali si decide span per span
+    };
+
+    // Buffer di tail sampling: raggruppa gli span per traccia finché termina lo span radice
+    // locale (l'ultimo a terminare, grazie all'ordine LIFO degli span), poi conserva l'intera
+    // traccia solo se contiene uno span lento o in errore. Usato esclusivamente dal thread
+    // in background del BatchSpanProcessor, quindi non richiede sincronizzazione.
+    class TailSampler {
+    private:
+        struct TraceIdHash {
+            size_t operator()(const TraceId& id) const {
+                uint64_t low;
+                std::memcpy(&low, id.data() + 8, sizeof(low)); // Gli ID sono già casuali
+                return static_cast<size_t>(low);
+            }
+        };
+
+        struct PendingTrace {
+            std::vector<SpanData> spans;
+            bool keep = false;
+            std::chrono::steady_clock::time_point first_seen;
+        };
+
+        TailSamplingOptions options;
+        std::unordered_map<TraceId, PendingTrace, TraceIdHash> pending;
+        std::atomic<uint64_t> dropped{ 0 }; // Scritto dal worker, letto da /metrics
+
+        bool IsInteresting(const SpanData& span) const {
+            return span.duration >= options.latency_threshold ||
+                (options.keep_errors && span.status == StatusCode::Error);
+        }
+
+        void Decide(PendingTrace& trace, std::vector<SpanData>& out) {
+            if (trace.keep) {
+                for (auto& span : trace.spans) out.push_back(std::move(span));
+            }
+            else {
+                dropped.fetch_add(trace.spans.size(), std::memory_order_relaxed);
+            }
+        }
+
+    public:
+        explicit TailSampler(const TailSamplingOptions& opts) : options(opts) {}
+
+        // Accoda uno span terminato; gli span delle tracce decise da conservare finiscono in `out`.
+        void Add(SpanData&& span, std::vector<SpanData>& out) {
+            auto it = pending.find(span.context.trace_id);
+            if (it == pending.end()) {
+                if (span.local_root || pending.size() >= options.max_pending_traces) {
+                    // Traccia di un solo span (o buffer pieno): decisione immediata
+                    if (IsInteresting(span)) out.push_back(std::move(span));
+                    else dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                it = pending.emplace(span.context.trace_id, PendingTrace()).first;
+                it->second.first_seen = std::chrono::steady_clock::now();
+            }
+            PendingTrace& trace = it->second;
+            trace.keep = trace.keep || IsInteresting(span);
+            bool complete = span.local_root;
+            trace.spans.push_back(std::move(span));
+            if (complete) {
+                Decide(trace, out);
+                pending.erase(it);
+            }
+        }
+
+        // Decide le tracce in attesa da più di decision_wait con gli span ricevuti finora.
+        void Expire(std::chrono::steady_clock::time_point now, std::vector<SpanData>& out) {
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (now - it->second.first_seen >= options.decision_wait) {
+                    Decide(it->second, out);
+                    it = pending.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+
+        // Allo spegnimento: decide tutte le tracce ancora in attesa.
+        void Flush(std::vector<SpanData>& out) {
+            for (auto& pair : pending) Decide(pair.second, out);
+            pending.clear();
+        }
+
+        uint64_t GetDroppedSpans() const { return dropped.load(std::memory_order_relaxed); }
+    };
+
+    // Opzioni del BatchSpanProcessor. I default ricalcano il processor `batch`
+    // configurato in otel-collector-config.yaml (timeout: 1s).
+    struct BatchSpanProcessorOptions {
+        size_t max_queue_size = 2048;                      // Capacità della coda lock-free
+        size_t max_export_batch_size = 512;                // Span massimi per singola chiamata a Export
+        std::chrono::milliseconds schedule_delay{ 1000 };  // Intervallo massimo tra due export
+        bool drop_on_full = true;                          // true: scarta se la coda è piena; false: il chiamante attende
+        TailSamplingOptions tail_sampling;                 // Filtro opzionale applicato dal worker prima dell'export
+
+        // Variabili standard OTEL_BSP_MAX_QUEUE_SIZE, OTEL_BSP_MAX_EXPORT_BATCH_SIZE e
+        // OTEL_BSP_SCHEDULE_DELAY (ms); con OTEL_TRACES_TAIL_LATENCY_MS vengono esportate solo
+        // le tracce con almeno uno span più lento della soglia (o in errore).
+        static BatchSpanProcessorOptions FromEnvironment() {
+            BatchSpanProcessorOptions options;
+            if (const char* v = config::Get("OTEL_BSP_MAX_QUEUE_SIZE")) options.max_queue_size = std::max<size_t>(1, std::strtoul(v, nullptr, 10));
+            if (const char* v = config::Get("OTEL_BSP_MAX_EXPORT_BATCH_SIZE")) options.max_export_batch_size = std::max<size_t>(1, std::strtoul(v, nullptr, 10));
+            if (const char* v = config::Get("OTEL_BSP_SCHEDULE_DELAY")) {
+                long delay_ms = std::atol(v);
+                if (delay_ms > 0) options.schedule_delay = std::chrono::milliseconds(delay_ms); // 0: il thread girerebbe a vuoto
+            }
+            options.max_export_batch_size = std::min(options.max_export_batch_size, options.max_queue_size);
+            if (const char* v = config::Get("OTEL_TRACES_TAIL_LATENCY_MS")) {
+                options.tail_sampling.enabled = true;
+                options.tail_sampling.latency_threshold = std::chrono::microseconds(static_cast<int64_t>(std::atof(v) * 1000));
+            }
+            return options;
+        }
+    };
+
+    // Processor che accoda gli span terminati in una BoundedQueue e li esporta
+    // a batch da un thread in background, per dimensione (max_export_batch_size)
+    // o per tempo (schedule_delay), come il processor `batch` del Collector.
+    class BatchSpanProcessor : public SpanProcessor {
+    private:
+        std::unique_ptr<SpanExporter> exporter;
+        BatchSpanProcessorOptions options;
+        BoundedQueue<SpanData> queue;
+        std::unique_ptr<TailSampler> tail_sampler; // nullptr se il tail sampling è disattivato
+
+        // Contatori della pipeline (letti da /metrics)
+        std::atomic<uint64_t> spans_dropped{ 0 };
+        std::atomic<uint64_t> spans_exported{ 0 };
+        std::atomic<uint64_t> export_failures{ 0 };
+
+        // Sincronizzazione con il worker: il mutex serve solo alla condition_variable,
+        // i produttori lo toccano esclusivamente quando la coda raggiunge la soglia di batch.
+        std::mutex worker_mutex;
+        std::condition_variable worker_cv;
+        std::atomic<bool> batch_ready{ false };
+        std::atomic<bool> running{ true };
+        std::thread worker;
+
+        void NotifyWorker() {
+            // Evita notifiche ripetute finché il worker non ha consumato il batch
+            if (!batch_ready.exchange(true, std::memory_order_acq_rel)) {
+                std::lock_guard<std::mutex> lock(worker_mutex);
+                worker_cv.notify_one();
+            }
+        }
+
+        void ExportBatch(const std::vector<SpanData>& batch) {
+            if (batch.empty()) return;
+            if (exporter->Export(batch)) {
+                spans_exported.fetch_add(batch.size(), std::memory_order_relaxed);
+            }
+            else {
+                export_failures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Svuota la coda esportando batch di al massimo max_export_batch_size span estratti.
+        // Con il tail sampling il batch contiene solo gli span delle tracce conservate
+        // (può superare la dimensione massima quando si completa una traccia lunga).
+        void Drain(std::vector<SpanData>& batch) {
+            SpanData span;
+            for (;;) {
+                batch.clear();
+                size_t popped = 0;
+                while (popped < options.max_export_batch_size && queue.TryPop(span)) {
+                    ++popped;
+                    if (tail_sampler) tail_sampler->Add(std::move(span), batch);
+                    else batch.push_back(std::move(span));
+                }
+                if (tail_sampler) tail_sampler->Expire(std::chrono::steady_clock::now(), batch);
+                ExportBatch(batch);
+                if (popped < options.max_export_batch_size) return;
+            }
+        }
+
+        void WorkerLoop() {
+            std::vector<SpanData> batch;
+            batch.reserve(options.max_export_batch_size);
+            while (running.load(std::memory_order_acquire)) {
+                {
+                    std::unique_lock<std::mutex> lock(worker_mutex);
+                    worker_cv.wait_for(lock, options.schedule_delay, [this] {
+                        return batch_ready.load(std::memory_order_acquire) || !running.load(std::memory_order_acquire);
+                    });
+                }
+                batch_ready.store(false, std::memory_order_release);
+                Drain(batch);
+            }
+            // Flush finale degli span rimasti in coda allo spegnimento
+            Drain(batch);
+            if (tail_sampler) {
+                batch.clear();
+                tail_sampler->Flush(batch);
+                ExportBatch(batch);
+            }
+        }
+
+    public:
+        BatchSpanProcessor(std::unique_ptr<SpanExporter> exp, const BatchSpanProcessorOptions& opts = {})
+            : exporter(std::move(exp)), options(opts), queue(opts.max_queue_size) {
+            if (options.max_export_batch_size == 0 || options.max_export_batch_size > queue.Capacity()) {
+                options.max_export_batch_size = queue.Capacity();
+            }
+            if (options.tail_sampling.enabled) {
+                tail_sampler = std::make_unique<TailSampler>(options.tail_sampling);
+            }
+            worker = std::thread(&BatchSpanProcessor::WorkerLoop, this);
+        }
+
+        ~BatchSpanProcessor() override {
+            Shutdown();
+        }
+
+        // Chiamato dal thread della richiesta: un push lock-free nel caso comune.
+        void OnEnd(SpanData&& span) override {
+            if (!queue.TryPush(std::move(span))) {
+                if (options.drop_on_full) {
+                    spans_dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                // Modalità bloccante: sveglia il worker e attende che si liberi spazio.
+                // Lo span è ancora valido: TryPush lo sposta solo in caso di successo.
+                NotifyWorker();
+                while (!queue.TryPush(std::move(span))) {
+                    if (!running.load(std::memory_order_acquire)) {
+                        spans_dropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    std::this_thread::yield();
+                }
+            }
+            if (queue.ApproxSize() >= options.max_export_batch_size) {
+                NotifyWorker();
+            }
+        }
+
+        // Ferma il worker dopo aver esportato gli span rimasti. Idempotente.
+        void Shutdown() override {
+            if (running.exchange(false, std::memory_order_acq_rel)) {
+                {
+                    std::lock_guard<std::mutex> lock(worker_mutex);
+                    worker_cv.notify_one();
+                }
+                if (worker.joinable()) worker.join();
+            }
+        }
+
+        uint64_t GetDroppedSpans() const { return spans_dropped.load(std::memory_order_relaxed); }
+        uint64_t GetExportedSpans() const { return spans_exported.load(std::memory_order_relaxed); }
+        uint64_t GetExportFailures() const { return export_failures.load(std::memory_order_relaxed); }
+        size_t GetQueueSize() const { return queue.ApproxSize(); }
+        size_t GetQueueCapacity() const { return queue.Capacity(); }
+        uint64_t GetTailDroppedSpans() const { return tail_sampler ? tail_sampler->GetDroppedSpans() : 0; }
+
+        bool HasTailSampler() const { return tail_sampler != nullptr; }
+    };
+
+    // --- Campionamento (head sampling) ---
+    // La decisione viene presa alla creazione dello span, prima di generare ID o
+    // raccogliere attributi: uno span scartato non costa quasi nulla.
+    // Link utile: https://opentelemetry.io/docs/specs/otel/trace/sdk/#sampler
+
+    // Interfaccia di un sampler. Viene chiamato sul thread della richiesta per ogni span,
+    // quindi deve essere economico e thread-safe.
+    class Sampler {
+    public:
+        virtual ~Sampler() = default;
+        // parent: contesto del genitore (remoto o locale), nullptr per gli span radice.
+        // name: nome dello span (negli handler identifica la route).
+        virtual bool ShouldSample(const SpanContext* parent, std::string_view name) = 0;
+    };
+
+    class AlwaysOnSampler : public Sampler {
+    public:
+        bool ShouldSample(const SpanContext*, std::string_view) override { return true; }
+    };
+
+    class AlwaysOffSampler : public Sampler {
+    public:
+        bool ShouldSample(const SpanContext*, std::string_view) override { return false; }
+    };
+
+    // Campiona una frazione `ratio` delle tracce. Con un genitore la decisione dipende
+    // dal suo trace-id (così è coerente tra gli span della stessa traccia); per gli
+    // span radice, il cui trace-id non è ancora stato generato, usa un numero casuale.
+    class TraceIdRatioSampler : public Sampler {
+    private:
+        uint64_t threshold; // Soglia su 63 bit: campiona se valore < threshold
+        bool always;
+
+    public:
+        explicit TraceIdRatioSampler(double ratio)
+            : threshold(static_cast<uint64_t>(std::max(0.0, std::min(ratio, 1.0)) * 9223372036854775807.0)),
+            always(ratio >= 1.0) {}
+
+        bool ShouldSample(const SpanContext* parent, std::string_view) override {
+            if (always) return true;
+            uint64_t value;
+            if (parent) std::memcpy(&value, parent->trace_id.data() + 8, sizeof(value));
+            else value = IdGenerator::NextRandom();
+            return (value >> 1) < threshold;
+        }
+    };
+
+    // Rispetta la decisione del genitore (flag "sampled" di traceparent o dello span locale);
+    // solo gli span radice vengono delegati al sampler `root`.
+    class ParentBasedSampler : public Sampler {
+    private:
+        std::unique_ptr<Sampler> root;
+
+    public:
+        explicit ParentBasedSampler(std::unique_ptr<Sampler> r) : root(std::move(r)) {}
+
+        bool ShouldSample(const SpanContext* parent, std::string_view name) override {
+            if (parent) return parent->IsSampled();
+            return root->ShouldSample(parent, name);
+        }
+    };
+
+    // Limita gli span campionati a `per_second` al secondo (con un burst di `burst` span),
+    // con l'algoritmo GCRA: un unico atomico con l'istante teorico del prossimo
+    // span ammesso, aggiornato con un CAS. Nessun lock sul percorso della richiesta.
+    class RateLimitingSampler : public Sampler {
+    private:
+        int64_t interval_ns;  // Distanza teorica tra due span ammessi
+        int64_t tolerance_ns; // Anticipo consentito (burst)
+        alignas(kCacheLineSize) std::atomic<int64_t> theoretical_arrival{ 0 };
+
+        static int64_t NowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    public:
+        explicit RateLimitingSampler(double per_second, double burst = 1.0)
+            : interval_ns(per_second > 0 ? static_cast<int64_t>(1e9 / per_second) : INT64_MAX),
+            tolerance_ns(per_second > 0 ? static_cast<int64_t>(std::max(0.0, burst - 1.0) * 1e9 / per_second) : 0) {}
+
+        bool ShouldSample(const SpanContext*, std::string_view) override {
+            if (interval_ns == INT64_MAX) return false;
+            int64_t now = NowNs();
+            int64_t tat = theoretical_arrival.load(std::memory_order_relaxed);
+            for (;;) {
+                int64_t next = std::max(tat, now);
+                if (next - tolerance_ns > now) return false; // Quota esaurita
+                if (theoretical_arrival.compare_exchange_weak(tat, next + interval_ns, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+    };
+
+    // Sampler distinto per nome di span (una route per handler), con un fallback
+    // per gli altri nomi. La tabella viene costruita all'avvio ed è poi solo letta;
+    // con poche route una scansione lineare sui string_view è più economica di un hash.
+    class PerRouteSampler : public Sampler {
+    public:
+        using Routes = std::vector<std::pair<std::string, std::unique_ptr<Sampler>>>;
+
+    private:
+        Routes routes;
+        std::unique_ptr<Sampler> fallback;
+
+    public:
+        PerRouteSampler(Routes r, std::unique_ptr<Sampler> f)
+            : routes(std::move(r)), fallback(std::move(f)) {}
+
+        bool ShouldSample(const SpanContext* parent, std::string_view name) override {
+            for (const auto& route : routes) {
+                if (route.first == name) return route.second->ShouldSample(parent, name);
+            }
+            return fallback->ShouldSample(parent, name);
+        }
+    };
+
+    // Sampler sostituibile a runtime (es. ricaricando la configurazione con SIGHUP):
+    // ShouldSample costa un load acquire in più. I sampler sostituiti restano vivi fino alla
+    // distruzione, perché un thread potrebbe ancora usarli; le sostituzioni sono rare.
+    class SwappableSampler : public Sampler {
+    private:
+        std::atomic<Sampler*> current;
+        std::vector<std::unique_ptr<Sampler>> owned; // Sotto swap_mutex
+        std::mutex swap_mutex;
+
+    public:
+        explicit SwappableSampler(std::unique_ptr<Sampler> initial) : current(initial.get()) {
+            owned.push_back(std::move(initial));
+        }
+
+        void Set(std::unique_ptr<Sampler> next) {
+            std::lock_guard<std::mutex> lock(swap_mutex);
+            current.store(next.get(), std::memory_order_release);
+            owned.push_back(std::move(next));
+        }
+
+        bool ShouldSample(const SpanContext* parent, std::string_view name) override {
+            return current.load(std::memory_order_acquire)->ShouldSample(parent, name);
+        }
+    };
+
+    // Sampler configurato dalle variabili standard OTEL_TRACES_SAMPLER / OTEL_TRACES_SAMPLER_ARG
+    // (always_on, always_off, traceidratio, parentbased_always_on, parentbased_always_off,
+    // parentbased_traceidratio). Default: parentbased_always_on.
+    // `get(nome)` restituisce il valore di un'impostazione o nullptr (di default config::Get).
+    template <typename Lookup>
+    std::unique_ptr<Sampler> SamplerFromSettings(Lookup get) {
+        const char* name = get("OTEL_TRACES_SAMPLER");
+        const char* arg = get("OTEL_TRACES_SAMPLER_ARG");
+        std::string sampler = name ? name : "parentbased_always_on";
+        double ratio = arg ? std::atof(arg) : 1.0;
+
+        if (sampler == "always_on") return std::make_unique<AlwaysOnSampler>();
+        if (sampler == "always_off") return std::make_unique<AlwaysOffSampler>();
+        if (sampler == "traceidratio") return std::make_unique<TraceIdRatioSampler>(ratio);
+        if (sampler == "parentbased_always_off") {
+            return std::make_unique<ParentBasedSampler>(std::make_unique<AlwaysOffSampler>());
+        }
+        if (sampler == "parentbased_traceidratio") {
+            return std::make_unique<ParentBasedSampler>(std::make_unique<TraceIdRatioSampler>(ratio));
+        }
+        if (sampler != "parentbased_always_on") {
+            std::cerr << "[OTEL] Sampler sconosciuto '" << sampler << "', uso parentbased_always_on" << std::endl;
+        }
+        return std::make_unique<ParentBasedSampler>(std::make_unique<AlwaysOnSampler>());
+    }
+
+    inline std::unique_ptr<Sampler> SamplerFromEnvironment() {
+        return SamplerFromSettings(config::Get);
+    }
+
+    // Provider Singleton che possiede il processor a cui gli Span consegnano i propri dati
+    // e il sampler che decide quali span registrare.
+    // Va configurato in main() prima di avviare il server; se non configurato,
+    // al primo utilizzo viene creato un BatchSpanProcessor con export su console
+    // e un sampler parentbased_always_on.
+    class TracerProvider {
+    private:
+        std::unique_ptr<BatchSpanProcessor> processor;
+        std::unique_ptr<Sampler> sampler;
+        std::once_flag init_flag;
+
+        TracerProvider() = default;
+
+    public:
+        TracerProvider(const TracerProvider&) = delete;
+        TracerProvider& operator=(const TracerProvider&) = delete;
+
+        static TracerProvider& Instance() {
+            static TracerProvider instance;
+            return instance;
+        }
+
+        // Inizializza la pipeline di tracing. Le chiamate successive alla prima non hanno effetto.
+        // exporter/sampler nulli selezionano i default (console, parentbased_always_on).
+        void Init(std::unique_ptr<SpanExporter> exporter, const BatchSpanProcessorOptions& options = {},
+            std::unique_ptr<Sampler> span_sampler = nullptr) {
+            std::call_once(init_flag, [&] {
+                if (!exporter) exporter = std::make_unique<ConsoleSpanExporter>();
+                if (!span_sampler) span_sampler = std::make_unique<ParentBasedSampler>(std::make_unique<AlwaysOnSampler>());
+                processor = std::make_unique<BatchSpanProcessor>(std::move(exporter), options);
+                sampler = std::move(span_sampler);
+            });
+        }
+
+        // Dopo l'inizializzazione costa solo il controllo di call_once: nessuna allocazione.
+        BatchSpanProcessor& GetProcessor() {
+            Init(nullptr);
+            return *processor;
+        }
+
+        Sampler& GetSampler() {
+            Init(nullptr);
+            return *sampler;
+        }
+
+        // Esporta gli span rimasti e ferma il thread in background.
+        void Shutdown() {
+            if constexpr (kTracingEnabled) GetProcessor().Shutdown();
+        }
+    };
+
+    // Arena per thread degli Span allocati dinamicamente (es. std::make_unique negli handler).
+    // I blocchi liberati tornano in una free list del thread e vengono riusati dalle richieste
+    // successive: a regime creare uno span non chiama malloc. Lo stato è in variabili
+    // thread_local banali, quindi resta utilizzabile anche durante la terminazione del thread.
+    class SpanArena {
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        static constexpr size_t kMaxCachedBlocks = 64; // Blocchi trattenuti al massimo per thread
+
+        struct State {
+            FreeBlock* head = nullptr;
+            size_t cached = 0;
+            bool closed = false; // Thread in terminazione: i blocchi tornano all'allocatore globale
+        };
+
+        // Alla terminazione del thread restituisce i blocchi all'allocatore globale.
+        struct Cleanup {
+            ~Cleanup() {
+                State& state = ThreadState();
+                while (state.head) {
+                    FreeBlock* block = state.head;
+                    state.head = block->next;
+                    ::operator delete(block);
+                }
+                state.cached = 0;
+                state.closed = true;
+            }
+        };
+
+        static State& ThreadState() {
+            static thread_local State state;
+            return state;
+        }
+
+    public:
+        static void* Allocate(size_t size) {
+            State& state = ThreadState();
+            if (state.head) {
+                FreeBlock* block = state.head;
+                state.head = block->next;
+                --state.cached;
+                return block;
+            }
+            static thread_local Cleanup cleanup; // Registra la pulizia al primo utilizzo del thread
+            (void)cleanup;
+            return ::operator new(size);
+        }
+
+        static void Release(void* pointer) {
+            State& state = ThreadState();
+            if (state.closed || state.cached >= kMaxCachedBlocks) {
+                ::operator delete(pointer);
+                return;
+            }
+            FreeBlock* block = static_cast<FreeBlock*>(pointer);
+            block->next = state.head;
+            state.head = block;
+            ++state.cached;
+        }
+    };
+
+    // Rappresenta uno Span, un'unità di lavoro discreta in una traccia.
+    // Ha un nome, un contesto, un tempo di inizio/fine e attributi.
+    // Nome e chiavi degli attributi sono StaticString e gli attributi stanno in un
+    // AttributeList inline: nel caso comune uno span non esegue allocazioni.
+    //
+    // Ogni thread mantiene uno stack degli span attivi: uno Span creato senza un
+    // genitore esplicito diventa figlio dello span corrente del thread (Span::Current()),
+    // e lo sostituisce fino a End(). Gli span vanno quindi terminati in ordine LIFO
+    // (come avviene naturalmente con il RAII) e non vanno passati ad altri thread.
+    //
+    // Se il Sampler del TracerProvider scarta lo span (o il genitore è uno span già scartato)
+    // lo span è "non registrante": non legge i clock, non copia nome e attributi, non genera
+    // ID (riusa il contesto del genitore, che continua a propagarsi a valle; uno span radice
+    // scartato ha un contesto vuoto) e in End() non consegna nulla al processor.
+    // Registra il tempo trascorso in Span::End (definita con l'auto-strumentazione, dopo CounterCell).
+    inline void RecordSpanEndCost(std::chrono::nanoseconds cost);
+
+    class Span {
+    private:
+        StaticString name;      // Nome dello span (es. "handle_request", "database_query")
+        SpanContext context;    // Contesto di traccia/span
+        SpanId parent_span_id{}; // Span genitore (tutto a zero per gli span radice)
+        SpanKind kind;
+        StatusCode status = StatusCode::Unset;
+        bool local_root = false; // Genitore assente o remoto
+        std::chrono::time_point<std::chrono::high_resolution_clock> start_time; // Tempo di inizio dello span
+        std::chrono::system_clock::time_point start_wall; // Inizio in tempo "di calendario", richiesto da OTLP
+        AttributeList attributes; // Attributi associati allo span
+        bool recording = true;  // false per gli span di tracce non campionate
+        bool ended = false;     // Flag per assicurarsi che End() sia chiamato una sola volta
+        Span* previous_active;  // Span attivo prima di questo sullo stesso thread
+
+        static Span*& ActiveSlot() {
+            thread_local Span* active = nullptr;
+            return active;
+        }
+
+        void Start(StaticString n, const SpanContext* parent) {
+            if constexpr (!kTracingEnabled) {
+                recording = false;
+                previous_active = nullptr;
+                return;
+            }
+            // Un genitore locale con contesto vuoto è uno span radice scartato: nessuna traccia da continuare
+            bool sampled = !(parent && !parent->IsValid()) &&
+                TracerProvider::Instance().GetSampler().ShouldSample(parent, n.View());
+            if (!sampled) {
+                recording = false;
+                if (parent) {
+                    context = *parent;
+                    context.trace_flags &= static_cast<uint8_t>(~kTraceFlagSampled);
+                    context.is_remote = false;
+                }
+            }
+            else {
+                local_root = !parent || parent->is_remote;
+                if (parent) {
+                    context.trace_id = parent->trace_id;
+                    context.span_id = IdGenerator::NewSpanId();
+                    context.trace_flags = parent->trace_flags | kTraceFlagSampled;
+                    context.trace_state = parent->trace_state;
+                    parent_span_id = parent->span_id;
+                }
+                else {
+                    context = SpanContext::CreateRandom();
+                }
+                name = n;
+                start_time = std::chrono::high_resolution_clock::now();
+                start_wall = std::chrono::system_clock::now();
+            }
+            previous_active = ActiveSlot();
+            ActiveSlot() = this;
+        }
+
+        static const SpanContext* CurrentContext() {
+            Span* current = ActiveSlot();
+            return current ? &current->context : nullptr;
+        }
+
+    public:
+        // Costruttore: Inizia lo span registrando il tempo corrente.
+        // Il genitore è lo span attivo sul thread, se presente; altrimenti inizia una nuova traccia.
+        explicit Span(StaticString n, SpanKind k = SpanKind::Internal) : kind(k) {
+            Start(n, CurrentContext());
+        }
+
+        // Costruttore con genitore esplicito (es. estratto da traceparent con TraceContext::Extract).
+        // Se il contesto non è valido si comporta come il costruttore precedente.
+        Span(StaticString n, const SpanContext& parent, SpanKind k) : kind(k) {
+            Start(n, parent.IsValid() ? &parent : CurrentContext());
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        // Gli Span allocati con new/make_unique usano l'arena del thread.
+        static void* operator new(size_t size) {
+            return size == sizeof(Span) ? SpanArena::Allocate(size) : ::operator new(size);
+        }
+
+        static void operator delete(void* pointer, size_t size) {
+            if (size == sizeof(Span)) SpanArena::Release(pointer);
+            else ::operator delete(pointer);
+        }
+
+        // Span attivo sul thread corrente (nullptr se nessuno).
+        static Span* Current() { return ActiveSlot(); }
+
+        const SpanContext& GetContext() const { return context; }
+        bool IsRecording() const { return recording; }
+
+        // Imposta l'esito dell'operazione (Error fa conservare la traccia dal tail sampling).
+        void SetStatus(StatusCode code) {
+            if (recording) status = code;
+        }
+
+        // Aggiunge un attributo tipizzato (ignorato se lo span non registra, senza
+        // nemmeno costruire il valore). La chiave è un letterale o una StaticString internata;
+        // il valore può essere intero, double, bool o stringa e viene formattato solo all'export.
+        template <typename T>
+        void SetAttribute(AttributeKey key, const T& value) {
+            if constexpr (!kStringAttributesEnabled && std::is_convertible_v<const T&, std::string_view>) {
+                (void)key;
+                (void)value;
+            }
+            else if (recording) {
+                attributes.Add(key, AttributeValue(value));
+            }
+        }
+
+        // Termina lo span: calcola la durata e consegna i dati al processor del TracerProvider.
+        // Nessuna scrittura su console avviene qui: la formattazione e l'export sono
+        // a carico del thread in background del BatchSpanProcessor.
+        void End() {
+            if (ended) return; // Evita doppie chiamate a End
+            ended = true;
+            if constexpr (!kTracingEnabled) return;
+
+            // Ripristina lo span attivo precedente sul thread
+            if (ActiveSlot() == this) ActiveSlot() = previous_active;
+            if (!recording) return;
+
+            auto end_time = std::chrono::high_resolution_clock::now();
+
+            SpanData data;
+            data.name = name;
+            data.context = context; // Copia: GetContext() resta valido anche dopo End()
+            data.parent_span_id = parent_span_id;
+            data.kind = kind;
+            data.status = status;
+            data.local_root = local_root;
+            data.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+            // La fine viene derivata dalla durata misurata con il clock monotono
+            data.start_time_unix_nano = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(start_wall.time_since_epoch()).count());
+            data.end_time_unix_nano = data.start_time_unix_nano + static_cast<uint64_t>(data.duration.count());
+            data.attributes = std::move(attributes);
+
+            TracerProvider::Instance().GetProcessor().OnEnd(std::move(data));
+            RecordSpanEndCost(std::chrono::high_resolution_clock::now() - end_time);
+        }
+
+        // Distruttore: Assicura che End() venga chiamato automaticamente
+        // quando lo span esce dallo scope (es. alla fine di una funzione o handler).
+        // Questo implementa il pattern RAII (Resource Acquisition Is Initialization).
+        ~Span() {
+            if (!ended) {
+                End();
+            }
+        }
+    };
+
+    // Tipo di strumento di una metrica.
+    enum class InstrumentKind {
+        Counter,   // Valore monotono crescente
+        Gauge,     // Valore istantaneo che può salire e scendere
+        Histogram  // Distribuzione di valori in bucket
+    };
+
+    // Esemplare di un bucket: un'osservazione concreta con la traccia che l'ha prodotta,
+    // per passare da un bucket lento di un istogramma alla traccia corrispondente.
+    struct Exemplar {
+        TraceId trace_id{}; // Tutto a zero: nessun esemplare per il bucket
+        SpanId span_id{};
+        double value = 0;   // Nell'unità esposta
+        uint64_t time_unix_nano = 0; // Istante dell'osservazione (CoarseUnixNano, risoluzione di pochi ms)
+
+        bool IsValid() const { return !IsZeroId(trace_id); }
+    };
+
+    // Singolo punto di una metrica (una combinazione di label) in uno snapshot.
+    struct MetricPoint {
+        std::vector<std::pair<std::string, std::string>> labels; // Label ordinate per chiave
+        int64_t value = 0;                   // Counter e Gauge
+        std::vector<uint64_t> bucket_counts; // Histogram: conteggi NON cumulativi, uno per bucket + "+Inf"
+        uint64_t count = 0;                  // Histogram: numero di osservazioni
+        double sum = 0;                      // Histogram: somma delle osservazioni (nell'unità esposta)
+        std::vector<Exemplar> exemplars;     // Histogram: uno per bucket, vuoto se nessuno span campionato
+    };
+
+    // Temporalità di Sum e Histogram in OTLP (valori dell'enum AggregationTemporality).
+    enum class AggregationTemporality {
+        Delta = 1,      // Variazione dall'export precedente
+        Cumulative = 2  // Totale dall'avvio (come l'esposizione Prometheus)
+    };
+
+    // Snapshot di una metrica consegnato agli exporter (es. OTLP).
+    struct MetricData {
+        std::string name;
+        std::string description;
+        InstrumentKind kind = InstrumentKind::Counter;
+        std::vector<double> bounds; // Histogram: limiti superiori dei bucket (nell'unità esposta)
+        std::vector<MetricPoint> points;
+        // Impostati dal PeriodicMetricReader; 0 = scelti dall'exporter
+        AggregationTemporality temporality = AggregationTemporality::Cumulative;
+        uint64_t start_time_unix_nano = 0;
+        uint64_t time_unix_nano = 0;
+    };
+
+    // Numero di shard per ogni contatore (potenza di 2). Con al massimo kCounterShards
+    // thread attivi ogni thread scrive su una cache line tutta sua.
+    constexpr size_t kCounterShards = 16;
+
+    // Restituisce lo shard assegnato al thread corrente. L'indice viene assegnato
+    // round-robin alla prima chiamata e poi resta in una variabile thread_local.
+    inline size_t ThisThreadShard() {
+        static std::atomic<size_t> next_shard{ 0 };
+        thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) & (kCounterShards - 1);
+        return shard;
+    }
+
+    // Contatore suddiviso in shard, ciascuno su una propria cache line.
+    // L'incremento è un singolo fetch_add relaxed sullo shard del thread corrente;
+    // gli shard vengono sommati solo quando serve il valore (scrape/export).
+    class CounterCell {
+    private:
+        struct alignas(kCacheLineSize) Shard {
+            std::atomic<int64_t> value{ 0 };
+        };
+        Shard shards[kCounterShards];
+
+    public:
+        void Add(int64_t value) {
+            shards[ThisThreadShard()].value.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        int64_t Sum() const {
+            int64_t total = 0;
+            for (const auto& shard : shards) {
+                total += shard.value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        size_t MemoryBytes() const { return sizeof(*this); }
+    };
+
+    // Handle "pre-risolto" verso la cella di un contatore per una specifica combinazione di label.
+    // Si ottiene una volta con Metric::Bind() e poi si incrementa senza lock né allocazioni.
+    // È copiabile e resta valido per tutta la vita della Metric che lo ha creato.
+    class BoundCounter {
+    private:
+        CounterCell* cell = nullptr;
+
+    public:
+        BoundCounter() = default;
+        explicit BoundCounter(CounterCell* c) : cell(c) {}
+
+        void Add(int64_t value = 1) const {
+            cell->Add(value);
+        }
+
+        // Valore corrente della cella (somma degli shard).
+        int64_t Value() const {
+            return cell->Sum();
+        }
+
+        bool IsValid() const { return cell != nullptr; }
+    };
+
+    // --- Auto-strumentazione della telemetria ---
+    // Quanto costa, sui thread delle richieste, la telemetria stessa. Ogni evento è un
+    // fetch_add relaxed su un CounterCell: abbastanza economico da restare sempre attivo.
+    // I valori sono esposti come strumenti osservabili del MetricsRegistry (RegisterSelfTelemetry).
+    struct SelfTelemetry {
+        CounterCell span_end_count;   // Span registrati terminati
+        CounterCell span_end_nanos;   // Tempo totale speso in Span::End (ns)
+        CounterCell lock_contentions; // Acquisizioni del lock delle serie che hanno dovuto attendere
+        CounterCell lock_wait_nanos;  // Tempo totale di attesa su quel lock (ns)
+        CounterCell arena_upstream_bytes; // Byte chiesti all'heap dalle arene per richiesta oltre il blocco iniziale
+
+        static SelfTelemetry& Instance() {
+            static SelfTelemetry instance;
+            return instance;
+        }
+    };
+
+    inline void RecordSpanEndCost(std::chrono::nanoseconds cost) {
+        SelfTelemetry& telemetry = SelfTelemetry::Instance();
+        telemetry.span_end_count.Add(1);
+        telemetry.span_end_nanos.Add(cost.count());
+    }
+
+    // Registra un'attesa nel profilo di contesa, se attivo (definita con il profiler, profiling::).
+    inline void RecordLockContention(std::chrono::nanoseconds wait);
+
+    // Acquisisce `lock` (shared_lock/unique_lock costruito con std::defer_lock).
+    // Il tempo viene misurato solo se il mutex è conteso: senza contesa costa un try_lock.
+    template <typename Lock>
+    void LockAndMeasureWait(Lock& lock) {
+        if (lock.try_lock()) return;
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        SelfTelemetry& telemetry = SelfTelemetry::Instance();
+        telemetry.lock_contentions.Add(1);
+        telemetry.lock_wait_nanos.Add(wait.count());
+        RecordLockContention(wait);
+    }
+
+    // Allocazioni eseguite dal thread corrente, incrementate dall'operator new globale
+    // (vedi in fondo al namespace). thread_local banale: nessun costo di inizializzazione.
+    inline thread_local uint64_t thread_allocations = 0;
+#ifdef OTEL_NO_ALLOCATION_COUNTING
+    constexpr bool kAllocationCountingEnabled = false; // thread_allocations resta a zero
+#else
+    constexpr bool kAllocationCountingEnabled = true;
+#endif
+
+    inline uint64_t ThisThreadAllocations() {
+        return thread_allocations;
+    }
+
+    using LabelSet = std::unordered_map<std::string, std::string>;
+    using SortedLabels = std::vector<std::pair<std::string, std::string>>;
+
+    // --- Helper per l'esposizione Prometheus ---
+    // L'esposizione scrive in un buffer std::string riutilizzabile: le parti stabili di ogni
+    // serie (nome, HELP/TYPE, label già escapate) vengono renderizzate una sola volta,
+    // allo scrape si aggiungono solo i numeri.
+    // Link utile: https://prometheus.io/docs/instrumenting/exposition_formats/
+
+    // Escape del valore di una label: backslash, doppi apici e newline.
+    inline std::string EscapeLabelValue(const std::string& value) {
+        std::string out;
+        out.reserve(value.size());
+        for (char c : value) {
+            switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"': out += "\\\""; break;
+            case '\n': out += "\\n"; break;
+            default: out += c;
+            }
+        }
+        return out;
+    }
+
+    // Escape del testo di HELP: backslash e newline.
+    inline std::string EscapeHelp(const std::string& text) {
+        std::string out;
+        out.reserve(text.size());
+        for (char c : text) {
+            if (c == '\\') out += "\\\\";
+            else if (c == '\n') out += "\\n";
+            else out += c;
+        }
+        return out;
+    }
+
+    // Righe HELP e TYPE di una metrica.
+    inline std::string RenderHeader(const std::string& name, const std::string& description, const char* type) {
+        return "# HELP " + name + " " + EscapeHelp(description) + "\n# TYPE " + name + " " + type + "\n";
+    }
+
+    // Label in formato Prometheus senza parentesi graffe: k1="v1",k2="v2"
+    inline std::string RenderLabels(const SortedLabels& labels) {
+        std::string out;
+        for (const auto& label : labels) {
+            if (!out.empty()) out += ',';
+            out += label.first + "=\"" + EscapeLabelValue(label.second) + "\"";
+        }
+        return out;
+    }
+
+    // Prefisso completo di una riga di serie: nome{label} (con lo spazio finale prima del valore).
+    // `extra` è una label aggiuntiva già renderizzata (es. le="0.1" per i bucket).
+    inline std::string RenderSeriesPrefix(const std::string& name, const std::string& labels_text,
+        const std::string& extra = std::string()) {
+        std::string out = name;
+        if (!labels_text.empty() || !extra.empty()) {
+            out += '{';
+            out += labels_text;
+            if (!labels_text.empty() && !extra.empty()) out += ',';
+            out += extra;
+            out += '}';
+        }
+        out += ' ';
+        return out;
+    }
+
+    // Aggiunge un intero al buffer senza allocazioni (std::to_chars).
+    inline void AppendInt(std::string& out, int64_t value) {
+        char buffer[24];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr);
+    }
+
+    inline void AppendUint(std::string& out, uint64_t value) {
+        char buffer[24];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr);
+    }
+
+    // Formatta un numero per l'esposizione Prometheus (es. limiti "le" e somme).
+    inline std::string FormatDouble(double value) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+        return buffer;
+    }
+
+    inline void AppendDouble(std::string& out, double value) {
+        char buffer[32];
+        int n = std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+        out.append(buffer, static_cast<size_t>(n));
+    }
+
+    // Scrive uno snapshot in formato testo: Prometheus 0.0.4 oppure OpenMetrics 1.0.0.
+    // È il percorso generico, usato dove non ci sono righe pre-renderizzate (footprint,
+    // OpenMetrics). Differenze di OpenMetrics: la famiglia di un contatore non ha il
+    // suffisso _total (che resta sul campione), HELP esegue l'escape anche dei doppi apici
+    // e i bucket degli istogrammi possono portare un esemplare:
+    //   name_bucket{le="0.1"} 42 # {trace_id="...",span_id="..."} 0.087 1700000000.123
+    // Link utile: https://github.com/prometheus/OpenMetrics/blob/main/specification/OpenMetrics.md
+    inline void AppendTextExposition(std::string& out, const MetricData& data, bool openmetrics) {
+        const char* type = data.kind == InstrumentKind::Counter ? "counter" :
+            data.kind == InstrumentKind::Gauge ? "gauge" : "histogram";
+        std::string family = data.name;
+        std::string sample = data.name;
+        if (openmetrics && data.kind == InstrumentKind::Counter) {
+            const std::string suffix = "_total";
+            if (family.size() > suffix.size() && family.compare(family.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                family.resize(family.size() - suffix.size());
+            }
+            sample = family + suffix;
+        }
+        std::string help = EscapeHelp(data.description);
+        if (openmetrics) {
+            for (size_t pos = help.find('"'); pos != std::string::npos; pos = help.find('"', pos + 2)) {
+                help.insert(pos, 1, '\\');
+            }
+        }
+        out += "# HELP " + family + " " + help + "\n# TYPE " + family + " " + type + "\n";
+
+        for (const auto& point : data.points) {
+            std::string labels_text = RenderLabels(point.labels);
+            if (data.kind != InstrumentKind::Histogram) {
+                out += RenderSeriesPrefix(sample, labels_text);
+                AppendInt(out, point.value);
+                out += '\n';
+                continue;
+            }
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < point.bucket_counts.size(); ++i) {
+                cumulative += point.bucket_counts[i];
+                out += RenderSeriesPrefix(data.name + "_bucket", labels_text,
+                    i < data.bounds.size() ? "le=\"" + FormatDouble(data.bounds[i]) + "\"" : std::string("le=\"+Inf\""));
+                AppendUint(out, cumulative);
+                if (openmetrics && i < point.exemplars.size() && point.exemplars[i].IsValid()) {
+                    const Exemplar& exemplar = point.exemplars[i];
+                    out += " # {trace_id=\"";
+                    AppendHex(out, exemplar.trace_id.data(), exemplar.trace_id.size());
+                    out += "\",span_id=\"";
+                    AppendHex(out, exemplar.span_id.data(), exemplar.span_id.size());
+                    out += "\"} ";
+                    AppendDouble(out, exemplar.value);
+                    // Timestamp in secondi con i millisecondi, senza passare da un double
+                    out += ' ';
+                    AppendUint(out, exemplar.time_unix_nano / 1000000000);
+                    char millis[5] = { '.', '0', '0', '0', '\0' };
+                    const uint64_t ms = exemplar.time_unix_nano / 1000000 % 1000;
+                    millis[1] = static_cast<char>('0' + ms / 100);
+                    millis[2] = static_cast<char>('0' + ms / 10 % 10);
+                    millis[3] = static_cast<char>('0' + ms % 10);
+                    out += millis;
+                }
+                out += '\n';
+            }
+            out += RenderSeriesPrefix(data.name + "_sum", labels_text);
+            AppendDouble(out, point.sum);
+            out += '\n';
+            out += RenderSeriesPrefix(data.name + "_count", labels_text);
+            AppendUint(out, point.count);
+            out += '\n';
+        }
+    }
+
+    // --- Label internate e limiti di cardinalità ---
+    // Ogni chiave e valore di label distinti è salvato una sola volta nel processo e
+    // identificato da un ID a 32 bit: le serie memorizzano solo coppie di ID.
+    // Una stringa viene internata solo quando una serie viene effettivamente creata
+    // (entro il limite di cardinalità), quindi valori arbitrari provenienti dal traffico
+    // (es. percorsi inventati da uno scanner) non fanno crescere la tabella.
+    class LabelInterner {
+    private:
+        std::unordered_map<std::string_view, uint32_t> ids; // Le view puntano in `strings`
+        std::deque<std::string> strings;                    // Indirizzi stabili, indice = ID
+        size_t string_bytes = 0;
+        mutable std::shared_mutex mutex;
+
+        LabelInterner() = default;
+
+    public:
+        static constexpr uint32_t kNotFound = UINT32_MAX;
+
+        static LabelInterner& Instance() {
+            static LabelInterner instance;
+            return instance;
+        }
+
+        // ID di una stringa già internata, o kNotFound. Non inserisce nulla.
+        uint32_t Find(std::string_view text) const {
+            std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+            LockAndMeasureWait(lock);
+            auto it = ids.find(text);
+            return it != ids.end() ? it->second : kNotFound;
+        }
+
+        uint32_t Intern(std::string_view text) {
+            std::unique_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+            LockAndMeasureWait(lock);
+            auto it = ids.find(text);
+            if (it != ids.end()) return it->second;
+            uint32_t id = static_cast<uint32_t>(strings.size());
+            strings.emplace_back(text);
+            string_bytes += strings.back().capacity();
+            ids.emplace(strings.back(), id);
+            return id;
+        }
+
+        // Il riferimento resta valido per tutta la vita del processo.
+        const std::string& Get(uint32_t id) const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return strings[id];
+        }
+
+        size_t Size() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return strings.size();
+        }
+
+        // Stima della memoria occupata: stringhe più voci della mappa.
+        size_t MemoryBytes() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return string_bytes + strings.size() * (sizeof(std::string) + sizeof(std::pair<std::string_view, uint32_t>) + 2 * sizeof(void*));
+        }
+    };
+
+    // Numero massimo di serie per strumento (come il cardinality limit degli SDK OpenTelemetry).
+    // Le combinazioni di label oltre il limite confluiscono nella serie {otel_metric_overflow="true"}.
+    // Default 2000, modificabile con OTEL_METRICS_CARDINALITY_LIMIT o per strumento.
+    inline size_t DefaultCardinalityLimit() {
+        static const size_t limit = [] {
+            const char* value = config::Get("OTEL_METRICS_CARDINALITY_LIMIT");
+            long parsed = value ? std::atol(value) : 0;
+            return parsed > 0 ? static_cast<size_t>(parsed) : static_cast<size_t>(2000);
+        }();
+        return limit;
+    }
+
+    // Label massime per serie: le combinazioni più lunghe finiscono nella serie di overflow.
+    constexpr size_t kMaxLabelsPerSeries = 16;
+
+    // Contenitore delle serie (una per combinazione di label) di uno strumento.
+    // Ogni serie possiede una cella allocata separatamente, così il suo indirizzo resta
+    // stabile: gli handle Bound* vi puntano direttamente. Le serie sono anche tenute in un
+    // vettore in ordine di creazione, così lo scrape le visita in tempo lineare senza ordinare.
+    // L'indice è una tabella flat a indirizzamento aperto (probing lineare) sulle coppie di ID
+    // delle label: una ricerca non alloca e non confronta stringhe. Superato il limite di
+    // cardinalità le nuove combinazioni usano la serie di overflow, quindi memoria e tempo di
+    // scrape restano limitati qualunque sia il traffico.
+    // Il lock protegge solo la struttura (Bind e scrape), mai gli aggiornamenti delle celle.
+    template <typename Cell>
+    class SeriesMap {
+    public:
+        struct Series {
+            std::vector<uint32_t> label_ids;   // Coppie (chiave, valore) internate, ordinate per ID della chiave
+            std::vector<std::string> prefixes; // Righe di esposizione pre-renderizzate (senza valore)
+            std::unique_ptr<Cell> cell;
+        };
+
+    private:
+        // Chiave di ricerca costruita sullo stack a ogni Bind.
+        struct LabelIds {
+            std::array<uint32_t, 2 * kMaxLabelsPerSeries> ids;
+            size_t size = 0;
+
+            uint32_t Hash() const {
+                uint64_t hash = 1469598103934665603ULL; // FNV-1a a 64 bit sugli ID
+                for (size_t i = 0; i < size; ++i) {
+                    hash = (hash ^ ids[i]) * 1099511628211ULL;
+                }
+                return static_cast<uint32_t>(hash ^ (hash >> 32));
+            }
+
+            bool Equals(const std::vector<uint32_t>& other) const {
+                return other.size() == size && std::equal(other.begin(), other.end(), ids.begin());
+            }
+        };
+
+        // Slot della tabella: hash della chiave e indice+1 in `ordered` (0 = vuoto).
+        struct Slot {
+            uint32_t hash = 0;
+            uint32_t series = 0;
+        };
+
+        std::vector<Slot> slots; // Dimensione potenza di 2, riempimento massimo 3/4
+        std::vector<std::unique_ptr<Series>> ordered;
+        Series* overflow = nullptr;
+        size_t limit = DefaultCardinalityLimit();
+        std::atomic<uint64_t> overflowed_binds{ 0 };
+        mutable std::shared_mutex mutex;
+
+        // Risolve le label negli ID già internati; false se qualche stringa è sconosciuta
+        // (quindi la serie non può esistere) o se le label sono troppe.
+        static bool FindIds(const LabelSet& labels, LabelIds& key, bool intern) {
+            if (labels.size() > kMaxLabelsPerSeries) return false;
+            LabelInterner& interner = LabelInterner::Instance();
+            key.size = 0;
+            for (const auto& label : labels) {
+                uint32_t key_id = intern ? interner.Intern(label.first) : interner.Find(label.first);
+                uint32_t value_id = intern ? interner.Intern(label.second) : interner.Find(label.second);
+                if (key_id == LabelInterner::kNotFound || value_id == LabelInterner::kNotFound) return false;
+                key.ids[key.size++] = key_id;
+                key.ids[key.size++] = value_id;
+            }
+            // Ordine canonico: coppie ordinate per ID della chiave (insertion sort, poche label)
+            for (size_t i = 2; i < key.size; i += 2) {
+                for (size_t j = i; j >= 2 && key.ids[j - 2] > key.ids[j]; j -= 2) {
+                    std::swap(key.ids[j - 2], key.ids[j]);
+                    std::swap(key.ids[j - 1], key.ids[j + 1]);
+                }
+            }
+            return true;
+        }
+
+        Series* Lookup(const LabelIds& key, uint32_t hash) const {
+            if (slots.empty()) return nullptr;
+            size_t mask = slots.size() - 1;
+            for (size_t i = hash & mask; slots[i].series != 0; i = (i + 1) & mask) {
+                if (slots[i].hash == hash) {
+                    Series* series = ordered[slots[i].series - 1].get();
+                    if (key.Equals(series->label_ids)) return series;
+                }
+            }
+            return nullptr;
+        }
+
+        void InsertSlot(uint32_t hash, uint32_t series_index) {
+            size_t mask = slots.size() - 1;
+            size_t i = hash & mask;
+            while (slots[i].series != 0) i = (i + 1) & mask;
+            slots[i].hash = hash;
+            slots[i].series = series_index + 1;
+        }
+
+        // Raddoppia la tabella quando supererebbe il 75% di riempimento. Chiamato con il lock esclusivo.
+        void Reserve(size_t count) {
+            if ((count + 1) * 4 <= slots.size() * 3) return;
+            std::vector<Slot> old = std::move(slots);
+            slots.assign(std::max<size_t>(16, old.size() * 2), Slot());
+            for (const Slot& slot : old) {
+                if (slot.series != 0) InsertSlot(slot.hash, slot.series - 1);
+            }
+        }
+
+        // Label della serie ordinate per nome della chiave (per esposizione ed export).
+        static SortedLabels ResolveLabels(const std::vector<uint32_t>& label_ids) {
+            LabelInterner& interner = LabelInterner::Instance();
+            SortedLabels labels;
+            labels.reserve(label_ids.size() / 2);
+            for (size_t i = 0; i < label_ids.size(); i += 2) {
+                labels.emplace_back(interner.Get(label_ids[i]), interner.Get(label_ids[i + 1]));
+            }
+            std::sort(labels.begin(), labels.end());
+            return labels;
+        }
+
+        template <typename MakeCell, typename MakePrefixes>
+        std::unique_ptr<Series> MakeSeries(std::vector<uint32_t> label_ids, MakeCell& make_cell, MakePrefixes& make_prefixes) {
+            auto series = std::make_unique<Series>();
+            series->label_ids = std::move(label_ids);
+            series->prefixes = make_prefixes(RenderLabels(ResolveLabels(series->label_ids)));
+            series->cell = make_cell();
+            return series;
+        }
+
+        // Label esattamente {otel_metric_overflow="true"}: la serie di overflow stessa, per esempio
+        // salvata da StateFile, che va rimessa nella serie di overflow e non creata come serie normale.
+        static bool IsOverflowLabels(const LabelSet& labels) {
+            if (labels.size() != 1) return false;
+            auto it = labels.find("otel_metric_overflow");
+            return it != labels.end() && it->second == "true";
+        }
+
+        // Serie {otel_metric_overflow="true"}, creata alla prima combinazione oltre il limite.
+        // Chiamato con il lock esclusivo.
+        template <typename MakeCell, typename MakePrefixes>
+        Cell* Overflow(MakeCell& make_cell, MakePrefixes& make_prefixes, bool count_bind = true) {
+            if (count_bind) overflowed_binds.fetch_add(1, std::memory_order_relaxed);
+            if (!overflow) {
+                LabelInterner& interner = LabelInterner::Instance();
+                std::vector<uint32_t> ids = { interner.Intern("otel_metric_overflow"), interner.Intern("true") };
+                ordered.push_back(MakeSeries(std::move(ids), make_cell, make_prefixes));
+                overflow = ordered.back().get();
+            }
+            return overflow->cell.get();
+        }
+
+    public:
+        // Restituisce la cella associata alle label, creandola con make_cell() se non esiste.
+        // make_prefixes(labels_text) produce le righe di esposizione pre-renderizzate della nuova serie.
+        // Se la serie esiste già non alloca nulla.
+        template <typename MakeCell, typename MakePrefixes>
+        Cell* Bind(const LabelSet& labels, MakeCell make_cell, MakePrefixes make_prefixes) {
+            LabelIds key;
+            bool known = FindIds(labels, key, false);
+            uint32_t hash = known ? key.Hash() : 0;
+            if (known) {
+                std::shared_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+                LockAndMeasureWait(lock);
+                if (Series* series = Lookup(key, hash)) return series->cell.get();
+            }
+
+            std::unique_lock<std::shared_mutex> lock(mutex, std::defer_lock);
+            LockAndMeasureWait(lock);
+            if (known) {
+                if (Series* series = Lookup(key, hash)) return series->cell.get();
+            }
+
+            if (IsOverflowLabels(labels)) return Overflow(make_cell, make_prefixes, false);
+            size_t regular = ordered.size() - (overflow ? 1 : 0);
+            if (regular >= limit || labels.size() > kMaxLabelsPerSeries) {
+                return Overflow(make_cell, make_prefixes);
+            }
+
+            // Serie nuova entro il limite: solo ora le stringhe vengono internate
+            if (!known) {
+                FindIds(labels, key, true);
+                hash = key.Hash();
+                if (Series* series = Lookup(key, hash)) return series->cell.get();
+            }
+            Reserve(ordered.size());
+            ordered.push_back(MakeSeries(std::vector<uint32_t>(key.ids.begin(), key.ids.begin() + key.size),
+                make_cell, make_prefixes));
+            InsertSlot(hash, static_cast<uint32_t>(ordered.size() - 1));
+            return ordered.back()->cell.get();
+        }
+
+        // Visita tutte le serie in ordine di creazione: fn(const Series&).
+        template <typename Fn>
+        void ForEach(Fn fn) const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            for (const auto& series : ordered) {
+                fn(*series);
+            }
+        }
+
+        // Label della serie, ordinate per chiave (snapshot per gli exporter push).
+        SortedLabels LabelsOf(const Series& series) const {
+            return ResolveLabels(series.label_ids);
+        }
+
+        size_t Size() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return ordered.size();
+        }
+
+        void SetLimit(size_t max_series) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            limit = max_series;
+        }
+
+        size_t GetLimit() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return limit;
+        }
+
+        // Bind finiti nella serie di overflow perché il limite era raggiunto.
+        uint64_t GetOverflowedBinds() const { return overflowed_binds.load(std::memory_order_relaxed); }
+
+        // Stima della memoria posseduta: celle, ID delle label, righe pre-renderizzate e indice.
+        // Le stringhe internate sono condivise e contate a parte (LabelInterner::MemoryBytes).
+        size_t MemoryBytes() const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            size_t bytes = sizeof(*this) + slots.capacity() * sizeof(Slot) + ordered.capacity() * sizeof(void*);
+            for (const auto& series : ordered) {
+                bytes += sizeof(Series) + series->label_ids.capacity() * sizeof(uint32_t) + series->cell->MemoryBytes();
+                bytes += series->prefixes.capacity() * sizeof(std::string);
+                for (const auto& prefix : series->prefixes) bytes += prefix.capacity() + 1;
+            }
+            return bytes;
+        }
+    };
+
+    // Interfaccia comune a tutti gli strumenti registrati nel MetricsRegistry.
+    class Instrument {
+    public:
+        virtual ~Instrument() = default;
+
+        // Aggiunge le serie in formato testo Prometheus al buffer `out`.
+        // Può essere eseguito in concorrenza con gli aggiornamenti (Add/Set/Record).
+        virtual void WritePrometheus(std::string& out) const = 0;
+
+        // Restituisce uno snapshot dei valori correnti (usato dagli exporter push).
+        virtual MetricData Collect() const = 0;
+
+        // Footprint dello strumento, esposto come otel_metric_series/otel_metric_memory_bytes.
+        virtual size_t SeriesCount() const { return 1; }
+        virtual size_t MemoryBytes() const { return 0; }
+        // Bind finiti nella serie di overflow per il limite di cardinalità.
+        virtual uint64_t OverflowedBinds() const { return 0; }
+        // Numero massimo di serie (default: DefaultCardinalityLimit()).
+        virtual void SetCardinalityLimit(size_t) {}
+
+        // Persistenza (StateFile): SaveState passa a `sink` i valori grezzi di ogni serie
+        // (nell'unità interna), RestoreState li somma alla serie corrispondente al riavvio.
+        // Di default lo strumento non viene salvato: i gauge sono valori istantanei e gli
+        // strumenti osservabili vengono ricalcolati dalle callback.
+        using StateSink = std::function<void(const SortedLabels& labels, const int64_t* values, size_t count)>;
+        virtual void SaveState(const StateSink&) const {}
+        virtual void RestoreState(const SortedLabels&, const int64_t*, size_t) {}
+
+        // Restituisce le serie in formato testo compatibile con Prometheus.
+        std::string GetPrometheusFormat() const {
+            std::string out;
+            WritePrometheus(out);
+            return out;
+        }
+    };
+
+    // Rappresenta una Metrica (contatore) in stile OpenTelemetry minimale.
+    // Supporta label per distinguere valori diversi della stessa metrica.
+    class Metric : public Instrument {
+    private:
+        std::string name;        // Nome della metrica (es. "request_count")
+        std::string description; // Descrizione della metrica
+        std::string header;      // Righe HELP/TYPE pre-renderizzate
+        // Memorizza le serie della metrica associate a diverse combinazioni di label.
+        SeriesMap<CounterCell> values;
+
+    public:
+        // Costruttore: Inizializza nome e descrizione della metrica.
+        Metric(const std::string& n, const std::string& desc)
+            : name(n), description(desc), header(RenderHeader(n, desc, "counter")) {}
+
+        // Risolve una combinazione di label nella relativa cella, creandola se necessario.
+        // Da chiamare una volta (es. all'avvio o alla prima occorrenza), non per ogni incremento.
+        BoundCounter Bind(const LabelSet& labels = {}) {
+            return BoundCounter(values.Bind(labels,
+                [] { return std::make_unique<CounterCell>(); },
+                [this](const std::string& labels_text) {
+                    return std::vector<std::string>{ RenderSeriesPrefix(name, labels_text) };
+                }));
+        }
+
+        // Aggiunge un valore al contatore, opzionalmente con label.
+        // Comodo ma risolve le label a ogni chiamata: nei percorsi caldi usare Bind()
+        // una volta e poi BoundCounter::Add().
+        void Add(int64_t value, const LabelSet& labels = {}) {
+            Bind(labels).Add(value);
+        }
+
+        size_t SeriesCount() const override { return values.Size(); }
+        size_t MemoryBytes() const override { return sizeof(*this) + header.capacity() + values.MemoryBytes(); }
+        uint64_t OverflowedBinds() const override { return values.GetOverflowedBinds(); }
+        void SetCardinalityLimit(size_t max_series) override { values.SetLimit(max_series); }
+
+        // Stato persistente: un solo valore per serie, il totale cumulativo.
+        void SaveState(const StateSink& sink) const override {
+            values.ForEach([&](const SeriesMap<CounterCell>::Series& series) {
+                int64_t value = series.cell->Sum();
+                sink(values.LabelsOf(series), &value, 1);
+            });
+        }
+
+        void RestoreState(const SortedLabels& labels, const int64_t* state, size_t count) override {
+            if (count != 1) return;
+            Bind(LabelSet(labels.begin(), labels.end())).Add(state[0]);
+        }
+
+        // Restituisce uno snapshot dei valori correnti (somma degli shard per ogni serie).
+        MetricData Collect() const override {
+            MetricData data;
+            data.name = name;
+            data.description = description;
+            data.kind = InstrumentKind::Counter;
+            values.ForEach([&](const SeriesMap<CounterCell>::Series& series) {
+                MetricPoint point;
+                point.labels = values.LabelsOf(series);
+                point.value = series.cell->Sum();
+                data.points.push_back(std::move(point));
+            });
+            return data;
+        }
+
+        // Esposizione Prometheus: il valore di ogni serie è la somma dei suoi shard.
+        void WritePrometheus(std::string& out) const override {
+            out += header;
+            values.ForEach([&](const SeriesMap<CounterCell>::Series& series) {
+                out += series.prefixes[0];
+                AppendInt(out, series.cell->Sum());
+                out += '\n';
+            });
+        }
+    };
+
+    // Cella di un gauge: un singolo atomico su una propria cache line.
+    // Un gauge rappresenta un valore istantaneo (Set), quindi non viene suddiviso in shard.
+    struct alignas(kCacheLineSize) GaugeCell {
+        std::atomic<int64_t> value{ 0 };
+
+        size_t MemoryBytes() const { return sizeof(*this); }
+    };
+
+    // Handle pre-risolto verso la cella di un gauge per una combinazione di label.
+    class BoundGauge {
+    private:
+        GaugeCell* cell = nullptr;
+
+    public:
+        BoundGauge() = default;
+        explicit BoundGauge(GaugeCell* c) : cell(c) {}
+
+        void Set(int64_t value) const { cell->value.store(value, std::memory_order_relaxed); }
+        void Add(int64_t delta) const { cell->value.fetch_add(delta, std::memory_order_relaxed); }
+        int64_t Value() const { return cell->value.load(std::memory_order_relaxed); }
+
+        bool IsValid() const { return cell != nullptr; }
+    };
+
+    // Gauge: valore istantaneo che può salire e scendere (es. richieste in corso, timestamp).
+    class Gauge : public Instrument {
+    private:
+        std::string name;
+        std::string description;
+        std::string header;
+        SeriesMap<GaugeCell> values;
+
+    public:
+        Gauge(const std::string& n, const std::string& desc)
+            : name(n), description(desc), header(RenderHeader(n, desc, "gauge")) {}
+
+        BoundGauge Bind(const LabelSet& labels = {}) {
+            return BoundGauge(values.Bind(labels,
+                [] { return std::make_unique<GaugeCell>(); },
+                [this](const std::string& labels_text) {
+                    return std::vector<std::string>{ RenderSeriesPrefix(name, labels_text) };
+                }));
+        }
+
+        size_t SeriesCount() const override { return values.Size(); }
+        size_t MemoryBytes() const override { return sizeof(*this) + header.capacity() + values.MemoryBytes(); }
+        uint64_t OverflowedBinds() const override { return values.GetOverflowedBinds(); }
+        void SetCardinalityLimit(size_t max_series) override { values.SetLimit(max_series); }
+
+        MetricData Collect() const override {
+            MetricData data;
+            data.name = name;
+            data.description = description;
+            data.kind = InstrumentKind::Gauge;
+            values.ForEach([&](const SeriesMap<GaugeCell>::Series& series) {
+                MetricPoint point;
+                point.labels = values.LabelsOf(series);
+                point.value = series.cell->value.load(std::memory_order_relaxed);
+                data.points.push_back(std::move(point));
+            });
+            return data;
+        }
+
+        void WritePrometheus(std::string& out) const override {
+            out += header;
+            values.ForEach([&](const SeriesMap<GaugeCell>::Series& series) {
+                out += series.prefixes[0];
+                AppendInt(out, series.cell->value.load(std::memory_order_relaxed));
+                out += '\n';
+            });
+        }
+    };
+
+    // Limiti esponenziali dei bucket: start, start*factor, start*factor^2, ... (count limiti).
+    // Es. ExponentialBuckets(50000, 2, 16) copre da 50us a ~1.6s se i valori sono in nanosecondi.
+    inline std::vector<uint64_t> ExponentialBuckets(uint64_t start, double factor, size_t count) {
+        std::vector<uint64_t> bounds;
+        bounds.reserve(count);
+        double bound = static_cast<double>(start);
+        for (size_t i = 0; i < count; ++i) {
+            bounds.push_back(static_cast<uint64_t>(bound));
+            bound *= factor;
+        }
+        return bounds;
+    }
+
+    // Istante corrente in ns Unix con la risoluzione del tick del kernel (CLOCK_REALTIME_COARSE,
+    // pochi ms): letto dal vDSO senza interrogare l'hardware, costa una frazione di
+    // system_clock::now(). Non supera mai l'istante reale, quindi un esemplare non cade
+    // nell'intervallo di export successivo alla sua osservazione.
+    inline uint64_t CoarseUnixNano() {
+#if defined(CLOCK_REALTIME_COARSE)
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+#else
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    // Cella di un istogramma, suddivisa in shard come CounterCell.
+    // Ogni shard è una riga contigua di atomici allineata alla cache line:
+    //   [bucket_0 ... bucket_{n-1}, bucket_+Inf, somma]
+    // Record() è una ricerca binaria sui limiti più due fetch_add relaxed sullo shard
+    // del thread corrente; gli shard vengono sommati solo allo scrape.
+    class HistogramCell {
+    private:
+        static constexpr size_t kSlotsPerLine = kCacheLineSize / sizeof(std::atomic<uint64_t>);
+        struct alignas(kCacheLineSize) Line {
+            std::atomic<uint64_t> slots[kSlotsPerLine];
+        };
+
+        // Ultimo esemplare di un bucket, protetto da un seqlock: `sequence` è dispari durante
+        // la scrittura. Chi trova il bucket già in scrittura rinuncia (l'esemplare è solo un
+        // campione) invece di attendere, quindi Record() non si blocca mai.
+        struct ExemplarSlot {
+            std::atomic<uint32_t> sequence{ 0 }; // 0: mai scritto
+            std::atomic<uint64_t> words[5];      // trace_id (2 parole), span_id, valore (unità interna), istante (ns Unix)
+        };
+
+        const std::vector<uint64_t>& bounds; // Limiti superiori (inclusivi), posseduti dall'Histogram
+        size_t lines_per_shard;
+        std::unique_ptr<Line[]> lines;
+        // Allocati alla prima osservazione dentro uno span campionato: le serie mai
+        // toccate da una richiesta tracciata non pagano la memoria degli esemplari.
+        std::atomic<ExemplarSlot*> exemplars{ nullptr };
+
+        size_t SumSlot() const { return bounds.size() + 1; }
+
+        std::atomic<uint64_t>& Slot(size_t shard, size_t index) const {
+            return lines[shard * lines_per_shard + index / kSlotsPerLine].slots[index % kSlotsPerLine];
+        }
+
+        void RecordExemplar(size_t bucket, uint64_t value, const Span& span) {
+            ExemplarSlot* slots = exemplars.load(std::memory_order_acquire);
+            if (!slots) {
+                auto* fresh = new ExemplarSlot[bounds.size() + 1]();
+                if (exemplars.compare_exchange_strong(slots, fresh, std::memory_order_acq_rel)) slots = fresh;
+                else delete[] fresh; // Installati da un altro thread: `slots` punta ai suoi
+            }
+            ExemplarSlot& slot = slots[bucket];
+            uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+            if ((sequence & 1) != 0 ||
+                !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire)) {
+                return;
+            }
+            uint64_t words[3];
+            std::memcpy(words, span.GetContext().trace_id.data(), 16);
+            std::memcpy(words + 2, span.GetContext().span_id.data(), 8);
+            for (size_t i = 0; i < 3; ++i) slot.words[i].store(words[i], std::memory_order_relaxed);
+            slot.words[3].store(value, std::memory_order_relaxed);
+            slot.words[4].store(CoarseUnixNano(), std::memory_order_relaxed); // Istante dell'osservazione
+            slot.sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+    public:
+        explicit HistogramCell(const std::vector<uint64_t>& b)
+            : bounds(b),
+            lines_per_shard((b.size() + 2 + kSlotsPerLine - 1) / kSlotsPerLine),
+            lines(new Line[lines_per_shard * kCounterShards]()) {} // () azzera gli atomici
+
+        ~HistogramCell() { delete[] exemplars.load(std::memory_order_relaxed); }
+
+        HistogramCell(const HistogramCell&) = delete;
+        HistogramCell& operator=(const HistogramCell&) = delete;
+
+        // Se il thread ha uno span campionato attivo, l'osservazione diventa anche
+        // l'esemplare del suo bucket (collegamento metrica -> traccia per OpenMetrics).
+        void Record(uint64_t value) {
+            // Primo limite >= value: il bucket "le" che contiene il valore (bounds.size() = +Inf)
+            size_t bucket = static_cast<size_t>(std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin());
+            size_t shard = ThisThreadShard();
+            Slot(shard, bucket).fetch_add(1, std::memory_order_relaxed);
+            Slot(shard, SumSlot()).fetch_add(value, std::memory_order_relaxed);
+            const Span* span = Span::Current();
+            if (span && span->IsRecording()) RecordExemplar(bucket, value, *span);
+        }
+
+        size_t MemoryBytes() const {
+            size_t bytes = sizeof(*this) + lines_per_shard * kCounterShards * sizeof(Line);
+            if (exemplars.load(std::memory_order_relaxed)) bytes += (bounds.size() + 1) * sizeof(ExemplarSlot);
+            return bytes;
+        }
+
+        // Legge l'esemplare di ogni bucket (valori moltiplicati per `scale`). `out` resta vuoto
+        // se la serie non ha mai registrato esemplari; un bucket in scrittura viene saltato.
+        void SnapshotExemplars(std::vector<Exemplar>& out, double scale) const {
+            out.clear();
+            const ExemplarSlot* slots = exemplars.load(std::memory_order_acquire);
+            if (!slots) return;
+            out.resize(bounds.size() + 1);
+            for (size_t i = 0; i <= bounds.size(); ++i) {
+                const ExemplarSlot& slot = slots[i];
+                for (int attempt = 0; attempt < 4; ++attempt) {
+                    uint32_t before = slot.sequence.load(std::memory_order_acquire);
+                    if (before == 0) break;
+                    if ((before & 1) != 0) continue;
+                    uint64_t words[5];
+                    for (size_t w = 0; w < 5; ++w) words[w] = slot.words[w].load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+                    std::memcpy(out[i].trace_id.data(), words, 16);
+                    std::memcpy(out[i].span_id.data(), words + 2, 8);
+                    out[i].value = static_cast<double>(words[3]) * scale;
+                    out[i].time_unix_nano = words[4];
+                    break;
+                }
+            }
+        }
+
+        // Somma gli shard: conteggi per bucket (non cumulativi) e somma totale.
+        // Somma conteggi per bucket (bounds.size() + 1) e somma salvati da un'esecuzione
+        // precedente. Usa lo shard 0: è chiamato una volta all'avvio.
+        void Restore(const int64_t* bucket_counts, int64_t sum) {
+            for (size_t i = 0; i <= bounds.size(); ++i) {
+                Slot(0, i).fetch_add(static_cast<uint64_t>(bucket_counts[i]), std::memory_order_relaxed);
+            }
+            Slot(0, SumSlot()).fetch_add(static_cast<uint64_t>(sum), std::memory_order_relaxed);
+        }
+
+        void Snapshot(std::vector<uint64_t>& bucket_counts, uint64_t& sum) const {
+            bucket_counts.assign(bounds.size() + 1, 0);
+            sum = 0;
+            for (size_t shard = 0; shard < kCounterShards; ++shard) {
+                for (size_t i = 0; i <= bounds.size(); ++i) {
+                    bucket_counts[i] += Slot(shard, i).load(std::memory_order_relaxed);
+                }
+                sum += Slot(shard, SumSlot()).load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // Handle pre-risolto verso la cella di un istogramma per una combinazione di label.
+    class BoundHistogram {
+    private:
+        HistogramCell* cell = nullptr;
+
+    public:
+        BoundHistogram() = default;
+        explicit BoundHistogram(HistogramCell* c) : cell(c) {}
+
+        void Record(uint64_t value) const { cell->Record(value); }
+
+        // Registra una durata in nanosecondi (l'unità interna degli istogrammi di latenza).
+        template <typename Rep, typename Period>
+        void Record(std::chrono::duration<Rep, Period> duration) const {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            cell->Record(ns > 0 ? static_cast<uint64_t>(ns) : 0);
+        }
+
+        bool IsValid() const { return cell != nullptr; }
+    };
+
+    // Istogramma con bucket configurabili (espliciti o ExponentialBuckets).
+    // I valori sono registrati come interi nell'unità di misura interna (es. nanosecondi)
+    // ed esposti moltiplicati per `scale` (es. 1e-9 per esporre secondi, come da convenzione Prometheus).
+    class Histogram : public Instrument {
+    private:
+        std::string name;
+        std::string description;
+        std::string header;
+        std::vector<uint64_t> bounds; // Ordinati, unità interna
+        double scale;                 // Fattore di conversione verso l'unità esposta
+        std::vector<std::string> le_labels; // le="..." pre-renderizzate, una per bucket + "+Inf"
+        SeriesMap<HistogramCell> values;
+
+    public:
+        Histogram(const std::string& n, const std::string& desc, std::vector<uint64_t> b, double s = 1.0)
+            : name(n), description(desc), header(RenderHeader(n, desc, "histogram")), bounds(std::move(b)), scale(s) {
+            std::sort(bounds.begin(), bounds.end());
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+            for (uint64_t bound : bounds) {
+                le_labels.push_back("le=\"" + FormatDouble(static_cast<double>(bound) * scale) + "\"");
+            }
+            le_labels.push_back("le=\"+Inf\"");
+        }
+
+        // Ogni serie pre-renderizza le righe _bucket (una per limite), _sum e _count.
+        BoundHistogram Bind(const LabelSet& labels = {}) {
+            return BoundHistogram(BindCell(labels));
+        }
+
+    private:
+        HistogramCell* BindCell(const LabelSet& labels) {
+            return values.Bind(labels,
+                [this] { return std::make_unique<HistogramCell>(bounds); },
+                [this](const std::string& labels_text) {
+                    std::vector<std::string> prefixes;
+                    prefixes.reserve(le_labels.size() + 2);
+                    for (const auto& le : le_labels) {
+                        prefixes.push_back(RenderSeriesPrefix(name + "_bucket", labels_text, le));
+                    }
+                    prefixes.push_back(RenderSeriesPrefix(name + "_sum", labels_text));
+                    prefixes.push_back(RenderSeriesPrefix(name + "_count", labels_text));
+                    return prefixes;
+                });
+        }
+
+    public:
+
+        void Record(uint64_t value, const LabelSet& labels = {}) {
+            Bind(labels).Record(value);
+        }
+
+        size_t SeriesCount() const override { return values.Size(); }
+        size_t MemoryBytes() const override {
+            return sizeof(*this) + header.capacity() + bounds.capacity() * sizeof(uint64_t) + values.MemoryBytes();
+        }
+        uint64_t OverflowedBinds() const override { return values.GetOverflowedBinds(); }
+        void SetCardinalityLimit(size_t max_series) override { values.SetLimit(max_series); }
+
+        // Stato persistente: conteggi per bucket (non cumulativi, +Inf compreso) e somma grezza.
+        // Al riavvio viene accettato solo se il numero di bucket non è cambiato.
+        void SaveState(const StateSink& sink) const override {
+            std::vector<uint64_t> bucket_counts;
+            std::vector<int64_t> state;
+            values.ForEach([&](const SeriesMap<HistogramCell>::Series& series) {
+                uint64_t raw_sum;
+                series.cell->Snapshot(bucket_counts, raw_sum);
+                state.assign(bucket_counts.begin(), bucket_counts.end());
+                state.push_back(static_cast<int64_t>(raw_sum));
+                sink(values.LabelsOf(series), state.data(), state.size());
+            });
+        }
+
+        void RestoreState(const SortedLabels& labels, const int64_t* state, size_t count) override {
+            if (count != bounds.size() + 2) return;
+            BindCell(LabelSet(labels.begin(), labels.end()))->Restore(state, state[bounds.size() + 1]);
+        }
+
+        MetricData Collect() const override {
+            MetricData data;
+            data.name = name;
+            data.description = description;
+            data.kind = InstrumentKind::Histogram;
+            data.bounds.reserve(bounds.size());
+            for (uint64_t bound : bounds) {
+                data.bounds.push_back(static_cast<double>(bound) * scale);
+            }
+            values.ForEach([&](const SeriesMap<HistogramCell>::Series& series) {
+                MetricPoint point;
+                point.labels = values.LabelsOf(series);
+                uint64_t raw_sum;
+                series.cell->Snapshot(point.bucket_counts, raw_sum);
+                series.cell->SnapshotExemplars(point.exemplars, scale);
+                for (uint64_t c : point.bucket_counts) point.count += c;
+                point.sum = static_cast<double>(raw_sum) * scale;
+                data.points.push_back(std::move(point));
+            });
+            return data;
+        }
+
+        // Esposizione Prometheus: serie _bucket cumulative (con "le"), _sum e _count.
+        void WritePrometheus(std::string& out) const override {
+            out += header;
+            std::vector<uint64_t> bucket_counts;
+            values.ForEach([&](const SeriesMap<HistogramCell>::Series& series) {
+                uint64_t raw_sum;
+                series.cell->Snapshot(bucket_counts, raw_sum);
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < bucket_counts.size(); ++i) {
+                    cumulative += bucket_counts[i];
+                    out += series.prefixes[i];
+                    AppendUint(out, cumulative);
+                    out += '\n';
+                }
+                out += series.prefixes[bucket_counts.size()];
+                AppendDouble(out, static_cast<double>(raw_sum) * scale);
+                out += '\n';
+                out += series.prefixes[bucket_counts.size() + 1];
+                AppendUint(out, cumulative);
+                out += '\n';
+            });
+        }
+    };
+
+    // Strumento osservabile (asincrono): il valore non viene aggiornato dal codice instrumentato
+    // ma letto da una callback a ogni scrape/export, come ObservableCounter/ObservableGauge
+    // di OpenTelemetry. Adatto a valori già mantenuti altrove (contatori interni, code).
+    class ObservableInstrument : public Instrument {
+    public:
+        using Callback = std::function<int64_t()>;
+
+    private:
+        std::string name;
+        std::string description;
+        InstrumentKind kind; // Counter o Gauge
+        std::string header;
+        Callback callback;
+
+    public:
+        ObservableInstrument(const std::string& n, const std::string& desc, InstrumentKind k, Callback cb)
+            : name(n), description(desc), kind(k),
+            header(RenderHeader(n, desc, k == InstrumentKind::Counter ? "counter" : "gauge")), callback(std::move(cb)) {}
+
+        MetricData Collect() const override {
+            MetricData data;
+            data.name = name;
+            data.description = description;
+            data.kind = kind;
+            MetricPoint point;
+            point.value = callback();
+            data.points.push_back(std::move(point));
+            return data;
+        }
+
+        void WritePrometheus(std::string& out) const override {
+            out += header;
+            out += name;
+            out += ' ';
+            AppendInt(out, callback());
+            out += '\n';
+        }
+    };
+
+    // Registry Singleton per gestire tutte le metriche OpenTelemetry (minimali).
+    // Assicura che ci sia una singola istanza del registry per creare e accedere alle metriche.
+    //
+    // Gli strumenti sono pubblicati una sola volta e mai rimossi (stile RCU senza reclamation):
+    // - una lista append-only in ordine di registrazione, percorsa da scrape ed export;
+    // - un indice per nome a indirizzamento aperto, sostituito da una copia più grande
+    //   quando si riempie. Le tabelle sostituite restano vive fino alla distruzione del
+    //   registry, quindi un lettore che ne tiene ancora il puntatore non legge mai memoria liberata.
+    // Ricerche e iterazioni non prendono lock e possono procedere mentre si registrano nuovi
+    // strumenti; solo la registrazione si sincronizza (registration_mutex).
+    class MetricsRegistry {
+    private:
+        struct Entry {
+            std::string name;
+            size_t hash;
+            std::unique_ptr<Instrument> instrument;
+            std::atomic<Entry*> next{ nullptr }; // Entry registrata subito dopo
+        };
+
+        // Tabella immutabile nella dimensione; gli slot vuoti vengono riempiti una sola volta
+        // (store release) dal thread che registra.
+        struct Index {
+            explicit Index(size_t capacity) : slots(new std::atomic<Entry*>[capacity]), mask(capacity - 1) {
+                for (size_t i = 0; i < capacity; ++i) slots[i].store(nullptr, std::memory_order_relaxed);
+            }
+            std::unique_ptr<std::atomic<Entry*>[]> slots;
+            size_t mask;
+        };
+
+        std::atomic<Entry*> head{ nullptr };
+        Entry* tail = nullptr;                 // Solo sotto registration_mutex
+        std::atomic<size_t> entry_count{ 0 };
+        std::atomic<Index*> index;
+        std::vector<std::unique_ptr<Index>> indexes; // Tabelle correnti e sostituite (sotto registration_mutex)
+        std::vector<std::unique_ptr<Entry>> entries; // Proprietà delle entry (sotto registration_mutex)
+        std::mutex registration_mutex;
+
+        // Costruttore privato per impedire l'instanziazione diretta (Singleton).
+        MetricsRegistry() {
+            indexes.push_back(std::make_unique<Index>(64));
+            index.store(indexes.back().get(), std::memory_order_release);
+        }
+
+        // Ricerca senza lock: probing lineare sulla tabella pubblicata più di recente.
+        Entry* Find(const std::string& name, size_t hash) const {
+            const Index* table = index.load(std::memory_order_acquire);
+            for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+                Entry* entry = table->slots[i].load(std::memory_order_acquire);
+                if (!entry) return nullptr;
+                if (entry->hash == hash && entry->name == name) return entry;
+            }
+        }
+
+        static void Insert(Index& table, Entry* entry) {
+            size_t i = entry->hash & table.mask;
+            while (table.slots[i].load(std::memory_order_relaxed)) i = (i + 1) & table.mask;
+            table.slots[i].store(entry, std::memory_order_release);
+        }
+
+        // Visita le entry in ordine di registrazione, senza lock.
+        template <typename Fn>
+        void ForEachEntry(Fn fn) const {
+            for (const Entry* entry = head.load(std::memory_order_acquire); entry;
+                entry = entry->next.load(std::memory_order_acquire)) {
+                fn(*entry);
+            }
+        }
+
+        // Crea lo strumento con make() se il nome non è registrato; altrimenti restituisce
+        // quello esistente, o nullptr se con lo stesso nome è registrato uno strumento di altro tipo.
+        // Se lo strumento esiste già costa una ricerca senza lock.
+        template <typename T, typename Make>
+        T* GetOrCreate(const std::string& name, Make make) {
+            const size_t hash = std::hash<std::string>{}(name);
+            if (Entry* entry = Find(name, hash)) {
+                return dynamic_cast<T*>(entry->instrument.get());
+            }
+
+            std::unique_lock<std::mutex> lock(registration_mutex, std::defer_lock);
+            LockAndMeasureWait(lock);
+            if (Entry* entry = Find(name, hash)) {
+                return dynamic_cast<T*>(entry->instrument.get());
+            }
+
+            auto owned = std::make_unique<Entry>();
+            owned->name = name;
+            owned->hash = hash;
+            owned->instrument = make();
+            Entry* entry = owned.get();
+            entries.push_back(std::move(owned));
+
+            // Riempimento massimo 1/2: oltre, si pubblica una copia di dimensione doppia.
+            // I lettori vedono la vecchia tabella (ancora valida) o la nuova, già completa.
+            Index* table = index.load(std::memory_order_relaxed);
+            size_t count = entry_count.load(std::memory_order_relaxed) + 1;
+            if (count * 2 > table->mask + 1) {
+                auto grown = std::make_unique<Index>((table->mask + 1) * 2);
+                for (const auto& existing : entries) Insert(*grown, existing.get());
+                index.store(grown.get(), std::memory_order_release);
+                indexes.push_back(std::move(grown));
+            }
+            else {
+                Insert(*table, entry);
+            }
+
+            // Pubblicazione nella lista: da qui lo strumento è visibile a scrape ed export
+            if (tail) tail->next.store(entry, std::memory_order_release);
+            else head.store(entry, std::memory_order_release);
+            tail = entry;
+            entry_count.store(count, std::memory_order_relaxed);
+            return dynamic_cast<T*>(entry->instrument.get());
+        }
+
+    public:
+        // Cancella costruttori di copia e assegnazione per garantire che sia Singleton.
+        MetricsRegistry(const MetricsRegistry&) = delete;
+        MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+        MetricsRegistry(MetricsRegistry&&) = delete;
+        MetricsRegistry& operator=(MetricsRegistry&&) = delete;
+
+        // Metodo statico per ottenere l'unica istanza del registry.
+        static MetricsRegistry& Instance() {
+            static MetricsRegistry instance; // Creata al primo utilizzo (thread-safe in C++11+)
+            return instance;
+        }
+
+        // Crea o restituisce un contatore esistente. Thread-safe.
+        Metric* CreateCounter(const std::string& name, const std::string& description) {
+            return GetOrCreate<Metric>(name, [&] { return std::make_unique<Metric>(name, description); });
+        }
+
+        // Crea o restituisce un gauge esistente.
+        Gauge* CreateGauge(const std::string& name, const std::string& description) {
+            return GetOrCreate<Gauge>(name, [&] { return std::make_unique<Gauge>(name, description); });
+        }
+
+        // Crea o restituisce un istogramma esistente. `bounds` sono i limiti superiori dei bucket
+        // nell'unità interna; `scale` converte verso l'unità esposta (es. 1e-9: da ns a secondi).
+        Histogram* CreateHistogram(const std::string& name, const std::string& description,
+            std::vector<uint64_t> bounds, double scale = 1.0) {
+            return GetOrCreate<Histogram>(name, [&] {
+                return std::make_unique<Histogram>(name, description, std::move(bounds), scale);
+            });
+        }
+
+        // Registra un contatore osservabile: `callback` restituisce il totale cumulativo corrente.
+        ObservableInstrument* CreateObservableCounter(const std::string& name, const std::string& description,
+            ObservableInstrument::Callback callback) {
+            return GetOrCreate<ObservableInstrument>(name, [&] {
+                return std::make_unique<ObservableInstrument>(name, description, InstrumentKind::Counter, std::move(callback));
+            });
+        }
+
+        // Registra un gauge osservabile: `callback` restituisce il valore istantaneo.
+        ObservableInstrument* CreateObservableGauge(const std::string& name, const std::string& description,
+            ObservableInstrument::Callback callback) {
+            return GetOrCreate<ObservableInstrument>(name, [&] {
+                return std::make_unique<ObservableInstrument>(name, description, InstrumentKind::Gauge, std::move(callback));
+            });
+        }
+
+        // Restituisce le metriche di tutte le metriche registrate in formato Prometheus.
+        std::string GetAllMetrics() const {
+            std::string out;
+            WritePrometheus(out);
+            return out;
+        }
+
+        // Aggiunge al buffer `out` l'esposizione di tutte le metriche registrate, in ordine di
+        // registrazione. Non prende lock: può procedere in parallelo alla creazione di nuove metriche.
+        void WritePrometheus(std::string& out) const {
+            ForEachEntry([&](const Entry& entry) {
+                entry.instrument->WritePrometheus(out);
+                out += '\n';
+            });
+            WriteFootprint(out);
+        }
+
+        // Footprint di ogni strumento (serie, memoria stimata, overflow di cardinalità)
+        // e della tabella delle label internate, come snapshot aggiunti a `out`.
+        void CollectFootprint(std::vector<MetricData>& out) const {
+            auto add_family = [&](const char* family, const char* help, InstrumentKind kind, auto value_of) {
+                MetricData data;
+                data.name = family;
+                data.description = help;
+                data.kind = kind;
+                ForEachEntry([&](const Entry& entry) {
+                    MetricPoint point;
+                    point.labels.emplace_back("metric", entry.name);
+                    point.value = static_cast<int64_t>(value_of(*entry.instrument));
+                    data.points.push_back(std::move(point));
+                });
+                out.push_back(std::move(data));
+            };
+            add_family("otel_metric_series", "Serie attive per strumento", InstrumentKind::Gauge,
+                [](const Instrument& metric) { return metric.SeriesCount(); });
+            add_family("otel_metric_memory_bytes", "Memoria stimata per strumento (celle, indice, righe pre-renderizzate)", InstrumentKind::Gauge,
+                [](const Instrument& metric) { return metric.MemoryBytes(); });
+            add_family("otel_metric_cardinality_overflow_total", "Bind confluiti nella serie di overflow per il limite di cardinalita'", InstrumentKind::Counter,
+                [](const Instrument& metric) { return metric.OverflowedBinds(); });
+
+            const LabelInterner& interner = LabelInterner::Instance();
+            auto add_gauge = [&](const char* family, const char* help, size_t value) {
+                MetricData data;
+                data.name = family;
+                data.description = help;
+                data.kind = InstrumentKind::Gauge;
+                data.points.emplace_back();
+                data.points.back().value = static_cast<int64_t>(value);
+                out.push_back(std::move(data));
+            };
+            add_gauge("otel_label_interner_strings", "Stringhe di label internate", interner.Size());
+            add_gauge("otel_label_interner_memory_bytes", "Memoria stimata della tabella delle label internate", interner.MemoryBytes());
+        }
+
+        void WriteFootprint(std::string& out) const {
+            std::vector<MetricData> families;
+            CollectFootprint(families);
+            for (const auto& family : families) AppendTextExposition(out, family, false);
+            out += '\n';
+        }
+
+        // Restituisce uno snapshot di tutte le metriche registrate (usato dagli exporter push).
+        std::vector<MetricData> Collect() const {
+            std::vector<MetricData> result;
+            result.reserve(entry_count.load(std::memory_order_relaxed));
+            ForEachEntry([&](const Entry& entry) {
+                result.push_back(entry.instrument->Collect());
+            });
+            return result;
+        }
+
+        // Strumento registrato con questo nome, o nullptr. Ricerca senza lock.
+        Instrument* Find(const std::string& name) const {
+            Entry* entry = Find(name, std::hash<std::string>{}(name));
+            return entry ? entry->instrument.get() : nullptr;
+        }
+
+        // Visita gli strumenti in ordine di registrazione: fn(nome, strumento). Senza lock.
+        template <typename Fn>
+        void ForEachInstrument(Fn fn) const {
+            ForEachEntry([&](const Entry& entry) { fn(entry.name, *entry.instrument); });
+        }
+
+        // Numero di strumenti registrati.
+        size_t Size() const {
+            return entry_count.load(std::memory_order_relaxed);
+        }
+    };
+
+    // Pubblica nel registry i costi misurati da SelfTelemetry. I tempi sono totali in nanosecondi:
+    // in Grafana il costo medio è rate(..._nanoseconds_total) / rate(..._total).
+    inline void RegisterSelfTelemetry() {
+        MetricsRegistry& registry = MetricsRegistry::Instance();
+        SelfTelemetry& telemetry = SelfTelemetry::Instance();
+        registry.CreateObservableCounter("otel_telemetry_span_end_total",
+            "Span registrati terminati (Span::End)",
+            [&telemetry] { return telemetry.span_end_count.Sum(); });
+        registry.CreateObservableCounter("otel_telemetry_span_end_nanoseconds_total",
+            "Tempo totale speso in Span::End sui thread delle richieste (ns)",
+            [&telemetry] { return telemetry.span_end_nanos.Sum(); });
+        registry.CreateObservableCounter("otel_telemetry_metric_lock_contended_total",
+            "Acquisizioni contese dei lock della telemetria (serie, registry, indice dei percorsi)",
+            [&telemetry] { return telemetry.lock_contentions.Sum(); });
+        registry.CreateObservableCounter("otel_telemetry_metric_lock_wait_nanoseconds_total",
+            "Tempo totale di attesa su quei lock (ns)",
+            [&telemetry] { return telemetry.lock_wait_nanos.Sum(); });
+        registry.CreateObservableCounter("otel_telemetry_request_arena_upstream_bytes_total",
+            "Byte chiesti all'heap dalle arene per richiesta oltre il blocco iniziale",
+            [&telemetry] { return telemetry.arena_upstream_bytes.Sum(); });
+        // Pipeline di tracing (coda e batch export degli span), se compilata
+        if constexpr (kTracingEnabled) {
+            BatchSpanProcessor& processor = TracerProvider::Instance().GetProcessor();
+            registry.CreateObservableCounter("otel_span_processor_dropped_spans_total",
+                "Span scartati perche' la coda era piena",
+                [&processor] { return static_cast<int64_t>(processor.GetDroppedSpans()); });
+            registry.CreateObservableCounter("otel_span_processor_exported_spans_total",
+                "Span esportati con successo",
+                [&processor] { return static_cast<int64_t>(processor.GetExportedSpans()); });
+            registry.CreateObservableCounter("otel_span_processor_export_failures_total",
+                "Batch la cui esportazione e' fallita",
+                [&processor] { return static_cast<int64_t>(processor.GetExportFailures()); });
+            registry.CreateObservableGauge("otel_span_processor_queue_size",
+                "Span attualmente in coda",
+                [&processor] { return static_cast<int64_t>(processor.GetQueueSize()); });
+            if (processor.HasTailSampler()) {
+                registry.CreateObservableCounter("otel_span_processor_tail_dropped_spans_total",
+                    "Span scartati dal tail sampling (tracce veloci e senza errori)",
+                    [&processor] { return static_cast<int64_t>(processor.GetTailDroppedSpans()); });
+            }
+            registry.CreateObservableGauge("otel_span_processor_queue_capacity",
+                "Capacita' della coda degli span (per il rapporto con otel_span_processor_queue_size)",
+                [&processor] { return static_cast<int64_t>(processor.GetQueueCapacity()); });
+        }
+    }
+
+    // --- Export OTLP/HTTP (protobuf) ---
+    // Encoder protobuf scritto a mano per i soli messaggi OTLP che ci servono
+    // (ExportTraceServiceRequest ed ExportMetricsServiceRequest), per non dipendere
+    // da libprotobuf e dal codice generato dai .proto di opentelemetry-proto.
+    // Link utile: https://github.com/open-telemetry/opentelemetry-proto
+    namespace proto {
+
+        // Tipi di campo del wire format protobuf.
+        enum WireType : uint32_t {
+            kVarint = 0,
+            kFixed64 = 1,
+            kLengthDelimited = 2,
+        };
+
+        // Serializza campi protobuf in un buffer. I messaggi annidati vengono
+        // costruiti in un Writer separato e inseriti con Message().
+        class Writer {
+        private:
+            std::string buffer;
+
+            void Tag(uint32_t field, WireType type) {
+                Varint((static_cast<uint64_t>(field) << 3) | type);
+            }
+
+        public:
+            void Varint(uint64_t value) {
+                while (value >= 0x80) {
+                    buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+                    value >>= 7;
+                }
+                buffer.push_back(static_cast<char>(value));
+            }
+
+            void Uint64(uint32_t field, uint64_t value) {
+                Tag(field, kVarint);
+                Varint(value);
+            }
+
+            void Enum(uint32_t field, int32_t value) {
+                Uint64(field, static_cast<uint64_t>(static_cast<int64_t>(value)));
+            }
+
+            void Bool(uint32_t field, bool value) {
+                Uint64(field, value ? 1 : 0);
+            }
+
+            void Fixed64(uint32_t field, uint64_t value) {
+                Tag(field, kFixed64);
+                RawFixed64(value);
+            }
+
+            void Double(uint32_t field, double value) {
+                uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                Fixed64(field, bits);
+            }
+
+            void Bytes(uint32_t field, const char* data, size_t size) {
+                Tag(field, kLengthDelimited);
+                Varint(size);
+                buffer.append(data, size);
+            }
+
+            void String(uint32_t field, std::string_view value) {
+                Bytes(field, value.data(), value.size());
+            }
+
+            void Message(uint32_t field, const Writer& message) {
+                Bytes(field, message.buffer.data(), message.buffer.size());
+            }
+
+            // Messaggio preceduto solo dalla lunghezza, senza tag (stream "delimited").
+            void Delimited(const Writer& message) {
+                Varint(message.buffer.size());
+                buffer.append(message.buffer);
+            }
+
+            // Campo repeated fixed64 in forma packed (un unico campo length-delimited).
+            void PackedFixed64(uint32_t field, const std::vector<uint64_t>& values) {
+                Tag(field, kLengthDelimited);
+                Varint(values.size() * 8);
+                for (uint64_t value : values) RawFixed64(value);
+            }
+
+            // Campo repeated double in forma packed.
+            void PackedDouble(uint32_t field, const std::vector<double>& values) {
+                Tag(field, kLengthDelimited);
+                Varint(values.size() * 8);
+                for (double value : values) {
+                    uint64_t bits;
+                    std::memcpy(&bits, &value, sizeof(bits));
+                    RawFixed64(bits);
+                }
+            }
+
+            // Scrive 8 byte little-endian senza tag (usato anche per i campi packed).
+            void RawFixed64(uint64_t value) {
+                for (int i = 0; i < 8; ++i) {
+                    buffer.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+                }
+            }
+
+            // Campi già serializzati di un altro Writer, accodati a quelli di questo messaggio.
+            void Append(const Writer& fields) {
+                buffer.append(fields.buffer);
+            }
+
+            const std::string& Data() const { return buffer; }
+            std::string Release() { return std::move(buffer); }
+        };
+
+        // KeyValue { key = 1; AnyValue value = 2 } con AnyValue { string_value = 1 }
+        inline Writer KeyValue(std::string_view key, std::string_view value) {
+            Writer any_value;
+            any_value.String(1, value);
+            Writer kv;
+            kv.String(1, key);
+            kv.Message(2, any_value);
+            return kv;
+        }
+
+        // KeyValue di un attributo tipizzato:
+        // AnyValue { string_value = 1; bool_value = 2; int_value = 3; double_value = 4 }
+        inline Writer AttributeKeyValue(const Attribute& attr) {
+            Writer any_value;
+            switch (attr.value.GetType()) {
+            case AttributeValue::Type::String: any_value.String(1, attr.value.GetString()); break;
+            case AttributeValue::Type::Bool: any_value.Bool(2, attr.value.GetBool()); break;
+            case AttributeValue::Type::Int: any_value.Uint64(3, static_cast<uint64_t>(attr.value.GetInt())); break;
+            case AttributeValue::Type::Double: any_value.Double(4, attr.value.GetDouble()); break;
+            }
+            Writer kv;
+            kv.String(1, attr.key.View());
+            kv.Message(2, any_value);
+            return kv;
+        }
+
+        // Resource { attributes = 1 } condivisa da tracce e metriche.
+        inline Writer Resource(const std::string& service_name) {
+            Writer resource;
+            resource.Message(1, KeyValue("service.name", service_name));
+            resource.Message(1, KeyValue("telemetry.sdk.name", "webserver-otel-minimal"));
+            resource.Message(1, KeyValue("telemetry.sdk.language", "cpp"));
+            return resource;
+        }
+
+        // InstrumentationScope { name = 1; version = 2 }
+        inline Writer Scope() {
+            Writer scope;
+            scope.String(1, "webserver");
+            scope.String(2, "1.0.0");
+            return scope;
+        }
+
+        // Costruisce il payload di ExportTraceServiceRequest per un batch di span.
+        inline std::string EncodeTraces(const std::vector<SpanData>& batch, const std::string& service_name) {
+            Writer scope_spans;
+            scope_spans.Message(1, Scope());
+            for (const auto& span : batch) {
+                Writer s;
+                // Gli ID sono già byte grezzi, come richiesto da OTLP: nessuna conversione
+                s.Bytes(1, reinterpret_cast<const char*>(span.context.trace_id.data()), span.context.trace_id.size());
+                s.Bytes(2, reinterpret_cast<const char*>(span.context.span_id.data()), span.context.span_id.size());
+                if (!span.context.trace_state.empty()) s.String(3, span.context.trace_state);
+                if (!IsZeroId(span.parent_span_id)) {
+                    s.Bytes(4, reinterpret_cast<const char*>(span.parent_span_id.data()), span.parent_span_id.size());
+                }
+                s.String(5, span.name.View());
+                s.Enum(6, static_cast<int32_t>(span.kind));
+                s.Fixed64(7, span.start_time_unix_nano);
+                s.Fixed64(8, span.end_time_unix_nano);
+                span.attributes.ForEach([&](const Attribute& attr) {
+                    s.Message(9, AttributeKeyValue(attr));
+                });
+                if (span.status != StatusCode::Unset) {
+                    Writer status; // Status { code = 3 }
+                    status.Enum(3, static_cast<int32_t>(span.status));
+                    s.Message(15, status);
+                }
+                scope_spans.Message(2, s);
+            }
+
+            Writer resource_spans;
+            resource_spans.Message(1, Resource(service_name));
+            resource_spans.Message(2, scope_spans);
+
+            Writer request;
+            request.Message(1, resource_spans);
+            return request.Release();
+        }
+
+        // NumberDataPoint { attributes = 7; start_time_unix_nano = 2; time_unix_nano = 3; as_int = 6 }
+        inline Writer NumberDataPoint(const MetricPoint& point, uint64_t start_time_unix_nano, uint64_t time_unix_nano) {
+            Writer data_point;
+            for (const auto& label : point.labels) {
+                data_point.Message(7, KeyValue(label.first, label.second));
+            }
+            data_point.Fixed64(2, start_time_unix_nano);
+            data_point.Fixed64(3, time_unix_nano);
+            data_point.Fixed64(6, static_cast<uint64_t>(point.value)); // as_int (sfixed64)
+            return data_point;
+        }
+
+        // HistogramDataPoint { attributes = 9; start = 2; time = 3; count = 4; sum = 5;
+        //                      bucket_counts = 6; explicit_bounds = 7; exemplars = 8 }
+        // Exemplar { time_unix_nano = 2; as_double = 3; span_id = 4; trace_id = 5 }
+        // Gli esemplari anteriori a `start` (export precedenti, in delta) non vengono ripetuti.
+        inline Writer HistogramDataPoint(const MetricPoint& point, const std::vector<double>& bounds,
+            uint64_t start_time_unix_nano, uint64_t time_unix_nano) {
+            Writer data_point;
+            for (const auto& label : point.labels) {
+                data_point.Message(9, KeyValue(label.first, label.second));
+            }
+            data_point.Fixed64(2, start_time_unix_nano);
+            data_point.Fixed64(3, time_unix_nano);
+            data_point.Fixed64(4, point.count);
+            data_point.Double(5, point.sum);
+            data_point.PackedFixed64(6, point.bucket_counts);
+            data_point.PackedDouble(7, bounds);
+            for (const Exemplar& exemplar : point.exemplars) {
+                if (!exemplar.IsValid() || exemplar.time_unix_nano < start_time_unix_nano) continue;
+                Writer e;
+                e.Fixed64(2, exemplar.time_unix_nano);
+                e.Double(3, exemplar.value);
+                e.Bytes(4, reinterpret_cast<const char*>(exemplar.span_id.data()), exemplar.span_id.size());
+                e.Bytes(5, reinterpret_cast<const char*>(exemplar.trace_id.data()), exemplar.trace_id.size());
+                data_point.Message(8, e);
+            }
+            return data_point;
+        }
+
+        // Costruisce il payload di ExportMetricsServiceRequest. I contatori diventano Sum
+        // monotone e gli istogrammi Histogram, con la temporalità indicata in MetricData
+        // (cumulativa per default, come l'esposizione Prometheus); i gauge diventano Gauge.
+        // start/time_unix_nano sono usati per le metriche che non hanno tempi propri.
+        inline std::string EncodeMetrics(const std::vector<MetricData>& metrics, const std::string& service_name,
+            uint64_t start_time_unix_nano, uint64_t time_unix_nano) {
+            Writer scope_metrics;
+            scope_metrics.Message(1, Scope());
+            for (const auto& metric : metrics) {
+                uint64_t start = metric.start_time_unix_nano ? metric.start_time_unix_nano : start_time_unix_nano;
+                uint64_t time = metric.time_unix_nano ? metric.time_unix_nano : time_unix_nano;
+                Writer data;
+                for (const auto& point : metric.points) {
+                    if (metric.kind == InstrumentKind::Histogram) {
+                        data.Message(1, HistogramDataPoint(point, metric.bounds, start, time));
+                    }
+                    else {
+                        data.Message(1, NumberDataPoint(point, start, time));
+                    }
+                }
+
+                Writer m;
+                m.String(1, metric.name);
+                m.String(2, metric.description);
+                switch (metric.kind) {
+                case InstrumentKind::Counter:
+                    data.Enum(2, static_cast<int32_t>(metric.temporality)); // aggregation_temporality
+                    data.Bool(3, true); // is_monotonic
+                    m.Message(7, data); // sum
+                    break;
+                case InstrumentKind::Gauge:
+                    m.Message(5, data); // gauge
+                    break;
+                case InstrumentKind::Histogram:
+                    data.Enum(2, static_cast<int32_t>(metric.temporality)); // aggregation_temporality
+                    m.Message(9, data); // histogram
+                    break;
+                }
+                scope_metrics.Message(2, m);
+            }
+
+            Writer resource_metrics;
+            resource_metrics.Message(1, Resource(service_name));
+            resource_metrics.Message(2, scope_metrics);
+
+            Writer request;
+            request.Message(1, resource_metrics);
+            return request.Release();
+        }
+
+        // --- Formato protobuf di Prometheus (io.prometheus.client, metrics.proto) ---
+        // LabelPair { name = 1; value = 2 }
+        inline Writer LabelPair(std::string_view name, std::string_view value) {
+            Writer pair;
+            pair.String(1, name);
+            pair.String(2, value);
+            return pair;
+        }
+
+        // MetricFamily { name = 1; help = 2; type = 3; metric = 4 }
+        // Metric { label = 1; gauge = 2; counter = 3; histogram = 7 }
+        // Counter/Gauge { value = 1 (double) }
+        // Histogram { sample_count = 1; sample_sum = 2; bucket = 3 }
+        // Bucket { cumulative_count = 1; upper_bound = 2; exemplar = 3 }
+        // Exemplar { label = 1; value = 2; timestamp = 3 }, Timestamp { seconds = 1; nanos = 2 }
+        // I contatori mantengono il nome completo (con _total), come nel formato testo.
+        inline Writer PrometheusMetricFamily(const MetricData& metric) {
+            enum : int32_t { kCounter = 0, kGauge = 1, kHistogram = 4 }; // MetricType
+            Writer family;
+            family.String(1, metric.name);
+            family.String(2, metric.description);
+            family.Enum(3, metric.kind == InstrumentKind::Counter ? kCounter :
+                metric.kind == InstrumentKind::Gauge ? kGauge : kHistogram);
+            std::string hex;
+            for (const auto& point : metric.points) {
+                Writer m;
+                for (const auto& label : point.labels) {
+                    m.Message(1, LabelPair(label.first, label.second));
+                }
+                if (metric.kind == InstrumentKind::Histogram) {
+                    Writer histogram;
+                    histogram.Uint64(1, point.count);
+                    histogram.Double(2, point.sum);
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i < point.bucket_counts.size(); ++i) {
+                        cumulative += point.bucket_counts[i];
+                        Writer bucket;
+                        bucket.Uint64(1, cumulative);
+                        bucket.Double(2, i < metric.bounds.size() ? metric.bounds[i] : std::numeric_limits<double>::infinity());
+                        if (i < point.exemplars.size() && point.exemplars[i].IsValid()) {
+                            const Exemplar& exemplar = point.exemplars[i];
+                            Writer e;
+                            hex.clear();
+                            AppendHex(hex, exemplar.trace_id.data(), exemplar.trace_id.size());
+                            e.Message(1, LabelPair("trace_id", hex));
+                            hex.clear();
+                            AppendHex(hex, exemplar.span_id.data(), exemplar.span_id.size());
+                            e.Message(1, LabelPair("span_id", hex));
+                            e.Double(2, exemplar.value);
+                            Writer timestamp;
+                            timestamp.Uint64(1, exemplar.time_unix_nano / 1000000000);
+                            timestamp.Uint64(2, exemplar.time_unix_nano % 1000000000);
+                            e.Message(3, timestamp);
+                            bucket.Message(3, e);
+                        }
+                        histogram.Message(3, bucket);
+                    }
+                    m.Message(7, histogram);
+                }
+                else {
+                    Writer value;
+                    value.Double(1, static_cast<double>(point.value));
+                    m.Message(metric.kind == InstrumentKind::Counter ? 3 : 2, value);
+                }
+                family.Message(4, m);
+            }
+            return family;
+        }
+    } // namespace proto
+
+    // --- Formati di esposizione per lo scrape ---
+    // Oltre al testo Prometheus 0.0.4 (righe pre-renderizzate, il percorso più veloce da
+    // generare) /metrics può servire OpenMetrics 1.0.0, che aggiunge gli esemplari dei
+    // bucket, e il protobuf di Prometheus (MetricFamily con prefisso di lunghezza), più
+    // economico da interpretare per il server Prometheus quando le serie sono molte.
+    // Entrambi sono generati dagli snapshot MetricData, come l'export OTLP.
+    enum class ExpositionFormat { PrometheusText, OpenMetricsText, PrometheusProtobuf };
+
+    inline const char* ExpositionContentType(ExpositionFormat format) {
+        switch (format) {
+        case ExpositionFormat::OpenMetricsText: return "application/openmetrics-text; version=1.0.0; charset=utf-8";
+        case ExpositionFormat::PrometheusProtobuf:
+            return "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited";
+        default: return "text/plain; version=0.0.4; charset=utf-8";
+        }
+    }
+
+    // OpenMetrics: tutte le famiglie seguite dal terminatore obbligatorio "# EOF".
+    inline void WriteOpenMetrics(std::string& out, const std::vector<MetricData>& families) {
+        for (const auto& family : families) AppendTextExposition(out, family, true);
+        out += "# EOF\n";
+    }
+
+    // Protobuf "delimited": ogni MetricFamily è preceduta dalla sua lunghezza in varint.
+    // Le famiglie senza serie vengono omesse, come fanno le librerie client di Prometheus.
+    inline void WritePrometheusProtobuf(std::string& out, const std::vector<MetricData>& families) {
+        proto::Writer stream;
+        for (const auto& family : families) {
+            if (!family.points.empty()) stream.Delimited(proto::PrometheusMetricFamily(family));
+        }
+        out += stream.Data();
+    }
+
+    // Opzioni comuni agli exporter OTLP/HTTP. I valori di default seguono le variabili
+    // d'ambiente standard OTEL_EXPORTER_OTLP_* (vedi FromEnvironment()).
+    struct OtlpHttpOptions {
+        std::string endpoint = "http://localhost:4318"; // Base URL del receiver OTLP/HTTP del Collector
+        std::string service_name = "webserver";
+        bool gzip = false;                                // Comprime i payload (richiede zlib)
+        std::chrono::milliseconds timeout{ 10000 };
+        int max_retries = 5;                              // Tentativi aggiuntivi dopo il primo
+        std::chrono::milliseconds initial_backoff{ 100 };
+        std::chrono::milliseconds max_backoff{ 5000 };
+
+        // Legge OTEL_EXPORTER_OTLP_ENDPOINT, OTEL_EXPORTER_OTLP_COMPRESSION,
+        // OTEL_EXPORTER_OTLP_TIMEOUT (ms) e OTEL_SERVICE_NAME.
+        static OtlpHttpOptions FromEnvironment() {
+            OtlpHttpOptions options;
+            if (const char* v = config::Get("OTEL_EXPORTER_OTLP_ENDPOINT")) options.endpoint = v;
+            if (const char* v = config::Get("OTEL_EXPORTER_OTLP_COMPRESSION")) options.gzip = std::string(v) == "gzip";
+            if (const char* v = config::Get("OTEL_EXPORTER_OTLP_TIMEOUT")) {
+                long timeout_ms = std::atol(v);
+                if (timeout_ms > 0) options.timeout = std::chrono::milliseconds(timeout_ms);
+            }
+            if (const char* v = config::Get("OTEL_SERVICE_NAME")) options.service_name = v;
+            return options;
+        }
+    };
+
+#ifdef OTEL_HAVE_ZLIB
+    // Comprime `input` in formato gzip (header e trailer inclusi) in un'unica chiamata a deflate.
+    // `output` può essere std::string o std::pmr::string (compressione nell'arena della richiesta).
+    template <typename String>
+    inline bool GzipCompress(std::string_view input, String& output, int level = Z_DEFAULT_COMPRESSION) {
+        z_stream zs{};
+        // 15 + 16: finestra massima con header/trailer gzip
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        output.resize(deflateBound(&zs, static_cast<uLong>(input.size())));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+        zs.avail_in = static_cast<uInt>(input.size());
+        zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+        zs.avail_out = static_cast<uInt>(output.size());
+        int ret = deflate(&zs, Z_FINISH);
+        output.resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END;
+    }
+#endif
+
+    // Trasporto HTTP verso il Collector, condiviso da span e metriche.
+    // - riusa la connessione (keep-alive di httplib::Client);
+    // - comprime opzionalmente il corpo con gzip;
+    // - ritenta con backoff esponenziale e jitter sugli errori transitori
+    //   (errori di connessione, 429, 502, 503, 504), rispettando Retry-After.
+    // NON è thread-safe: viene usato solo dal thread in background che lo possiede.
+    class OtlpHttpClient {
+    private:
+        OtlpHttpOptions options;
+        std::unique_ptr<httplib::Client> client;
+        std::string base_path; // Eventuale path contenuto nell'endpoint (es. "/otlp")
+        std::mt19937 jitter{ std::random_device{}() };
+
+        static bool IsRetryable(int status) {
+            return status == 429 || status == 502 || status == 503 || status == 504;
+        }
+
+    public:
+        explicit OtlpHttpClient(const OtlpHttpOptions& opts) : options(opts) {
+            // Separa "scheme://host:port" dall'eventuale path finale
+            std::string host = options.endpoint;
+            size_t scheme_end = host.find("://");
+            size_t path_start = host.find('/', scheme_end == std::string::npos ? 0 : scheme_end + 3);
+            if (path_start != std::string::npos) {
+                base_path = host.substr(path_start);
+                host = host.substr(0, path_start);
+                while (!base_path.empty() && base_path.back() == '/') base_path.pop_back();
+            }
+
+            client = std::make_unique<httplib::Client>(host);
+            client->set_keep_alive(true);
+            auto seconds = static_cast<time_t>(options.timeout.count() / 1000);
+            auto usec = static_cast<time_t>((options.timeout.count() % 1000) * 1000);
+            client->set_connection_timeout(seconds, usec);
+            client->set_read_timeout(seconds, usec);
+            client->set_write_timeout(seconds, usec);
+#ifndef OTEL_HAVE_ZLIB
+            if (options.gzip) {
+                std::cerr << "[OTEL] Compressione gzip richiesta ma zlib non disponibile: payload non compressi" << std::endl;
+                options.gzip = false;
+            }
+#endif
+        }
+
+        // Invia un payload protobuf a `path` (es. "/v1/traces"). Restituisce true in caso di 2xx.
+        bool Send(const std::string& path, const std::string& payload) {
+            httplib::Headers headers;
+            const std::string* body = &payload;
+#ifdef OTEL_HAVE_ZLIB
+            std::string compressed;
+            if (options.gzip && GzipCompress(payload, compressed)) {
+                headers.emplace("Content-Encoding", "gzip");
+                body = &compressed;
+            }
+#endif
+            const std::string full_path = base_path + path;
+            auto backoff = options.initial_backoff;
+            for (int attempt = 0;; ++attempt) {
+                auto res = client->Post(full_path, headers, *body, "application/x-protobuf");
+                std::chrono::milliseconds wait = backoff;
+                if (res) {
+                    if (res->status >= 200 && res->status < 300) return true;
+                    if (!IsRetryable(res->status)) {
+                        std::cerr << "[OTEL] Export OTLP su " << full_path << " rifiutato: HTTP " << res->status << std::endl;
+                        return false;
+                    }
+                    // Retry-After in secondi, limitato a max_backoff
+                    std::string retry_after = res->get_header_value("Retry-After");
+                    if (!retry_after.empty()) {
+                        wait = std::min(std::chrono::milliseconds(std::atol(retry_after.c_str()) * 1000), options.max_backoff);
+                    }
+                }
+                if (attempt >= options.max_retries) {
+                    std::cerr << "[OTEL] Export OTLP su " << full_path << " fallito dopo " << attempt + 1 << " tentativi" << std::endl;
+                    return false;
+                }
+                // Full jitter: attesa casuale in [wait/2, wait]
+                std::uniform_int_distribution<long long> dist(wait.count() / 2, wait.count());
+                std::this_thread::sleep_for(std::chrono::milliseconds(dist(jitter)));
+                backoff = std::min(backoff * 2, options.max_backoff);
+            }
+        }
+
+        const OtlpHttpOptions& GetOptions() const { return options; }
+    };
+
+    // Exporter di span verso il receiver OTLP/HTTP del Collector (POST /v1/traces).
+    // Viene eseguito sul thread del BatchSpanProcessor: i retry non bloccano mai le richieste.
+    class OtlpHttpSpanExporter : public SpanExporter {
+    private:
+        OtlpHttpClient client;
+
+    public:
+        explicit OtlpHttpSpanExporter(const OtlpHttpOptions& options) : client(options) {}
+
+        bool Export(const std::vector<SpanData>& batch) override {
+            if (batch.empty()) return true;
+            return client.Send("/v1/traces", proto::EncodeTraces(batch, client.GetOptions().service_name));
+        }
+    };
+
+    // Interfaccia degli exporter di metriche (push), invocati dal PeriodicMetricReader.
+    class MetricExporter {
+    public:
+        virtual ~MetricExporter() = default;
+        // Restituisce false se l'export è fallito.
+        virtual bool Export(const std::vector<MetricData>& metrics) = 0;
+    };
+
+    // Exporter di metriche verso il receiver OTLP/HTTP del Collector (POST /v1/metrics).
+    // Riceve snapshot prodotti da MetricsRegistry::Collect(); va invocato da un thread
+    // in background, non dai thread delle richieste.
+    class OtlpHttpMetricExporter : public MetricExporter {
+    private:
+        OtlpHttpClient client;
+        // Inizio della serie cumulativa: per questi contatori coincide con l'avvio del processo
+        uint64_t start_time_unix_nano;
+
+        static uint64_t NowUnixNano() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+        }
+
+    public:
+        explicit OtlpHttpMetricExporter(const OtlpHttpOptions& options)
+            : client(options), start_time_unix_nano(NowUnixNano()) {}
+
+        bool Export(const std::vector<MetricData>& metrics) override {
+            if (metrics.empty()) return true;
+            return client.Send("/v1/metrics",
+                proto::EncodeMetrics(metrics, client.GetOptions().service_name, start_time_unix_nano, NowUnixNano()));
+        }
+    };
+
+    // --- Lettura periodica delle metriche (push) ---
+    // Un thread in background fotografa il registry a intervalli regolari e spinge lo snapshot
+    // all'exporter (es. OTLP verso il Collector): i nodi dietro NAT non devono essere
+    // raggiungibili da Prometheus e il costo dello snapshot non ricade sui thread delle richieste.
+    // Link utile: https://opentelemetry.io/docs/specs/otel/metrics/sdk/#periodic-exporting-metricreader
+
+    struct PeriodicMetricReaderOptions {
+        std::chrono::milliseconds interval{ 60000 }; // Intervallo tra due export
+        AggregationTemporality temporality = AggregationTemporality::Cumulative;
+
+        // Legge OTEL_METRIC_EXPORT_INTERVAL (ms) e OTEL_EXPORTER_OTLP_METRICS_TEMPORALITY_PREFERENCE
+        // (cumulative, delta; lowmemory equivale a delta perché non ci sono UpDownCounter).
+        static PeriodicMetricReaderOptions FromEnvironment() {
+            PeriodicMetricReaderOptions options;
+            if (const char* v = config::Get("OTEL_METRIC_EXPORT_INTERVAL")) {
+                long interval_ms = std::atol(v);
+                if (interval_ms > 0) options.interval = std::chrono::milliseconds(interval_ms);
+            }
+            if (const char* v = config::Get("OTEL_EXPORTER_OTLP_METRICS_TEMPORALITY_PREFERENCE")) {
+                std::string preference = v;
+                std::transform(preference.begin(), preference.end(), preference.begin(),
+                    [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                if (preference == "delta" || preference == "lowmemory") options.temporality = AggregationTemporality::Delta;
+            }
+            return options;
+        }
+    };
+
+    class PeriodicMetricReader {
+    private:
+        // Ultimo valore cumulativo di una serie, per calcolare il delta successivo.
+        struct PreviousPoint {
+            int64_t value = 0;
+            std::vector<uint64_t> bucket_counts;
+            uint64_t count = 0;
+            double sum = 0;
+        };
+
+        // Statistiche del reader, condivise con le callback registrate nel MetricsRegistry
+        // (che possono sopravvivere al reader).
+        struct Stats {
+            std::atomic<int64_t> exports{ 0 };
+            std::atomic<int64_t> failures{ 0 };
+            std::atomic<int64_t> last_collect_nanos{ 0 };
+        };
+
+        std::unique_ptr<MetricExporter> exporter;
+        PeriodicMetricReaderOptions options;
+        std::shared_ptr<Stats> stats = std::make_shared<Stats>();
+
+        // Stato del delta: posseduto dal solo thread che esporta (nessun lock sui writer).
+        // La dimensione è limitata dai limiti di cardinalità degli strumenti.
+        std::unordered_map<std::string, PreviousPoint> previous;
+        uint64_t start_time_unix_nano;
+        uint64_t last_time_unix_nano;
+        std::mutex export_mutex; // Serializza export periodico e ForceFlush
+
+        std::mutex worker_mutex;
+        std::condition_variable worker_cv;
+        bool running = true;
+        std::thread worker;
+
+        static uint64_t NowUnixNano() {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+        }
+
+        static std::string SeriesKey(const MetricData& metric, const MetricPoint& point) {
+            std::string key = metric.name;
+            for (const auto& label : point.labels) {
+                key += '\0';
+                key += label.first;
+                key += '\0';
+                key += label.second;
+            }
+            return key;
+        }
+
+        // Trasforma i punti cumulativi di Sum e Histogram in variazioni dall'export precedente.
+        // Un valore inferiore al precedente (strumento ricreato) riparte da zero.
+        void ApplyDelta(MetricData& metric) {
+            if (metric.kind == InstrumentKind::Gauge) return;
+            metric.temporality = AggregationTemporality::Delta;
+            for (auto& point : metric.points) {
+                PreviousPoint& last = previous[SeriesKey(metric, point)];
+                if (metric.kind == InstrumentKind::Counter) {
+                    int64_t current = point.value;
+                    point.value = current >= last.value ? current - last.value : current;
+                    last.value = current;
+                    continue;
+                }
+                PreviousPoint current{ 0, point.bucket_counts, point.count, point.sum };
+                bool reset = current.count < last.count || last.bucket_counts.size() != current.bucket_counts.size();
+                if (!reset) {
+                    for (size_t i = 0; i < point.bucket_counts.size(); ++i) point.bucket_counts[i] -= last.bucket_counts[i];
+                    point.count -= last.count;
+                    point.sum -= last.sum;
+                }
+                last = std::move(current);
+            }
+        }
+
+        void CollectAndExport() {
+            std::lock_guard<std::mutex> lock(export_mutex);
+            auto started = std::chrono::steady_clock::now();
+            // Collect legge gli atomici con load relaxed: i thread delle richieste non si fermano mai
+            std::vector<MetricData> metrics = MetricsRegistry::Instance().Collect();
+            uint64_t now = NowUnixNano();
+            bool delta = options.temporality == AggregationTemporality::Delta;
+            for (auto& metric : metrics) {
+                metric.start_time_unix_nano = delta && metric.kind != InstrumentKind::Gauge ? last_time_unix_nano : start_time_unix_nano;
+                metric.time_unix_nano = now;
+                if (delta) ApplyDelta(metric);
+            }
+            last_time_unix_nano = now;
+            stats->last_collect_nanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started).count(), std::memory_order_relaxed);
+
+            if (exporter->Export(metrics)) stats->exports.fetch_add(1, std::memory_order_relaxed);
+            else stats->failures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void WorkerLoop() {
+            std::unique_lock<std::mutex> lock(worker_mutex);
+            while (running) {
+                if (worker_cv.wait_for(lock, options.interval, [this] { return !running; })) break;
+                lock.unlock();
+                CollectAndExport();
+                lock.lock();
+            }
+        }
+
+    public:
+        PeriodicMetricReader(std::unique_ptr<MetricExporter> exp, const PeriodicMetricReaderOptions& opts = {})
+            : exporter(std::move(exp)), options(opts),
+            start_time_unix_nano(NowUnixNano()), last_time_unix_nano(start_time_unix_nano) {
+            MetricsRegistry& registry = MetricsRegistry::Instance();
+            std::shared_ptr<Stats> shared = stats;
+            registry.CreateObservableCounter("otel_metric_reader_exports_total",
+                "Export periodici delle metriche riusciti",
+                [shared] { return shared->exports.load(std::memory_order_relaxed); });
+            registry.CreateObservableCounter("otel_metric_reader_export_failures_total",
+                "Export periodici delle metriche falliti",
+                [shared] { return shared->failures.load(std::memory_order_relaxed); });
+            registry.CreateObservableGauge("otel_metric_reader_collect_nanoseconds",
+                "Durata dell'ultimo snapshot del registry (ns)",
+                [shared] { return shared->last_collect_nanos.load(std::memory_order_relaxed); });
+            worker = std::thread(&PeriodicMetricReader::WorkerLoop, this);
+        }
+
+        PeriodicMetricReader(const PeriodicMetricReader&) = delete;
+        PeriodicMetricReader& operator=(const PeriodicMetricReader&) = delete;
+
+        ~PeriodicMetricReader() {
+            Shutdown();
+        }
+
+        // Esporta subito uno snapshot dal thread chiamante.
+        void ForceFlush() {
+            CollectAndExport();
+        }
+
+        // Ferma il thread ed esporta un ultimo snapshot. Idempotente.
+        void Shutdown() {
+            {
+                std::lock_guard<std::mutex> lock(worker_mutex);
+                if (!running) return;
+                running = false;
+            }
+            worker_cv.notify_one();
+            if (worker.joinable()) worker.join();
+            CollectAndExport();
+        }
+    };
+
+    // --- Profilazione in-process (formato pprof) ---
+    // Profili raccolti dal processo stesso, da scaricare da /debug/pprof/* e aprire con
+    // `go tool pprof` (flame graph incluso) senza collegare perf al nodo:
+    //   - CPU: setitimer(ITIMER_PROF) invia SIGPROF al thread che sta consumando CPU (di norma
+    //     un worker di httplib) ogni 1/hz secondi di CPU; il signal handler copia lo stack
+    //     (backtrace) in un buffer preallocato. Attivo solo per la durata della richiesta.
+    //   - Heap: l'operator new globale campiona un'allocazione ogni `heap_interval` byte del
+    //     thread (un decremento thread_local quando il profiler è spento) e ne registra lo stack
+    //     per sito di allocazione. Sono allocazioni cumulative (alloc_*), non la memoria in uso:
+    //     operator delete resta free() e non sa quali blocchi erano campionati.
+    //   - Contesa dei lock: ogni acquisizione contesa misurata da LockAndMeasureWait (serie delle
+    //     metriche, LabelInterner, registry, indice dei percorsi di VisitCounter) registra lo stack
+    //     e l'attesa. Senza contesa non costa nulla in più.
+    // Gli stack sono indirizzi: le funzioni vengono risolte con dladdr() dove possibile e il
+    // profilo include le mappature di /proc/self/maps, così pprof può simbolizzare con il binario.
+    // Richiede backtrace() (glibc o macOS); altrove le funzioni restituiscono un errore.
+    namespace profiling {
+
+        constexpr int kMaxDepth = 48; // Frame massimi per stack
+
+#ifdef OTEL_HAVE_PROFILER
+        constexpr bool kAvailable = true;
+
+        // Stack corrente a partire dall'indirizzo di ritorno `from` (esclusi i frame del profiler).
+        // Si taglia su un indirizzo e non su un numero di frame: inlining e tail call cambiano
+        // quanti frame del profiler compaiono. Se `from` non c'è si esclude solo CaptureStack.
+        OTEL_NOINLINE inline int CaptureStack(void** pcs, const void* from) {
+            void* frames[kMaxDepth + 8];
+            const int captured = backtrace(frames, kMaxDepth + 8);
+            int first = 1;
+            while (first < captured && frames[first] != from) ++first;
+            if (first == captured) first = 1;
+            const int depth = std::min(captured - first, kMaxDepth);
+            if (depth <= 0) return 0;
+            std::memcpy(pcs, frames + first, depth * sizeof(void*));
+            return depth;
+        }
+#else
+        constexpr bool kAvailable = false;
+#endif
+
+        // Tabella stack -> due valori sommati, a capacità fissa e allocata in anticipo: Add() non
+        // alloca (viene chiamata da operator new) e oltre la capacità scarta lo stack e lo conta.
+        class StackTable {
+        public:
+            struct Entry {
+                uint64_t hash = 0; // 0 = vuota
+                int depth = 0;
+                void* pcs[kMaxDepth];
+                int64_t values[2] = { 0, 0 };
+            };
+
+        private:
+            std::vector<Entry> entries; // Capacità potenza di due
+            size_t used = 0;
+            uint64_t dropped = 0;
+            mutable std::mutex mutex;
+
+        public:
+            explicit StackTable(size_t capacity) : entries(capacity) {}
+
+            void Add(void* const* pcs, int depth, int64_t first, int64_t second) {
+                uint64_t hash = 14695981039346656037ull;
+                for (int i = 0; i < depth; ++i) {
+                    hash = (hash ^ reinterpret_cast<uintptr_t>(pcs[i])) * 1099511628211ull;
+                }
+                hash |= 1;
+                std::lock_guard<std::mutex> lock(mutex);
+                const size_t mask = entries.size() - 1;
+                for (size_t probe = 0; probe < entries.size(); ++probe) {
+                    Entry& entry = entries[(hash + probe) & mask];
+                    if (entry.hash == 0) {
+                        if ((used + 1) * 4 > entries.size() * 3) break; // Oltre il 75%: scarta
+                        entry.hash = hash;
+                        entry.depth = depth;
+                        std::memcpy(entry.pcs, pcs, depth * sizeof(void*));
+                        ++used;
+                    }
+                    else if (entry.hash != hash || entry.depth != depth ||
+                        std::memcmp(entry.pcs, pcs, depth * sizeof(void*)) != 0) {
+                        continue;
+                    }
+                    entry.values[0] += first;
+                    entry.values[1] += second;
+                    return;
+                }
+                ++dropped;
+            }
+
+            // Copia delle voci occupate. Il profilo si costruisce sulla copia, fuori dal lock:
+            // costruirlo sotto il lock bloccherebbe i campioni degli altri thread e, allocando,
+            // rientrerebbe in Add() dal thread stesso. Da chiamare dentro uno ProfilerScope,
+            // perché anche la copia alloca tenendo il lock.
+            std::vector<Entry> Snapshot() const {
+                std::vector<Entry> copy;
+                std::lock_guard<std::mutex> lock(mutex);
+                copy.reserve(used);
+                for (const Entry& entry : entries) {
+                    if (entry.hash != 0) copy.push_back(entry);
+                }
+                return copy;
+            }
+
+            uint64_t Dropped() const {
+                std::lock_guard<std::mutex> lock(mutex);
+                return dropped;
+            }
+        };
+
+        // Tabelle attive (nullptr: profilo spento). Costanti-inizializzate, quindi leggibili
+        // anche da operator new prima di main().
+        inline std::atomic<StackTable*> heap_table{ nullptr };
+        inline std::atomic<StackTable*> contention_table{ nullptr };
+        inline std::atomic<int64_t> heap_interval{ 512 * 1024 };
+        inline thread_local int64_t heap_bytes_until_sample = 512 * 1024;
+        inline thread_local bool in_profiler = false; // Evita la ricorsione (il profiler che alloca o attende)
+        inline std::chrono::system_clock::time_point continuous_start; // Scritto prima di pubblicare le tabelle
+
+        // Marca il thread come interno al profiler per tutta la costruzione di un profilo: le sue
+        // allocazioni e attese non vengono campionate (niente rientro nelle StackTable).
+        class ProfilerScope {
+        private:
+            bool previous;
+
+        public:
+            ProfilerScope() : previous(in_profiler) { in_profiler = true; }
+            ~ProfilerScope() { in_profiler = previous; }
+            ProfilerScope(const ProfilerScope&) = delete;
+            ProfilerScope& operator=(const ProfilerScope&) = delete;
+        };
+
+
+        // Chiamata da operator new quando il thread ha allocato heap_interval byte dall'ultimo campione;
+        // `caller` è l'indirizzo di ritorno di operator new (il codice che alloca).
+        OTEL_NOINLINE inline void SampleAllocation(size_t size, const void* caller) {
+            const int64_t interval = heap_interval.load(std::memory_order_relaxed);
+            heap_bytes_until_sample = interval;
+#ifdef OTEL_HAVE_PROFILER
+            StackTable* table = heap_table.load(std::memory_order_acquire);
+            if (!table || in_profiler) return;
+            in_profiler = true;
+            void* pcs[kMaxDepth];
+            int depth = CaptureStack(pcs, caller);
+            // Un'allocazione di `size` byte viene campionata con probabilità ~size/interval:
+            // il campione rappresenta interval/size allocazioni (almeno una).
+            const double scale = std::max(1.0, static_cast<double>(interval) / static_cast<double>(size ? size : 1));
+            table->Add(pcs, depth, static_cast<int64_t>(scale), static_cast<int64_t>(scale * static_cast<double>(size)));
+            in_profiler = false;
+#else
+            (void)size;
+            (void)caller;
+#endif
+        }
+
+        // Mai inline: l'indirizzo di ritorno cade nella funzione che ha atteso il lock (dove
+        // LockAndMeasureWait è stata espansa, o il suo chiamante se la chiamata è una tail call).
+        OTEL_NOINLINE inline void RecordContention(std::chrono::nanoseconds wait) {
+#ifdef OTEL_HAVE_PROFILER
+            StackTable* table = contention_table.load(std::memory_order_acquire);
+            if (!table || in_profiler) return;
+            in_profiler = true;
+            void* pcs[kMaxDepth];
+            int depth = CaptureStack(pcs, OTEL_RETURN_ADDRESS());
+            table->Add(pcs, depth, 1, wait.count());
+            in_profiler = false;
+#else
+            (void)wait;
+#endif
+        }
+
+        // Costruisce un messaggio perftools.profiles.Profile (profile.proto di pprof).
+        // Link utile: https://github.com/google/pprof/blob/main/proto/profile.proto
+        class ProfileBuilder {
+        private:
+            struct Mapping {
+                uintptr_t start, limit, offset;
+                int64_t filename;
+            };
+
+            proto::Writer profile;
+            std::vector<std::string> strings{ "" }; // Indice 0 = stringa vuota, come richiesto dal formato
+            std::unordered_map<std::string, int64_t> string_ids;
+            std::unordered_map<uintptr_t, uint64_t> locations; // Indirizzo -> ID della Location
+            std::unordered_map<std::string, uint64_t> functions; // Nome -> ID della Function
+            std::vector<Mapping> mappings;
+            proto::Writer location_messages;
+            proto::Writer function_messages;
+
+            int64_t Intern(const std::string& text) {
+                auto it = string_ids.find(text);
+                if (it != string_ids.end()) return it->second;
+                int64_t id = static_cast<int64_t>(strings.size());
+                strings.push_back(text);
+                string_ids.emplace(text, id);
+                return id;
+            }
+
+            proto::Writer ValueType(const char* type, const char* unit) {
+                proto::Writer value;
+                value.Uint64(1, static_cast<uint64_t>(Intern(type)));
+                value.Uint64(2, static_cast<uint64_t>(Intern(unit)));
+                return value;
+            }
+
+            // Segmenti eseguibili del processo (Linux); su altri sistemi nessuna mappatura.
+            void LoadMappings() {
+                std::ifstream maps("/proc/self/maps");
+                std::string line;
+                while (std::getline(maps, line)) {
+                    unsigned long long start_address = 0, end_address = 0, offset = 0;
+                    char permissions[5] = {};
+                    int path_start = 0;
+                    if (std::sscanf(line.c_str(), "%llx-%llx %4s %llx %*s %*s %n",
+                        &start_address, &end_address, permissions, &offset, &path_start) < 4) continue;
+                    if (permissions[2] != 'x' || path_start <= 0 || static_cast<size_t>(path_start) >= line.size()) continue;
+                    const std::string path = line.substr(path_start);
+                    if (path.empty() || path.front() != '/') continue; // [vdso], [stack], ...
+                    mappings.push_back({ static_cast<uintptr_t>(start_address), static_cast<uintptr_t>(end_address),
+                        static_cast<uintptr_t>(offset), Intern(path) });
+                }
+            }
+
+            uint64_t MappingFor(uintptr_t address) const {
+                for (size_t i = 0; i < mappings.size(); ++i) {
+                    if (address >= mappings[i].start && address < mappings[i].limit) return i + 1;
+                }
+                return 0;
+            }
+
+            uint64_t FunctionFor(uintptr_t address) {
+#ifdef OTEL_HAVE_PROFILER
+                Dl_info info;
+                if (!dladdr(reinterpret_cast<void*>(address), &info) || !info.dli_sname) return 0;
+                std::string mangled = info.dli_sname;
+                auto it = functions.find(mangled);
+                if (it != functions.end()) return it->second;
+                int status = 0;
+                char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+                std::string name = status == 0 && demangled ? demangled : mangled;
+                std::free(demangled);
+                uint64_t id = functions.size() + 1;
+                proto::Writer function;
+                function.Uint64(1, id);
+                function.Uint64(2, static_cast<uint64_t>(Intern(name)));
+                function.Uint64(3, static_cast<uint64_t>(Intern(mangled)));
+                function_messages.Message(5, function);
+                functions.emplace(std::move(mangled), id);
+                return id;
+#else
+                (void)address;
+                return 0;
+#endif
+            }
+
+            uint64_t LocationFor(uintptr_t address) {
+                auto it = locations.find(address);
+                if (it != locations.end()) return it->second;
+                uint64_t id = locations.size() + 1;
+                proto::Writer location;
+                location.Uint64(1, id);
+                if (uint64_t mapping = MappingFor(address)) location.Uint64(2, mapping);
+                location.Uint64(3, address);
+                if (uint64_t function = FunctionFor(address)) {
+                    proto::Writer line;
+                    line.Uint64(1, function);
+                    location.Message(4, line);
+                }
+                location_messages.Message(4, location);
+                locations.emplace(address, id);
+                return id;
+            }
+
+        public:
+            // `sample_types`: (tipo, unità) di ciascun valore dei campioni; `period_type`/`period`:
+            // quanto rappresenta un campione (es. cpu/nanoseconds e 1e9/hz).
+            ProfileBuilder(std::initializer_list<std::pair<const char*, const char*>> sample_types,
+                std::pair<const char*, const char*> period_type, int64_t period) {
+                for (const auto& type : sample_types) profile.Message(1, ValueType(type.first, type.second));
+                profile.Message(11, ValueType(period_type.first, period_type.second));
+                profile.Uint64(12, static_cast<uint64_t>(period));
+                LoadMappings();
+            }
+
+            // Aggiunge un campione. Gli indirizzi di ritorno vengono spostati di un byte dentro
+            // l'istruzione di chiamata (come fa pprof), tranne la foglia esatta di un campione CPU.
+            void AddSample(void* const* pcs, int depth, std::initializer_list<int64_t> values, bool exact_leaf = false) {
+                proto::Writer sample;
+                for (int i = 0; i < depth; ++i) {
+                    uintptr_t address = reinterpret_cast<uintptr_t>(pcs[i]);
+                    if (!(exact_leaf && i == 0) && address > 0) --address;
+                    sample.Uint64(1, LocationFor(address));
+                }
+                for (int64_t value : values) sample.Uint64(2, static_cast<uint64_t>(value));
+                profile.Message(2, sample);
+            }
+
+            // Serializza il profilo iniziato a `start` (compresso con gzip se zlib è disponibile,
+            // come si aspetta pprof).
+            std::string Finish(std::chrono::system_clock::time_point start) {
+                const auto now = std::chrono::system_clock::now();
+                for (size_t i = 0; i < mappings.size(); ++i) {
+                    proto::Writer mapping;
+                    mapping.Uint64(1, i + 1);
+                    mapping.Uint64(2, mappings[i].start);
+                    mapping.Uint64(3, mappings[i].limit);
+                    mapping.Uint64(4, mappings[i].offset);
+                    mapping.Uint64(5, static_cast<uint64_t>(mappings[i].filename));
+                    profile.Message(3, mapping);
+                }
+                profile.Append(location_messages);
+                profile.Append(function_messages);
+                profile.Uint64(9, static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()));
+                profile.Uint64(10, static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()));
+                for (const std::string& text : strings) profile.String(6, text);
+                std::string encoded = profile.Release();
+#ifdef OTEL_HAVE_ZLIB
+                std::string compressed;
+                if (GzipCompress(encoded, compressed)) return compressed;
+#endif
+                return encoded;
+            }
+        };
+
+        // Attiva i profili continui di heap e contesa (chiamata una volta all'avvio).
+        // heap_interval_bytes = 0 lascia spento il profilo dell'heap.
+        inline bool StartContinuous(size_t heap_interval_bytes, std::string& error) {
+            if (!kAvailable) {
+                error = "profilazione non supportata su questa piattaforma";
+                return false;
+            }
+            continuous_start = std::chrono::system_clock::now();
+            static StackTable contention(2048);
+            contention_table.store(&contention, std::memory_order_release);
+            if (heap_interval_bytes > 0) {
+                if (!kAllocationCountingEnabled) {
+                    error = "profilo dell'heap non disponibile: compilato con OTEL_NO_ALLOCATION_COUNTING";
+                    return false;
+                }
+                static StackTable heap(4096);
+                heap_interval.store(static_cast<int64_t>(heap_interval_bytes), std::memory_order_relaxed);
+                heap_table.store(&heap, std::memory_order_release);
+            }
+            return true;
+        }
+
+        // Profilo delle allocazioni campionate dall'avvio; false se il profilo dell'heap è spento.
+        inline bool HeapProfile(std::string& output, std::string& error) {
+            StackTable* table = heap_table.load(std::memory_order_acquire);
+            if (!table) {
+                error = "profilo dell'heap non attivo (WEBSERVER_PPROF_HEAP_INTERVAL)";
+                return false;
+            }
+            ProfilerScope scope;
+            ProfileBuilder builder({ { "alloc_objects", "count" }, { "alloc_space", "bytes" } },
+                { "space", "bytes" }, heap_interval.load(std::memory_order_relaxed));
+            for (const StackTable::Entry& entry : table->Snapshot()) {
+                builder.AddSample(entry.pcs, entry.depth, { entry.values[0], entry.values[1] });
+            }
+            output = builder.Finish(continuous_start);
+            return true;
+        }
+
+        // Profilo delle acquisizioni contese dall'avvio.
+        inline bool ContentionProfile(std::string& output, std::string& error) {
+            StackTable* table = contention_table.load(std::memory_order_acquire);
+            if (!table) {
+                error = "profilo della contesa non attivo";
+                return false;
+            }
+            ProfilerScope scope;
+            ProfileBuilder builder({ { "contentions", "count" }, { "delay", "nanoseconds" } }, { "contentions", "count" }, 1);
+            for (const StackTable::Entry& entry : table->Snapshot()) {
+                builder.AddSample(entry.pcs, entry.depth, { entry.values[0], entry.values[1] });
+            }
+            output = builder.Finish(continuous_start);
+            return true;
+        }
+
+        // Campionamento della CPU per `duration` (blocca il chiamante). Una sola sessione alla volta.
+        class CpuProfiler {
+        private:
+            struct Sample {
+                int depth;
+                bool exact_leaf;
+                void* pcs[kMaxDepth];
+            };
+
+            std::unique_ptr<Sample[]> samples;
+            size_t capacity;
+            std::atomic<size_t> next{ 0 };
+
+            static std::atomic<CpuProfiler*>& Active() {
+                static std::atomic<CpuProfiler*> active{ nullptr };
+                return active;
+            }
+
+            // Handler in esecuzione. Statico e incrementato PRIMA di leggere Active(): un contatore
+            // nel profiler verrebbe toccato dopo averne letto l'indirizzo, quando Run() potrebbe
+            // già averlo distrutto. Le operazioni seq_cst garantiscono che Run(), dopo aver
+            // azzerato Active() e visto il contatore a zero, non abbia più handler che lo usano.
+            static std::atomic<int>& InHandler() {
+                static std::atomic<int> in_handler{ 0 };
+                return in_handler;
+            }
+
+#ifdef OTEL_HAVE_PROFILER
+            // Istruzione interrotta dal segnale, se l'architettura è nota.
+            static void* InterruptedPc(void* context) {
+#if defined(__linux__) && defined(__x86_64__)
+                return reinterpret_cast<void*>(static_cast<ucontext_t*>(context)->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__linux__) && defined(__aarch64__)
+                return reinterpret_cast<void*>(static_cast<ucontext_t*>(context)->uc_mcontext.pc);
+#else
+                (void)context;
+                return nullptr;
+#endif
+            }
+
+            // Signal handler: solo operazioni async-signal-safe (backtrace è già stato inizializzato).
+            static void OnSignal(int, siginfo_t*, void* context) {
+                InHandler().fetch_add(1);
+                CpuProfiler* profiler = Active().load();
+                if (!profiler || in_profiler) {
+                    InHandler().fetch_sub(1);
+                    return;
+                }
+                const int saved_errno = errno;
+                size_t slot = profiler->next.fetch_add(1, std::memory_order_relaxed);
+                if (slot < profiler->capacity) {
+                    void* frames[kMaxDepth + 8];
+                    int depth = backtrace(frames, kMaxDepth + 8);
+                    // Lo stack parte dall'handler e dal trampolino del segnale: si riparte dall'istruzione interrotta
+                    int first = std::min(depth, 2);
+                    bool exact = false;
+                    if (void* pc = InterruptedPc(context)) {
+                        int found = -1;
+                        for (int i = 0; i < depth && found < 0; ++i) {
+                            if (frames[i] == pc) found = i;
+                        }
+                        if (found >= 0) {
+                            first = found;
+                        }
+                        else if (first > 0) {
+                            frames[--first] = pc; // L'unwinder non ha restituito il frame interrotto: lo si mette in testa
+                        }
+                        else {
+                            frames[0] = pc;
+                            depth = 1;
+                        }
+                        exact = true;
+                    }
+                    Sample& sample = profiler->samples[slot];
+                    sample.depth = std::min(depth - first, kMaxDepth);
+                    sample.exact_leaf = exact;
+                    std::memcpy(sample.pcs, frames + first, sample.depth * sizeof(void*));
+                }
+                errno = saved_errno;
+                InHandler().fetch_sub(1);
+            }
+#endif
+
+            explicit CpuProfiler(size_t max_samples) : samples(new Sample[max_samples]), capacity(max_samples) {}
+
+        public:
+            // Profilo CPU di `duration` a `hz` campioni per secondo di CPU; false con l'errore se il
+            // profiler non è disponibile o un'altra sessione è in corso.
+            static bool Run(std::chrono::seconds duration, int hz, std::string& output, std::string& error) {
+#ifdef OTEL_HAVE_PROFILER
+                static std::mutex session;
+                std::unique_lock<std::mutex> lock(session, std::try_to_lock);
+                if (!lock.owns_lock()) {
+                    error = "profilo CPU già in corso";
+                    return false;
+                }
+                ProfilerScope scope;
+                hz = std::clamp(hz, 1, 1000);
+                void* warmup[4];
+                backtrace(warmup, 4); // Carica l'unwinder ora: la prima chiamata non è async-signal-safe
+
+                const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+                const size_t max_samples = std::min<size_t>(
+                    static_cast<size_t>(hz) * static_cast<size_t>(duration.count()) * cores + 16, 1 << 16);
+                CpuProfiler profiler(max_samples);
+
+                struct sigaction action = {};
+                struct sigaction previous = {};
+                action.sa_sigaction = &CpuProfiler::OnSignal;
+                action.sa_flags = SA_SIGINFO | SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                if (sigaction(SIGPROF, &action, &previous) != 0) {
+                    error = std::string("sigaction: ") + std::strerror(errno);
+                    return false;
+                }
+                Active().store(&profiler);
+                const auto start = std::chrono::system_clock::now();
+                struct itimerval timer = {};
+                timer.it_interval.tv_usec = 1000000 / hz;
+                timer.it_value = timer.it_interval;
+                setitimer(ITIMER_PROF, &timer, nullptr);
+
+                std::this_thread::sleep_for(duration);
+
+                struct itimerval stop = {};
+                setitimer(ITIMER_PROF, &stop, nullptr);
+                Active().store(nullptr);
+                while (InHandler().load() > 0) std::this_thread::yield();
+                sigaction(SIGPROF, &previous, nullptr);
+
+                const int64_t period = 1000000000LL / hz;
+                ProfileBuilder builder({ { "samples", "count" }, { "cpu", "nanoseconds" } }, { "cpu", "nanoseconds" }, period);
+                const size_t taken = std::min(profiler.next.load(), profiler.capacity);
+                for (size_t i = 0; i < taken; ++i) {
+                    const Sample& sample = profiler.samples[i];
+                    builder.AddSample(sample.pcs, sample.depth, { 1, period }, sample.exact_leaf);
+                }
+                output = builder.Finish(start);
+                return true;
+#else
+                (void)duration;
+                (void)hz;
+                (void)output;
+                error = "profilazione non supportata su questa piattaforma";
+                return false;
+#endif
+            }
+        };
+
+    } // namespace profiling
+
+    inline void RecordLockContention(std::chrono::nanoseconds wait) {
+        profiling::RecordContention(wait);
+    }
+} // namespace otel
+
+// --- Conteggio delle allocazioni ---
+// L'operator new globale conta le allocazioni del thread corrente (otel::thread_allocations),
+// così è possibile misurare le allocazioni per richiesta, e campiona le allocazioni per il
+// profilo dell'heap. Costa un incremento e un decremento non atomici di variabili thread_local. Si disattiva con -DOTEL_NO_ALLOCATION_COUNTING
+// (es. con allocatori sostitutivi o sanitizer che ridefiniscono operator new).
+// Le forme nothrow della libreria standard delegano a questa; delete resta free().
+// Le forme sostituite sono OTEL_NOINLINE: inlinate nel chiamante, GCC vedrebbe un free()
+// su un puntatore restituito da operator new (-Wmismatched-new-delete). Le forme allineate
+// non sono sostituite: quelle della libreria standard restano accoppiate tra loro.
+#ifndef OTEL_NO_ALLOCATION_COUNTING
+OTEL_NOINLINE void* operator new(std::size_t size) {
+    ++otel::thread_allocations;
+    // Profilo dell'heap: un campione ogni heap_interval byte allocati dal thread
+    if ((otel::profiling::heap_bytes_until_sample -= static_cast<int64_t>(size)) < 0) {
+        otel::profiling::SampleAllocation(size, OTEL_RETURN_ADDRESS());
+    }
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+OTEL_NOINLINE void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+OTEL_NOINLINE void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+OTEL_NOINLINE void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+OTEL_NOINLINE void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+OTEL_NOINLINE void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// --- Logging asincrono ---
+// I thread delle richieste non scrivono mai su stdout: copiano i campi della riga in un
+// ring buffer del proprio thread (nessun lock, nessuna formattazione) e un unico thread
+// di scrittura formatta e scrive le righe a blocchi. Il timestamp testuale viene calcolato
+// una sola volta al secondo dal thread di scrittura (localtime_r/gmtime_r, non std::localtime).
+// Con LOG_FORMAT=json ogni riga è un oggetto JSON, pronto per Loki
+// (vedi cloud-continuum-observability/loki).
+namespace logging {
+
+    enum class Level : int {
+        Debug = 0,
+        Info = 1,
+        Warn = 2,
+        Error = 3,
+        Off = 4 // Disattiva tutte le righe
+    };
+
+    inline const char* LevelName(Level level) {
+        switch (level) {
+        case Level::Debug: return "debug";
+        case Level::Info: return "info";
+        case Level::Warn: return "warn";
+        case Level::Error: return "error";
+        default: return "off";
+        }
+    }
+
+    inline bool ParseLevel(std::string_view text, Level& level) {
+        for (Level candidate : { Level::Debug, Level::Info, Level::Warn, Level::Error, Level::Off }) {
+            if (text == LevelName(candidate)) {
+                level = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    enum class Format {
+        Text, // [2025-01-01 12:00:00] INFO Visita remote_ip=... path=/ total_visits=3
+        Json  // {"ts":"2025-01-01T11:00:00.123Z","level":"info","msg":"Visita",...}
+    };
+
+    // Riga di log in attesa di scrittura, a dimensione fissa (vive nel ring buffer).
+    // Le chiavi e il messaggio devono essere letterali; i valori stringa vengono copiati
+    // (e troncati a kFieldText caratteri).
+    struct Entry {
+        static constexpr size_t kMaxFields = 6;
+        static constexpr size_t kFieldText = 46;
+
+        struct Field {
+            const char* key;
+            bool is_number;
+            int64_t number;
+            uint8_t size;
+            char text[kFieldText];
+        };
+
+        int64_t unix_nano;
+        Level level;
+        const char* message;
+        uint8_t field_count;
+        bool has_trace; // Riga emessa all'interno di uno span registrato
+        otel::TraceId trace_id;
+        otel::SpanId span_id;
+        Field fields[kMaxFields];
+    };
+
+    // Interfaccia passata al chiamante per aggiungere i campi strutturati di una riga.
+    class Record {
+    private:
+        Entry& entry;
+
+        Entry::Field* Next(const char* key) {
+            if (entry.field_count >= Entry::kMaxFields) return nullptr;
+            Entry::Field& field = entry.fields[entry.field_count++];
+            field.key = key;
+            return &field;
+        }
+
+    public:
+        explicit Record(Entry& e) : entry(e) {}
+
+        Record& Field(const char* key, std::string_view value) {
+            if (Entry::Field* field = Next(key)) {
+                field->is_number = false;
+                field->size = static_cast<uint8_t>(std::min(value.size(), Entry::kFieldText));
+                std::memcpy(field->text, value.data(), field->size);
+            }
+            return *this;
+        }
+
+        template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+        Record& Field(const char* key, T value) {
+            if (Entry::Field* field = Next(key)) {
+                field->is_number = true;
+                field->number = static_cast<int64_t>(value);
+            }
+            return *this;
+        }
+    };
+
+    // Ring buffer single-producer/single-consumer di un thread: il produttore è il thread
+    // proprietario, il consumatore il thread di scrittura. Se è pieno la riga viene
+    // scartata (e conteggiata): il thread della richiesta non attende mai.
+    class ThreadRing {
+    public:
+        static constexpr size_t kCapacity = 512; // Potenza di 2
+
+    private:
+        std::unique_ptr<Entry[]> entries{ new Entry[kCapacity] };
+        alignas(otel::kCacheLineSize) std::atomic<size_t> head{ 0 }; // Scritto dal produttore
+        alignas(otel::kCacheLineSize) std::atomic<size_t> tail{ 0 }; // Scritto dal consumatore
+        std::atomic<uint64_t> dropped{ 0 };
+
+    public:
+        std::atomic<bool> abandoned{ false }; // Il thread proprietario è terminato
+
+        // Restituisce lo slot da riempire, o nullptr se il ring è pieno.
+        Entry* BeginWrite() {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) >= kCapacity) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            return &entries[h & (kCapacity - 1)];
+        }
+
+        void CommitWrite() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // Consuma tutte le righe pubblicate; restituisce il numero di righe lette.
+        template <typename Fn>
+        size_t Drain(Fn fn) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t h = head.load(std::memory_order_acquire);
+            for (size_t i = t; i != h; ++i) fn(entries[i & (kCapacity - 1)]);
+            tail.store(h, std::memory_order_release);
+            return h - t;
+        }
+
+        bool Empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+        }
+
+        uint64_t TakeDropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+    };
+
+    // Stringa JSON tra doppi apici con l'escape dei caratteri di controllo (log JSON, /debug/slow).
+    inline void AppendJsonString(std::string& out, std::string_view text) {
+        out += '"';
+        for (char c : text) {
+            switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                }
+                else {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    // Logger Singleton: livello minimo modificabile a runtime e thread di scrittura.
+    // Log() con un livello disabilitato costa un load relaxed e un confronto:
+    // la lambda che aggiunge i campi non viene nemmeno chiamata.
+    class Logger {
+    private:
+        std::atomic<int> min_level{ static_cast<int>(Level::Info) };
+        std::atomic<int> format{ static_cast<int>(Format::Text) };
+
+        std::mutex rings_mutex; // Solo per registrare/rimuovere i ring (una volta per thread)
+        std::vector<std::unique_ptr<ThreadRing>> rings;
+        std::atomic<uint64_t> lines_dropped{ 0 };
+
+        std::mutex writer_mutex;
+        std::condition_variable writer_cv;
+        std::atomic<bool> running{ true };
+        std::thread writer;
+        static constexpr std::chrono::milliseconds kFlushInterval{ 50 };
+
+        // Cache del timestamp testuale, aggiornata al massimo una volta al secondo
+        int64_t cached_second = -1;
+        int cached_format = -1;
+        char cached_timestamp[32] = {};
+        size_t cached_timestamp_size = 0;
+
+        // Registra il ring del thread corrente alla prima riga; alla terminazione del
+        // thread il ring viene marcato come abbandonato e rimosso dopo essere stato svuotato.
+        struct RingHandle {
+            ThreadRing* ring = nullptr;
+            ~RingHandle() {
+                if (ring) ring->abandoned.store(true, std::memory_order_release);
+            }
+        };
+
+        Logger() {
+            writer = std::thread(&Logger::WriterLoop, this);
+        }
+
+        ThreadRing& ThisThreadRing() {
+            thread_local RingHandle handle;
+            if (!handle.ring) {
+                auto ring = std::make_unique<ThreadRing>();
+                handle.ring = ring.get();
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                rings.push_back(std::move(ring));
+            }
+            return *handle.ring;
+        }
+
+        const char* Timestamp(int64_t unix_nano, Format fmt, size_t& size) {
+            int64_t second = unix_nano / 1000000000;
+            if (second != cached_second || static_cast<int>(fmt) != cached_format) {
+                std::time_t time = static_cast<std::time_t>(second);
+                std::tm tm{};
+                if (fmt == Format::Json) gmtime_r(&time, &tm);
+                else localtime_r(&time, &tm);
+                cached_timestamp_size = std::strftime(cached_timestamp, sizeof(cached_timestamp),
+                    fmt == Format::Json ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &tm);
+                cached_second = second;
+                cached_format = static_cast<int>(fmt);
+            }
+            size = cached_timestamp_size;
+            return cached_timestamp;
+        }
+
+        static void AppendNumber(std::string& out, int64_t value) {
+            char buffer[24];
+            out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+        }
+
+        void FormatEntry(std::string& out, const Entry& entry) {
+            Format fmt = static_cast<Format>(format.load(std::memory_order_relaxed));
+            size_t ts_size;
+            const char* ts = Timestamp(entry.unix_nano, fmt, ts_size);
+            if (fmt == Format::Json) {
+                char millis[8];
+                std::snprintf(millis, sizeof(millis), ".%03dZ", static_cast<int>((entry.unix_nano / 1000000) % 1000));
+                out += "{\"ts\":\"";
+                out.append(ts, ts_size);
+                out += millis;
+                out += "\",\"level\":\"";
+                out += LevelName(entry.level);
+                out += "\",\"msg\":";
+                AppendJsonString(out, entry.message);
+                for (uint8_t i = 0; i < entry.field_count; ++i) {
+                    const Entry::Field& field = entry.fields[i];
+                    out += ',';
+                    AppendJsonString(out, field.key);
+                    out += ':';
+                    if (field.is_number) AppendNumber(out, field.number);
+                    else AppendJsonString(out, std::string_view(field.text, field.size));
+                }
+                if (entry.has_trace) {
+                    out += ",\"trace_id\":\"";
+                    otel::AppendHex(out, entry.trace_id.data(), entry.trace_id.size());
+                    out += "\",\"span_id\":\"";
+                    otel::AppendHex(out, entry.span_id.data(), entry.span_id.size());
+                    out += '"';
+                }
+                out += "}\n";
+            }
+            else {
+                out += '[';
+                out.append(ts, ts_size);
+                out += "] ";
+                for (const char* c = LevelName(entry.level); *c; ++c) out += static_cast<char>(std::toupper(*c));
+                out += ' ';
+                out += entry.message;
+                for (uint8_t i = 0; i < entry.field_count; ++i) {
+                    const Entry::Field& field = entry.fields[i];
+                    out += ' ';
+                    out += field.key;
+                    out += '=';
+                    if (field.is_number) AppendNumber(out, field.number);
+                    else out.append(field.text, field.size);
+                }
+                if (entry.has_trace) {
+                    out += " trace_id=";
+                    otel::AppendHex(out, entry.trace_id.data(), entry.trace_id.size());
+                }
+                out += '\n';
+            }
+        }
+
+        // Svuota tutti i ring in un unico buffer e lo scrive con una sola write/flush.
+        // L'ordine è per thread: righe di thread diversi nello stesso blocco possono
+        // non essere in ordine di tempo (il timestamp resta quello di emissione).
+        void Flush(std::string& out) {
+            out.clear();
+            uint64_t dropped = 0;
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                for (auto it = rings.begin(); it != rings.end();) {
+                    ThreadRing& ring = **it;
+                    bool abandoned = ring.abandoned.load(std::memory_order_acquire);
+                    ring.Drain([&](const Entry& entry) { FormatEntry(out, entry); });
+                    dropped += ring.TakeDropped();
+                    if (abandoned && ring.Empty()) it = rings.erase(it);
+                    else ++it;
+                }
+            }
+            if (dropped > 0) {
+                lines_dropped.fetch_add(dropped, std::memory_order_relaxed);
+                Entry entry{};
+                entry.unix_nano = NowUnixNano();
+                entry.level = Level::Warn;
+                entry.message = "Righe di log scartate (ring buffer pieno)";
+                Record(entry).Field("dropped", dropped);
+                FormatEntry(out, entry);
+            }
+            if (!out.empty()) {
+                std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+                std::cout.flush();
+            }
+        }
+
+        void WriterLoop() {
+            std::string out;
+            while (running.load(std::memory_order_acquire)) {
+                {
+                    std::unique_lock<std::mutex> lock(writer_mutex);
+                    writer_cv.wait_for(lock, kFlushInterval, [this] { return !running.load(std::memory_order_acquire); });
+                }
+                Flush(out);
+            }
+            Flush(out); // Righe emesse fino allo spegnimento
+        }
+
+        static int64_t NowUnixNano() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        template <typename Fn>
+        void Write(Level level, const char* message, Fn& fill) {
+            ThreadRing& ring = ThisThreadRing();
+            Entry* entry = ring.BeginWrite();
+            if (!entry) return;
+            entry->unix_nano = NowUnixNano();
+            entry->level = level;
+            entry->message = message;
+            entry->field_count = 0;
+            otel::Span* span = otel::Span::Current();
+            entry->has_trace = span && span->IsRecording();
+            if (entry->has_trace) {
+                entry->trace_id = span->GetContext().trace_id;
+                entry->span_id = span->GetContext().span_id;
+            }
+            Record record(*entry);
+            fill(record);
+            ring.CommitWrite();
+        }
+
+    public:
+        Logger(const Logger&) = delete;
+        Logger& operator=(const Logger&) = delete;
+
+        ~Logger() {
+            Shutdown();
+        }
+
+        static Logger& Instance() {
+            static Logger instance;
+            return instance;
+        }
+
+        // Configurazione da LOG_LEVEL (debug, info, warn, error, off) e LOG_FORMAT (text, json).
+        // Applica LOG_LEVEL e LOG_FORMAT; `get(nome)` restituisce il valore o nullptr.
+        template <typename Lookup>
+        void Configure(Lookup get) {
+            Level level;
+            if (const char* v = get("LOG_LEVEL")) {
+                if (ParseLevel(v, level)) SetLevel(level);
+                else std::cerr << "LOG_LEVEL non valido: " << v << std::endl;
+            }
+            if (const char* v = get("LOG_FORMAT")) {
+                SetFormat(std::string_view(v) == "json" ? Format::Json : Format::Text);
+            }
+        }
+
+        void ConfigureFromEnvironment() {
+            Configure(config::Get);
+        }
+
+        void SetLevel(Level level) { min_level.store(static_cast<int>(level), std::memory_order_relaxed); }
+        Level GetLevel() const { return static_cast<Level>(min_level.load(std::memory_order_relaxed)); }
+        void SetFormat(Format fmt) { format.store(static_cast<int>(fmt), std::memory_order_relaxed); }
+
+        bool Enabled(Level level) const {
+            return static_cast<int>(level) >= min_level.load(std::memory_order_relaxed);
+        }
+
+        // Emette una riga; fill(Record&) aggiunge i campi ed è chiamata solo se il livello è abilitato.
+        template <typename Fn>
+        void Log(Level level, const char* message, Fn&& fill) {
+            if (!Enabled(level)) return;
+            Write(level, message, fill);
+        }
+
+        void Log(Level level, const char* message) {
+            Log(level, message, [](Record&) {});
+        }
+
+        uint64_t GetDroppedLines() const { return lines_dropped.load(std::memory_order_relaxed); }
+
+        // Scrive le righe ancora nei ring e ferma il thread di scrittura. Idempotente.
+        void Shutdown() {
+            if (running.exchange(false, std::memory_order_acq_rel)) {
+                {
+                    std::lock_guard<std::mutex> lock(writer_mutex);
+                    writer_cv.notify_one();
+                }
+                if (writer.joinable()) writer.join();
+            }
+        }
+    };
+} // namespace logging
+
+// --- Classe per il conteggio delle visite ---
+// Questa classe gestisce il conteggio delle visite totali e per specifici percorsi.
+// È thread-safe per l'utilizzo in un server multi-thread.
+class VisitCounter {
+public:
+    // Identificatore compatto di un percorso "internato": indice nella tabella dei percorsi.
+    using PathId = uint32_t;
+
+    // Numero massimo di percorsi distinti tracciati singolarmente. L'ultimo slot è riservato
+    // al percorso di overflow "__other__", che raccoglie le visite oltre questo limite.
+    static constexpr size_t kMaxPaths = 1024;
+
+    // Contatore OTEL delle visite per percorso e nome del percorso di overflow.
+    static constexpr const char* kPathMetricName = "otel_path_visits_total";
+    static constexpr const char* kOverflowPathName = "__other__";
+
+private:
+    // Contatore totale delle visite. Usiamo std::atomic per thread-safety senza mutex aggiuntivi
+    // per operazioni semplici di incremento/lettura. A 64 bit: un int andrebbe in overflow
+    // su un nodo che resta attivo a lungo.
+    std::atomic<int64_t> total_counter{ 0 };
+
+    // Voce della tabella dei percorsi. Il conteggio del percorso È il contatore OTEL
+    // (già legato alla label {path="..."}): un solo incremento atomico alimenta sia
+    // path_visits_total che otel_path_visits_total.
+    struct PathEntry {
+        std::string path;
+        std::string prometheus_prefix; // "path_visits_total{path=\"...\"} " pre-renderizzato
+        otel::BoundCounter counter;
+    };
+
+    // Tabella a dimensione fissa: gli indirizzi non cambiano mai, quindi un PathId
+    // può essere usato senza lock. path_count viene pubblicato con memory_order_release
+    // DOPO aver scritto la voce, così i lettori vedono solo voci complete.
+    std::unique_ptr<PathEntry[]> paths{ new PathEntry[kMaxPaths] };
+    std::atomic<size_t> path_count{ 0 };
+    std::atomic<bool> overflow_ready{ false };
+    static constexpr PathId kOverflowPath = kMaxPaths - 1;
+
+    // Indice dei percorsi ordinato per nome, per /stats. Viene ricostruito (copia ordinata
+    // più un inserimento) solo quando si registra un percorso nuovo e pubblicato con un
+    // puntatore atomico: i lettori lo percorrono senza lock né ordinamenti. Le versioni
+    // sostituite restano vive fino alla distruzione del VisitCounter, perché un lettore
+    // potrebbe starle ancora visitando; sono al più kMaxPaths, quindi la memoria è limitata.
+    struct SortedIndex {
+        std::vector<PathId> ids; // PathId ordinati per paths[id].path
+    };
+    std::atomic<const SortedIndex*> sorted_index{ nullptr };
+    std::vector<std::unique_ptr<SortedIndex>> sorted_indexes; // Sotto registration_mutex
+
+    // Dimensione (con margine) dell'ultimo output di /metrics, usata per pre-allocare il successivo.
+    std::atomic<size_t> last_render_size{ 4096 };
+
+    // Mutex usato SOLO per registrare nuovi percorsi (raro), mai per gli incrementi.
+    std::mutex registration_mutex;
+
+    // Indice concorrente percorso -> PathId per i percorsi non noti a priori
+    // (es. route con wildcard). È suddiviso in shard con shared_mutex, così le
+    // ricerche (il caso di gran lunga più frequente) sono letture quasi senza contesa.
+    static constexpr size_t kIndexShards = 16;
+    struct alignas(otel::kCacheLineSize) IndexShard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, PathId> ids;
+    };
+    IndexShard index[kIndexShards];
+
+    // Riferimenti ai contatori OpenTelemetry gestiti dal registry.
+    // Questi puntatori NON sono gestiti da questa classe (non li creiamo con new/delete),
+    // ma li otteniamo dal MetricsRegistry singleton.
+    otel::Metric* visit_counter; // Contatore OTEL per le visite totali
+    otel::BoundCounter visit_counter_handle; // Cella pre-risolta (senza label) di visit_counter
+    // Un solo contatore OTEL per tutti i percorsi, con label path e lo stesso limite
+    // di cardinalità della tabella: i percorsi oltre kMaxPaths finiscono in "__other__".
+    otel::Metric* path_visits;
+
+    // Auto-strumentazione dello scrape: durata del rendering e dimensione dell'ultimo output.
+    otel::BoundHistogram render_duration;
+    otel::BoundGauge render_bytes;
+
+    IndexShard& ShardFor(const std::string& path) {
+        return index[std::hash<std::string>{}(path) & (kIndexShards - 1)];
+    }
+
+    bool FindPath(const std::string& path, PathId& id) {
+        IndexShard& shard = ShardFor(path);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex, std::defer_lock);
+        otel::LockAndMeasureWait(lock);
+        auto it = shard.ids.find(path);
+        if (it == shard.ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    // Lega una sola volta il contatore OTEL delle visite per percorso alla label {path="..."}.
+    PathEntry MakeEntry(const std::string& path) {
+        PathEntry entry;
+        entry.path = path;
+        entry.prometheus_prefix = "path_visits_total{path=\"" + otel::EscapeLabelValue(path) + "\"} ";
+        entry.counter = path_visits->Bind({ {"path", path} });
+        return entry;
+    }
+
+    // Pubblica un nuovo indice ordinato che include `id`, la cui voce è già stata scritta.
+    // Chiamato con registration_mutex acquisito.
+    void PublishSorted(PathId id) {
+        auto next = std::make_unique<SortedIndex>();
+        if (const SortedIndex* current = sorted_index.load(std::memory_order_relaxed)) {
+            next->ids.reserve(current->ids.size() + 1);
+            next->ids = current->ids;
+        }
+        auto position = std::lower_bound(next->ids.begin(), next->ids.end(), id,
+            [this](PathId a, PathId b) { return paths[a].path < paths[b].path; });
+        next->ids.insert(position, id);
+        sorted_index.store(next.get(), std::memory_order_release);
+        sorted_indexes.push_back(std::move(next));
+    }
+
+    // Restituisce (creandolo se serve) lo slot di overflow. Chiamato con registration_mutex acquisito.
+    PathId OverflowPath() {
+        if (!overflow_ready.load(std::memory_order_relaxed)) {
+            paths[kOverflowPath] = MakeEntry(kOverflowPathName);
+            overflow_ready.store(true, std::memory_order_release);
+            PublishSorted(kOverflowPath);
+        }
+        return kOverflowPath;
+    }
+
+public:
+    // Costruttore: Inizializza la classe e registra il contatore totale delle visite
+    // nel registry OpenTelemetry minimale.
+    VisitCounter() {
+        // Ottiene l'istanza unica del MetricsRegistry e crea (o ottiene) il contatore totale.
+        // Questo viene fatto una volta sola all'avvio del server.
+        visit_counter = otel::MetricsRegistry::Instance().CreateCounter(
+            "otel_visit_counter_total", "Numero totale di visite al server (OTEL)");
+        visit_counter_handle = visit_counter->Bind();
+        path_visits = otel::MetricsRegistry::Instance().CreateCounter(
+            kPathMetricName, "Visite per percorso (OTEL)");
+        path_visits->SetCardinalityLimit(kMaxPaths);
+
+        // Bucket da 10us a ~80ms, registrati in ns ed esposti in secondi.
+        render_duration = otel::MetricsRegistry::Instance().CreateHistogram(
+            "otel_telemetry_metrics_render_duration_seconds", "Durata del rendering di /metrics",
+            otel::ExponentialBuckets(10000, 2.0, 14), 1e-9)->Bind();
+        render_bytes = otel::MetricsRegistry::Instance().CreateGauge(
+            "otel_telemetry_metrics_render_bytes", "Dimensione dell'ultima esposizione di /metrics (byte)")->Bind();
+    }
+
+    // Incrementa il contatore totale delle visite in modo thread-safe.
+    // Restituisce il valore DOPO l'incremento.
+    int64_t incrementTotal() {
+        int64_t count = ++total_counter; // Operazione atomica di pre-incremento
+
+        // Aggiorna il contatore OpenTelemetry corrispondente.
+        // L'handle pre-risolto incrementa uno shard atomico: nessun lock, nessuna allocazione.
+        visit_counter_handle.Add(1);
+
+        return count;
+    }
+
+    // Somma al totale le visite salvate da un'esecuzione precedente (CounterCheckpointer).
+    // Il contatore OTEL otel_visit_counter_total viene ripristinato a parte, dal registry.
+    void restoreTotal(int64_t visits) {
+        total_counter.fetch_add(visits);
+    }
+
+    // Interna un percorso restituendone il PathId; da chiamare in main() quando si
+    // registrano le route, così gli handler incrementano direttamente tramite ID.
+    // Registrare più volte lo stesso percorso restituisce sempre lo stesso ID.
+    // A tabella piena i percorsi nuovi restituiscono lo slot di overflow senza entrare
+    // nell'indice, che resta così limitato a kMaxPaths voci qualunque sia il traffico.
+    PathId registerPath(const std::string& path) {
+        PathId id;
+        if (FindPath(path, id)) return id;
+        // La tabella non si svuota mai: una volta piena, senza lock
+        if (overflow_ready.load(std::memory_order_acquire)) return kOverflowPath;
+
+        std::unique_lock<std::mutex> lock(registration_mutex, std::defer_lock);
+        otel::LockAndMeasureWait(lock);
+        if (FindPath(path, id)) return id; // Registrato da un altro thread nel frattempo
+
+        size_t n = path_count.load(std::memory_order_relaxed);
+        if (n >= kOverflowPath) {
+            // Tabella piena: le visite confluiscono nel percorso di overflow
+            return OverflowPath();
+        }
+        paths[n] = MakeEntry(path);
+        path_count.store(n + 1, std::memory_order_release);
+        id = static_cast<PathId>(n);
+        PublishSorted(id);
+
+        IndexShard& shard = ShardFor(path);
+        std::unique_lock<std::shared_mutex> index_lock(shard.mutex, std::defer_lock);
+        otel::LockAndMeasureWait(index_lock);
+        shard.ids.emplace(path, id);
+        return id;
+    }
+
+    // Incrementa il contatore delle visite per un percorso già internato: un solo fetch_add atomico.
+    void incrementPath(PathId id) {
+        paths[id].counter.Add(1);
+    }
+
+    // Incrementa il contatore delle visite per un percorso specifico in modo thread-safe.
+    // Per i percorsi non registrati in anticipo costa una ricerca nell'indice concorrente.
+    void incrementPath(const std::string& path) {
+        incrementPath(registerPath(path));
+    }
+
+    // Restituisce il contatore totale delle visite in modo thread-safe.
+    int64_t getTotal() const {
+        return total_counter.load(); // Operazione atomica di lettura
+    }
+
+    // Restituisce i contatori per percorso ordinati per percorso, allocati in `resource`
+    // (di norma l'arena della richiesta). I percorsi sono viste sulla tabella, i cui slot
+    // non vengono mai riscritti dopo la pubblicazione. Segue l'indice ordinato già
+    // pubblicato leggendo ogni contatore con un load relaxed: nessun lock, nessun
+    // ordinamento, e gli incrementi concorrenti non vengono bloccati.
+    std::pmr::vector<std::pair<std::string_view, int64_t>> getPathCounters(
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const {
+        std::pmr::vector<std::pair<std::string_view, int64_t>> path_counters(resource);
+        const SortedIndex* sorted = sorted_index.load(std::memory_order_acquire);
+        if (!sorted) return path_counters;
+        path_counters.reserve(sorted->ids.size());
+        for (PathId id : sorted->ids) {
+            path_counters.emplace_back(paths[id].path, paths[id].counter.Value());
+        }
+        return path_counters;
+    }
+
+    // Genera le metriche in formato testo compatibile con Prometheus.
+    // Include sia i contatori "nativi" che quelli gestiti tramite l'OTEL Registry minimale.
+    // Il buffer viene pre-allocato con la dimensione dell'ultimo scrape, così il rendering
+    // (lineare nel numero di serie) non rialloca; nessun lock blocca i thread delle richieste.
+    std::string getPrometheusMetrics() {
+        return getMetrics(otel::ExpositionFormat::PrometheusText);
+    }
+
+    // Come getPrometheusMetrics, nel formato negoziato con lo scraper. Testo 0.0.4 usa le
+    // righe pre-renderizzate; OpenMetrics e protobuf partono dallo snapshot collectMetrics().
+    std::string getMetrics(otel::ExpositionFormat format) {
+        auto start = std::chrono::steady_clock::now();
+        std::string out;
+        out.reserve(last_render_size.load(std::memory_order_relaxed));
+        if (format == otel::ExpositionFormat::PrometheusText) {
+            writePrometheusMetrics(out);
+        }
+        else {
+            std::vector<otel::MetricData> families = collectMetrics();
+            if (format == otel::ExpositionFormat::OpenMetricsText) otel::WriteOpenMetrics(out, families);
+            else otel::WritePrometheusProtobuf(out, families);
+        }
+        last_render_size.store(out.size() + out.size() / 8, std::memory_order_relaxed);
+        // Il rendering corrente si vede allo scrape successivo
+        render_duration.Record(std::chrono::steady_clock::now() - start);
+        render_bytes.Set(static_cast<int64_t>(out.size()));
+        return out;
+    }
+
+    // Snapshot delle stesse famiglie di writePrometheusMetrics: contatori nativi,
+    // strumenti del registry e footprint.
+    std::vector<otel::MetricData> collectMetrics() {
+        std::vector<otel::MetricData> families;
+        families.reserve(otel::MetricsRegistry::Instance().Size() + 8);
+
+        otel::MetricData total;
+        total.name = "visit_counter_total";
+        total.description = "Numero totale di visite al server";
+        total.points.emplace_back();
+        total.points.back().value = total_counter.load();
+        families.push_back(std::move(total));
+
+        otel::MetricData per_path;
+        per_path.name = "path_visits_total";
+        per_path.description = "Numero di visite per percorso";
+        auto collect_path = [&per_path](const PathEntry& entry) {
+            otel::MetricPoint point;
+            point.labels.emplace_back("path", entry.path);
+            point.value = entry.counter.Value();
+            per_path.points.push_back(std::move(point));
+        };
+        size_t n = path_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            collect_path(paths[i]);
+        }
+        if (overflow_ready.load(std::memory_order_acquire)) {
+            collect_path(paths[kOverflowPath]);
+        }
+        families.push_back(std::move(per_path));
+
+        const otel::MetricsRegistry& registry = otel::MetricsRegistry::Instance();
+        for (auto& metric : registry.Collect()) families.push_back(std::move(metric));
+        registry.CollectFootprint(families);
+        return families;
+    }
+
+    // Aggiunge al buffer `out` l'esposizione Prometheus completa.
+    void writePrometheusMetrics(std::string& out) {
+        // --- Metriche "Native" (generate direttamente qui) ---
+
+        // Metrica totale visite
+        out += "# HELP visit_counter_total Numero totale di visite al server\n";
+        out += "# TYPE visit_counter_total counter\n";
+        out += "visit_counter_total ";
+        otel::AppendInt(out, total_counter.load()); // Legge il valore atomico
+        out += "\n\n";
+
+        // Metriche per percorso (dalla tabella dei percorsi, prefissi pre-renderizzati)
+        out += "# HELP path_visits_total Numero di visite per percorso\n";
+        out += "# TYPE path_visits_total counter\n";
+        auto write_path = [&out](const PathEntry& entry) {
+            // Formato con label: metric_name{label_key="label_value"} value
+            out += entry.prometheus_prefix;
+            otel::AppendInt(out, entry.counter.Value());
+            out += '\n';
+        };
+        size_t n = path_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            write_path(paths[i]);
+        }
+        if (overflow_ready.load(std::memory_order_acquire)) {
+            write_path(paths[kOverflowPath]);
+        }
+
+        // --- Metriche OpenTelemetry (dal Registry minimale) ---
+        // Aggiunge l'output delle metriche registrate tramite l'OTEL Registry.
+        // Queste sono già formattate in stile Prometheus dalla classe Metric.
+        out += '\n';
+        otel::MetricsRegistry::Instance().WritePrometheus(out);
+    }
+};
+
+// --- Persistenza dei contatori ---
+// Lo stato di contatori e istogrammi sopravvive ai riavvii (crash, redeploy con
+// restart: unless-stopped) in un file mappato in memoria, così le serie cumulative
+// ripartono dal valore precedente e rate() in Prometheus non vede un azzeramento.
+// Un thread dedicato scrive periodicamente uno snapshot nella mappatura: i thread delle
+// richieste non fanno alcun I/O aggiuntivo. All'avvio lo stato si rilegge direttamente
+// dalla mappatura (nessuna read né parsing di testo), in pochi microsecondi.
+
+// File di stato a doppio slot: [FileHeader][slot 0][slot 1]. Ogni checkpoint scrive lo
+// slot non corrente e solo alla fine il suo header (sequenza e checksum): se il processo
+// o la macchina si fermano a metà, la checksum non torna e al riavvio si usa l'altro slot.
+// Con MAP_SHARED le pagine scritte restano nella page cache anche se il processo va in
+// crash; msync(MS_ASYNC) chiede al kernel di scriverle su disco senza attendere.
+//
+// Il payload di uno slot è una sequenza di record, con interi nell'ordine nativo:
+//   [u16 lunghezza nome][nome][u16 numero label]([u16 lunghezza][chiave][u16 lunghezza][valore])*
+//   [u16 numero valori][i64 valori...]
+class StateFile {
+public:
+    static constexpr size_t kDefaultSlotBytes = 1 << 20;
+
+private:
+    static constexpr uint32_t kVersion = 1;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t slot_bytes;
+    };
+
+    struct SlotHeader {
+        uint64_t sequence;       // 0: slot mai scritto
+        uint64_t payload_bytes;
+        uint64_t time_unix_nano; // Istante del checkpoint
+        uint64_t checksum;       // FNV-1a di sequenza, lunghezza e payload
+    };
+
+    static constexpr size_t kHeaderBytes = 64;
+    static_assert(sizeof(FileHeader) <= kHeaderBytes, "FileHeader troppo grande");
+
+    int fd = -1;
+    std::byte* base = nullptr;
+    size_t mapped_bytes = 0;
+    size_t slot_bytes = 0;
+    uint64_t sequence = 0;  // Sequenza dell'ultimo slot valido
+    int current_slot = -1;  // Slot con l'ultimo snapshot valido, o -1
+
+    static void Magic(char (&magic)[8]) { std::memcpy(magic, "WSSTATE1", 8); }
+
+    static uint64_t Checksum(uint64_t seq, uint64_t size, const std::byte* payload) {
+        uint64_t hash = 1469598103934665603ULL;
+        auto mix = [&hash](const void* data, size_t n) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < n; ++i) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+            }
+        };
+        mix(&seq, sizeof(seq));
+        mix(&size, sizeof(size));
+        mix(payload, static_cast<size_t>(size));
+        return hash;
+    }
+
+    SlotHeader& Header(size_t slot) const {
+        return *reinterpret_cast<SlotHeader*>(base + kHeaderBytes + slot * (sizeof(SlotHeader) + slot_bytes));
+    }
+    std::byte* Payload(size_t slot) const {
+        return base + kHeaderBytes + slot * (sizeof(SlotHeader) + slot_bytes) + sizeof(SlotHeader);
+    }
+
+    bool SlotValid(size_t slot) const {
+        const SlotHeader& header = Header(slot);
+        return header.sequence != 0 && header.payload_bytes <= slot_bytes &&
+            header.checksum == Checksum(header.sequence, header.payload_bytes, Payload(slot));
+    }
+
+    // Slot con lo snapshot completo più recente, o -1.
+    int CurrentSlot() const {
+        int current = -1;
+        for (int slot = 0; slot < 2; ++slot) {
+            if (SlotValid(slot) && (current < 0 || Header(slot).sequence > Header(current).sequence)) current = slot;
+        }
+        return current;
+    }
+
+    StateFile() = default;
+
+public:
+    StateFile(const StateFile&) = delete;
+    StateFile& operator=(const StateFile&) = delete;
+
+    ~StateFile() {
+#ifndef _WIN32
+        if (base) {
+            msync(base, mapped_bytes, MS_SYNC);
+            munmap(base, mapped_bytes);
+        }
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    // Apre (creandolo se serve) il file di stato e lo mappa in memoria. Un file con formato
+    // o dimensione degli slot diversi viene reinizializzato vuoto. nullptr in caso di errore
+    // (descritto in `error`).
+    static std::unique_ptr<StateFile> Open(const std::string& path, size_t slot_bytes, std::string& error) {
+#ifdef _WIN32
+        (void)path; (void)slot_bytes;
+        error = "file di stato non supportato su Windows";
+        return nullptr;
+#else
+        std::unique_ptr<StateFile> file(new StateFile());
+        file->slot_bytes = (slot_bytes + 7) & ~size_t{ 7 };
+        file->mapped_bytes = kHeaderBytes + 2 * (sizeof(SlotHeader) + file->slot_bytes);
+        file->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file->fd < 0) {
+            error = path + ": " + std::strerror(errno);
+            return nullptr;
+        }
+        struct stat info;
+        bool fresh = fstat(file->fd, &info) != 0 || static_cast<size_t>(info.st_size) != file->mapped_bytes;
+        if (fresh && ftruncate(file->fd, static_cast<off_t>(file->mapped_bytes)) != 0) {
+            error = path + ": " + std::strerror(errno);
+            return nullptr;
+        }
+        void* mapping = mmap(nullptr, file->mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        if (mapping == MAP_FAILED) {
+            error = path + ": " + std::strerror(errno);
+            return nullptr;
+        }
+        file->base = static_cast<std::byte*>(mapping);
+
+        FileHeader& header = *reinterpret_cast<FileHeader*>(file->base);
+        FileHeader expected{};
+        Magic(expected.magic);
+        expected.version = kVersion;
+        expected.slot_bytes = file->slot_bytes;
+        if (fresh || std::memcmp(&header, &expected, sizeof(FileHeader)) != 0) {
+            std::memset(file->base, 0, file->mapped_bytes);
+            header = expected;
+        }
+        file->current_slot = file->CurrentSlot();
+        file->sequence = file->current_slot >= 0 ? file->Header(file->current_slot).sequence : 0;
+        return file;
+#endif
+    }
+
+    // Visita i record dell'ultimo snapshot completo:
+    // fn(std::string_view nome, const otel::SortedLabels& label, const int64_t* valori, size_t n).
+    // Restituisce il numero di record letti (0 se non c'è uno snapshot valido o è malformato
+    // da quel punto in poi).
+    template <typename Fn>
+    size_t ForEachRecord(Fn fn) const {
+        int slot = current_slot;
+        if (slot < 0) return 0;
+        const std::byte* cursor = Payload(slot);
+        const std::byte* end = cursor + Header(slot).payload_bytes;
+        auto read_u16 = [&](uint16_t& value) {
+            if (end - cursor < 2) return false;
+            std::memcpy(&value, cursor, 2);
+            cursor += 2;
+            return true;
+        };
+        auto read_string = [&](std::string_view& value) {
+            uint16_t size;
+            if (!read_u16(size) || end - cursor < size) return false;
+            value = std::string_view(reinterpret_cast<const char*>(cursor), size);
+            cursor += size;
+            return true;
+        };
+        size_t records = 0;
+        otel::SortedLabels labels;
+        std::vector<int64_t> values;
+        while (cursor < end) {
+            std::string_view name, key, value;
+            uint16_t label_count, value_count;
+            if (!read_string(name) || !read_u16(label_count)) break;
+            labels.clear();
+            bool ok = true;
+            for (uint16_t i = 0; i < label_count && ok; ++i) {
+                ok = read_string(key) && read_string(value);
+                if (ok) labels.emplace_back(std::string(key), std::string(value));
+            }
+            if (!ok || !read_u16(value_count) || static_cast<size_t>(end - cursor) < value_count * sizeof(int64_t)) break;
+            values.resize(value_count);
+            std::memcpy(values.data(), cursor, value_count * sizeof(int64_t));
+            cursor += value_count * sizeof(int64_t);
+            fn(name, labels, values.data(), values.size());
+            ++records;
+        }
+        return records;
+    }
+
+    // Accumula i record di un checkpoint in un buffer riutilizzabile, fino alla capacità
+    // di uno slot: i record che non entrano vengono scartati (e contati).
+    class Snapshot {
+    private:
+        std::string buffer;
+        size_t capacity = 0;
+        size_t dropped = 0;
+
+        void AppendU16(size_t value) {
+            uint16_t v = static_cast<uint16_t>(value);
+            buffer.append(reinterpret_cast<const char*>(&v), 2);
+        }
+        void AppendString(std::string_view value) {
+            AppendU16(value.size());
+            buffer.append(value.data(), value.size());
+        }
+
+    public:
+        void Reset(size_t slot_capacity) {
+            buffer.clear();
+            capacity = slot_capacity;
+            dropped = 0;
+        }
+
+        void Add(std::string_view name, const otel::SortedLabels& labels, const int64_t* values, size_t count) {
+            constexpr size_t kMaxField = std::numeric_limits<uint16_t>::max();
+            size_t size = 2 + name.size() + 2 + 2 + count * sizeof(int64_t);
+            bool fits = name.size() <= kMaxField && labels.size() <= kMaxField && count <= kMaxField;
+            for (const auto& label : labels) {
+                size += 4 + label.first.size() + label.second.size();
+                fits = fits && label.first.size() <= kMaxField && label.second.size() <= kMaxField;
+            }
+            if (!fits || buffer.size() + size > capacity) {
+                ++dropped;
+                return;
+            }
+            AppendString(name);
+            AppendU16(labels.size());
+            for (const auto& label : labels) {
+                AppendString(label.first);
+                AppendString(label.second);
+            }
+            AppendU16(count);
+            buffer.append(reinterpret_cast<const char*>(values), count * sizeof(int64_t));
+        }
+
+        std::string_view Data() const { return buffer; }
+        size_t Dropped() const { return dropped; }
+    };
+
+    size_t SlotBytes() const { return slot_bytes; }
+
+    // Scrive lo snapshot nello slot non corrente e lo rende il corrente. Da un solo thread.
+    void Write(const Snapshot& snapshot, uint64_t time_unix_nano) {
+        std::string_view data = snapshot.Data();
+        int slot = current_slot == 0 ? 1 : 0;
+        SlotHeader& header = Header(slot);
+        header.sequence = 0; // Invalida lo slot finché non è completo
+        std::memcpy(Payload(slot), data.data(), data.size());
+        uint64_t next = sequence + 1;
+        header.payload_bytes = data.size();
+        header.time_unix_nano = time_unix_nano;
+        header.checksum = Checksum(next, data.size(), Payload(slot));
+        header.sequence = next;
+        sequence = next;
+        current_slot = slot;
+#ifndef _WIN32
+        msync(base, mapped_bytes, MS_ASYNC);
+#endif
+    }
+};
+
+// Opzioni della persistenza: WEBSERVER_STATE_FILE (percorso; vuoto = disattivata),
+// WEBSERVER_STATE_CHECKPOINT_MS (intervallo tra due checkpoint), WEBSERVER_STATE_SLOT_BYTES.
+struct StateOptions {
+    std::string path;
+    std::chrono::milliseconds interval{ 1000 };
+    size_t slot_bytes = StateFile::kDefaultSlotBytes;
+
+    static StateOptions FromEnvironment() {
+        StateOptions options;
+        if (const char* v = config::Get("WEBSERVER_STATE_FILE")) options.path = v;
+        if (const char* v = config::Get("WEBSERVER_STATE_CHECKPOINT_MS")) {
+            long interval_ms = std::atol(v);
+            if (interval_ms > 0) options.interval = std::chrono::milliseconds(interval_ms);
+        }
+        if (const char* v = config::Get("WEBSERVER_STATE_SLOT_BYTES")) {
+            size_t bytes = std::strtoul(v, nullptr, 10);
+            if (bytes > 0) options.slot_bytes = bytes;
+        }
+        return options;
+    }
+};
+
+// Ripristina all'avvio e salva periodicamente lo stato del VisitCounter e degli strumenti
+// del registry (contatori e istogrammi) nel file di stato.
+class CounterCheckpointer {
+private:
+    // Nome del record del totale nativo delle visite (non è uno strumento del registry).
+    static constexpr const char* kVisitTotalRecord = "visit_counter_total";
+
+    struct Stats {
+        std::atomic<int64_t> checkpoints{ 0 };
+        std::atomic<int64_t> dropped_series{ 0 };
+        std::atomic<int64_t> last_bytes{ 0 };
+        std::atomic<int64_t> last_nanos{ 0 };
+    };
+
+    std::unique_ptr<StateFile> file;
+    VisitCounter& counter;
+    StateOptions options;
+    std::shared_ptr<Stats> stats = std::make_shared<Stats>();
+    StateFile::Snapshot snapshot; // Solo sotto checkpoint_mutex
+    std::mutex checkpoint_mutex;
+
+    std::mutex worker_mutex;
+    std::condition_variable worker_cv;
+    bool running = false;
+    std::thread worker;
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        while (running) {
+            if (worker_cv.wait_for(lock, options.interval, [this] { return !running; })) break;
+            lock.unlock();
+            Checkpoint();
+            lock.lock();
+        }
+    }
+
+public:
+    CounterCheckpointer(std::unique_ptr<StateFile> f, VisitCounter& c, const StateOptions& opts)
+        : file(std::move(f)), counter(c), options(opts) {
+        otel::MetricsRegistry& registry = otel::MetricsRegistry::Instance();
+        std::shared_ptr<Stats> shared = stats;
+        registry.CreateObservableCounter("webserver_state_checkpoints_total",
+            "Checkpoint dello stato dei contatori scritti nel file di stato",
+            [shared] { return shared->checkpoints.load(std::memory_order_relaxed); });
+        registry.CreateObservableCounter("webserver_state_dropped_series_total",
+            "Serie non salvate perche' lo slot del file di stato era pieno",
+            [shared] { return shared->dropped_series.load(std::memory_order_relaxed); });
+        registry.CreateObservableGauge("webserver_state_checkpoint_bytes",
+            "Dimensione dell'ultimo checkpoint (byte)",
+            [shared] { return shared->last_bytes.load(std::memory_order_relaxed); });
+        registry.CreateObservableGauge("webserver_state_checkpoint_nanoseconds",
+            "Durata dell'ultimo checkpoint (ns)",
+            [shared] { return shared->last_nanos.load(std::memory_order_relaxed); });
+    }
+
+    CounterCheckpointer(const CounterCheckpointer&) = delete;
+    CounterCheckpointer& operator=(const CounterCheckpointer&) = delete;
+
+    ~CounterCheckpointer() {
+        Shutdown();
+    }
+
+    // Somma ai contatori lo stato dell'ultimo checkpoint. Da chiamare una volta, dopo aver
+    // creato gli strumenti e prima di accettare richieste: le serie di strumenti non (più)
+    // registrati vengono ignorate. I percorsi salvati vengono re-internati nel VisitCounter,
+    // così compaiono subito in /stats. Restituisce il numero di serie ripristinate.
+    size_t Restore() {
+        otel::MetricsRegistry& registry = otel::MetricsRegistry::Instance();
+        size_t restored = 0;
+        file->ForEachRecord([&](std::string_view name, const otel::SortedLabels& labels, const int64_t* values, size_t count) {
+            if (name == kVisitTotalRecord) {
+                if (count == 1) counter.restoreTotal(values[0]);
+                ++restored;
+                return;
+            }
+            otel::Instrument* instrument = registry.Find(std::string(name));
+            if (!instrument) return;
+            instrument->RestoreState(labels, values, count);
+            ++restored;
+            if (name == VisitCounter::kPathMetricName) {
+                for (const auto& label : labels) {
+                    if (label.first == "path" && label.second != VisitCounter::kOverflowPathName) counter.registerPath(label.second);
+                }
+            }
+        });
+        return restored;
+    }
+
+    // Avvia il thread dei checkpoint periodici.
+    void Start() {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        if (running) return;
+        running = true;
+        worker = std::thread(&CounterCheckpointer::WorkerLoop, this);
+    }
+
+    // Scrive subito uno snapshot dal thread chiamante. Legge gli atomici con load relaxed:
+    // i thread delle richieste non vengono fermati.
+    void Checkpoint() {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex);
+        auto started = std::chrono::steady_clock::now();
+        snapshot.Reset(file->SlotBytes());
+        int64_t total = counter.getTotal();
+        snapshot.Add(kVisitTotalRecord, {}, &total, 1);
+        otel::MetricsRegistry::Instance().ForEachInstrument([&](const std::string& name, const otel::Instrument& instrument) {
+            instrument.SaveState([&](const otel::SortedLabels& labels, const int64_t* values, size_t count) {
+                snapshot.Add(name, labels, values, count);
+            });
+        });
+        file->Write(snapshot, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()));
+        stats->checkpoints.fetch_add(1, std::memory_order_relaxed);
+        stats->dropped_series.fetch_add(static_cast<int64_t>(snapshot.Dropped()), std::memory_order_relaxed);
+        stats->last_bytes.store(static_cast<int64_t>(snapshot.Data().size()), std::memory_order_relaxed);
+        stats->last_nanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count(), std::memory_order_relaxed);
+    }
+
+    // Ferma il thread e scrive un ultimo checkpoint. Idempotente.
+    void Shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(worker_mutex);
+            if (!running) return;
+            running = false;
+        }
+        worker_cv.notify_one();
+        if (worker.joinable()) worker.join();
+        Checkpoint();
+    }
+};
+
+// --- Aggregazione del cluster ---
+// Con più repliche dietro un bilanciatore ogni istanza conta solo le proprie visite.
+// In modalità cluster ogni nodo mantiene un G-counter (CRDT a soli incrementi): per ogni
+// nodo noto, il suo totale e le sue visite per percorso. Un thread in background invia
+// periodicamente ai peer le voci cambiate (delta) e ogni kFullStateRounds round lo stato
+// completo, che ripara i messaggi persi e allinea i peer appena avviati. L'unione di due
+// stati è il massimo elemento per elemento, quindi messaggi duplicati, fuori ordine o
+// rilanciati da altri nodi sono innocui. Homepage e /stats sommano ai valori locali la
+// vista remota pubblicata dal thread: nessuna chiamata di rete durante le richieste.
+//
+// Senza persistenza dei contatori ogni avvio è una nuova incarnazione ("<id>#<avvio>") che
+// riparte da zero. Lo stato è indicizzato per ID stabile: quando compare un'incarnazione più
+// recente, i valori della precedente confluiscono nella somma "ritirata" del nodo, scambiata
+// anch'essa in gossip (con il massimo). Le vecchie incarnazioni non occupano quindi voci del
+// G-counter e i riavvii non esauriscono il limite di nodi.
+//
+// Formato del messaggio (POST /cluster/gossip, text/plain), una voce per riga:
+//   N <nodo>[#<incarnazione>] <totale>   inizio delle voci di un nodo (incarnazione corrente)
+//   P <visite> <percorso>                percorso del nodo precedente (il percorso chiude la riga)
+//   R <nodo> <totale>                    somma delle incarnazioni ritirate del nodo
+//   Q <visite> <percorso>                percorso ritirato del nodo della riga R precedente
+
+// Opzioni: WEBSERVER_CLUSTER_PEERS (URL base dei peer separati da virgole; vuoto = modalità
+// disattivata), WEBSERVER_CLUSTER_NODE_ID (default: hostname:porta), WEBSERVER_CLUSTER_GOSSIP_MS,
+// WEBSERVER_CLUSTER_TOKEN (obbligatorio con i peer, richiesto nell'header X-Cluster-Token:
+// /cluster/gossip è sulla porta pubblica).
+struct ClusterOptions {
+    std::vector<std::string> peers;
+    std::string node_id;
+    std::chrono::milliseconds interval{ 1000 };
+    std::string token;
+
+    static ClusterOptions FromEnvironment(int port) {
+        ClusterOptions options;
+        if (const char* v = config::Get("WEBSERVER_CLUSTER_PEERS")) {
+            std::string_view rest = v;
+            while (!rest.empty()) {
+                size_t comma = rest.find(',');
+                std::string_view peer = rest.substr(0, comma);
+                while (!peer.empty() && std::isspace(static_cast<unsigned char>(peer.front()))) peer.remove_prefix(1);
+                while (!peer.empty() && std::isspace(static_cast<unsigned char>(peer.back()))) peer.remove_suffix(1);
+                while (!peer.empty() && peer.back() == '/') peer.remove_suffix(1);
+                if (!peer.empty()) options.peers.emplace_back(peer);
+                if (comma == std::string_view::npos) break;
+                rest.remove_prefix(comma + 1);
+            }
+        }
+        if (const char* v = config::Get("WEBSERVER_CLUSTER_NODE_ID")) options.node_id = v;
+        if (options.node_id.empty()) {
+            char host[256] = {};
+            if (gethostname(host, sizeof(host) - 1) != 0 || host[0] == '\0') std::strcpy(host, "localhost");
+            options.node_id = std::string(host) + ":" + std::to_string(port);
+        }
+        // L'ID chiude un campo separato da spazi: niente spazi né a capo; '#' separa l'incarnazione
+        for (char& c : options.node_id) {
+            if (std::isspace(static_cast<unsigned char>(c)) || c == '#') c = '_';
+        }
+        if (const char* v = config::Get("WEBSERVER_CLUSTER_GOSSIP_MS")) {
+            long interval_ms = std::atol(v);
+            if (interval_ms > 0) options.interval = std::chrono::milliseconds(interval_ms);
+        }
+        if (const char* v = config::Get("WEBSERVER_CLUSTER_TOKEN")) options.token = v;
+        return options;
+    }
+
+    bool Enabled() const { return !peers.empty(); }
+
+    // Configurazione utilizzabile: con i peer il token è obbligatorio.
+    bool Validate(std::string& error) const {
+        if (Enabled() && token.empty()) {
+            error = "WEBSERVER_CLUSTER_TOKEN obbligatorio con WEBSERVER_CLUSTER_PEERS";
+            return false;
+        }
+        return true;
+    }
+};
+
+class ClusterAggregator {
+public:
+    // Somma delle visite degli altri nodi: totale e percorsi ordinati per nome.
+    struct RemoteView {
+        int64_t total = 0;
+        std::vector<std::pair<std::string, int64_t>> paths;
+    };
+
+    // Somma dei contatori (mai negativi) che satura invece di andare in overflow: i valori
+    // arrivano dai peer e un messaggio con totali enormi non deve produrre somme negative.
+    static int64_t SaturatingAdd(int64_t a, int64_t b) {
+        return a > std::numeric_limits<int64_t>::max() - b ? std::numeric_limits<int64_t>::max() : a + b;
+    }
+
+private:
+    static constexpr size_t kFullStateRounds = 10;
+    // Nodi remoti (ID stabili, le incarnazioni non contano) tenuti nel G-counter: le voci di nodi
+    // nuovi oltre il limite vengono scartate. Per nodo (correnti e ritirati) e nella vista unita
+    // i percorsi sono al più VisitCounter::kMaxPaths: quelli nuovi oltre il limite confluiscono
+    // in "__other__".
+    static constexpr size_t kMaxNodes = 256;
+
+    // Contatori di un'incarnazione o delle incarnazioni ritirate di un nodo. `changed` marca i
+    // campi da includere nel prossimo delta.
+    struct Counts {
+        int64_t total = 0;
+        std::unordered_map<std::string, int64_t> paths;
+        bool total_changed = false;
+        std::unordered_set<std::string> changed_paths;
+
+        bool Empty() const { return total == 0 && paths.empty(); }
+
+        // Massimo elemento per elemento con un valore ricevuto; true se il valore è cambiato.
+        bool MergeTotal(int64_t value) {
+            if (value <= total) return false;
+            total = value;
+            total_changed = true;
+            return true;
+        }
+
+        bool MergePath(std::string_view path, int64_t value) {
+            auto it = FindOrAddPath(path);
+            if (value <= it->second) return false;
+            it->second = value;
+            changed_paths.emplace(it->first);
+            return true;
+        }
+
+        // Somma (satura) i contatori di un'incarnazione ritirata.
+        void Add(const Counts& retired) {
+            total = SaturatingAdd(total, retired.total);
+            total_changed = true;
+            for (const auto& [path, visits] : retired.paths) {
+                auto it = FindOrAddPath(path);
+                it->second = SaturatingAdd(it->second, visits);
+                changed_paths.emplace(it->first);
+            }
+        }
+
+    private:
+        std::unordered_map<std::string, int64_t>::iterator FindOrAddPath(std::string_view path) {
+            auto it = paths.find(std::string(path));
+            if (it != paths.end()) return it;
+            if (paths.size() >= VisitCounter::kMaxPaths) path = VisitCounter::kOverflowPathName;
+            return paths.emplace(std::string(path), 0).first;
+        }
+    };
+
+    // Voce del G-counter per un ID stabile: l'incarnazione corrente e la somma delle ritirate.
+    struct NodeState {
+        int64_t incarnation = 0; // 0: ID senza incarnazione (contatori persistenti)
+        Counts current;
+        Counts retired;
+    };
+
+    struct Stats {
+        std::atomic<int64_t> sent{ 0 };
+        std::atomic<int64_t> failures{ 0 };
+        std::atomic<int64_t> received{ 0 };
+        std::atomic<int64_t> nodes{ 0 };
+        std::atomic<int64_t> dropped{ 0 };
+    };
+
+    VisitCounter& counter;
+    ClusterOptions options;
+    std::shared_ptr<Stats> stats = std::make_shared<Stats>();
+
+    // Stato degli altri nodi per ID stabile: scritto dagli handler di /cluster/gossip e dal
+    // thread di gossip. La voce dell'ID locale contiene solo le incarnazioni ritirate del nodo.
+    std::mutex state_mutex;
+    std::map<std::string, NodeState> remote;
+    bool remote_changed = false;
+    std::string local_id;          // ID stabile del nodo locale
+    int64_t local_incarnation = 0; // Incarnazione locale (0 con contatori persistenti)
+
+    // Ultimi valori locali inviati (solo thread di gossip), per calcolare il delta.
+    int64_t sent_total = -1;
+    std::unordered_map<std::string, int64_t> sent_paths;
+    size_t round = 0;
+
+    // Vista pubblicata per gli handler: il totale è un atomico (letto a ogni richiesta
+    // della homepage), i percorsi uno snapshot condiviso (solo /stats).
+    std::atomic<int64_t> remote_total{ 0 };
+    mutable std::mutex view_mutex;
+    std::shared_ptr<const RemoteView> view = std::make_shared<RemoteView>();
+
+    std::vector<std::unique_ptr<httplib::Client>> clients;
+    std::mutex worker_mutex;
+    std::condition_variable worker_cv;
+    bool running = false;
+    std::thread worker;
+
+    // Separa "<id>#<incarnazione>" nell'ID stabile e nell'incarnazione (0 se assente).
+    static std::pair<std::string_view, int64_t> SplitIncarnation(std::string_view node) {
+        size_t hash = node.rfind('#');
+        if (hash == std::string_view::npos) return { node, 0 };
+        int64_t incarnation = 0;
+        auto parsed = std::from_chars(node.data() + hash + 1, node.data() + node.size(), incarnation);
+        if (parsed.ec != std::errc() || parsed.ptr != node.data() + node.size() || incarnation <= 0) return { node, 0 };
+        return { node.substr(0, hash), incarnation };
+    }
+
+    // `tag` è 'N' (incarnazione corrente) o 'R' (ritirate).
+    static void AppendNode(std::string& out, char tag, std::string_view node, int64_t incarnation, int64_t total) {
+        out += tag;
+        out += ' ';
+        out.append(node.data(), node.size());
+        if (incarnation > 0) {
+            out += '#';
+            otel::AppendInt(out, incarnation);
+        }
+        out += ' ';
+        otel::AppendInt(out, total);
+        out += '\n';
+    }
+
+    // `tag` è 'P' (percorso corrente) o 'Q' (ritirato).
+    static void AppendPath(std::string& out, char tag, std::string_view path, int64_t visits) {
+        if (path.find('\n') != std::string_view::npos) return; // Non rappresentabile nel formato
+        out += tag;
+        out += ' ';
+        otel::AppendInt(out, visits);
+        out += ' ';
+        out.append(path.data(), path.size());
+        out += '\n';
+    }
+
+    // Messaggio del round: la voce locale (cambiata o completa) e le voci remote cambiate,
+    // rilanciate così che i nodi non collegati direttamente convergano comunque.
+    std::string BuildMessage(bool full) {
+        std::string message;
+        int64_t total = counter.getTotal();
+        auto path_counters = counter.getPathCounters();
+        bool total_changed = full || total != sent_total;
+        std::string local_paths;
+        for (const auto& [path, visits] : path_counters) {
+            auto it = sent_paths.find(std::string(path));
+            if (!full && it != sent_paths.end() && it->second == visits) continue;
+            AppendPath(local_paths, 'P', path, visits);
+            sent_paths[std::string(path)] = visits;
+        }
+        if (total_changed || !local_paths.empty()) {
+            AppendNode(message, 'N', local_id, local_incarnation, total);
+            message += local_paths;
+            sent_total = total;
+        }
+
+        std::lock_guard<std::mutex> lock(state_mutex);
+        auto append = [&](char node_tag, char path_tag, const std::string& node, int64_t incarnation, Counts& counts) {
+            if (!full && !counts.total_changed && counts.changed_paths.empty()) return;
+            counts.total_changed = false;
+            if (counts.Empty()) return;
+            AppendNode(message, node_tag, node, incarnation, counts.total);
+            for (const auto& [path, visits] : counts.paths) {
+                if (full || counts.changed_paths.count(path)) AppendPath(message, path_tag, path, visits);
+            }
+            counts.changed_paths.clear();
+        };
+        for (auto& [node, state] : remote) {
+            if (node != local_id) append('N', 'P', node, state.incarnation, state.current);
+            append('R', 'Q', node, 0, state.retired);
+        }
+        return message;
+    }
+
+    // Ricalcola e pubblica la vista remota, se lo stato è cambiato.
+    void PublishView() {
+        auto next = std::make_shared<RemoteView>();
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            if (!remote_changed) return;
+            remote_changed = false;
+            std::unordered_map<std::string, int64_t> paths;
+            auto add = [&](const Counts& counts) {
+                next->total = SaturatingAdd(next->total, counts.total);
+                for (const auto& [path, visits] : counts.paths) {
+                    auto it = paths.find(path);
+                    if (it == paths.end()) {
+                        it = paths.size() < VisitCounter::kMaxPaths
+                            ? paths.emplace(path, 0).first
+                            : paths.emplace(VisitCounter::kOverflowPathName, 0).first;
+                    }
+                    it->second = SaturatingAdd(it->second, visits);
+                }
+            };
+            for (const auto& [node, state] : remote) {
+                add(state.current);
+                add(state.retired);
+            }
+            next->paths.assign(paths.begin(), paths.end());
+            stats->nodes.store(static_cast<int64_t>(remote.size()), std::memory_order_relaxed);
+        }
+        std::sort(next->paths.begin(), next->paths.end());
+        remote_total.store(next->total, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(view_mutex);
+        view = std::move(next);
+    }
+
+    void GossipRound() {
+        bool full = round++ % kFullStateRounds == 0;
+        std::string message = BuildMessage(full);
+        if (!message.empty()) {
+            httplib::Headers headers;
+            if (!options.token.empty()) headers.emplace("X-Cluster-Token", options.token);
+            for (auto& client : clients) {
+                auto result = client->Post("/cluster/gossip", headers, message, "text/plain");
+                if (result && result->status / 100 == 2) stats->sent.fetch_add(1, std::memory_order_relaxed);
+                else stats->failures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        PublishView();
+    }
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        while (running) {
+            if (worker_cv.wait_for(lock, options.interval, [this] { return !running; })) break;
+            lock.unlock();
+            GossipRound();
+            lock.lock();
+        }
+    }
+
+public:
+    // Senza persistenza dei contatori un riavvio riparte da zero: all'ID viene aggiunta
+    // l'incarnazione (istante di avvio in ms), così le visite precedenti passano nella somma
+    // ritirata del nodo invece di nascondere quelle nuove sotto il massimo.
+    ClusterAggregator(VisitCounter& c, const ClusterOptions& opts, bool persistent_counters)
+        : counter(c), options(opts), local_id(opts.node_id) {
+        if (!persistent_counters) {
+            local_incarnation = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            options.node_id += "#" + std::to_string(local_incarnation);
+        }
+        auto timeout_ms = std::max<long long>(100, options.interval.count() / 2);
+        auto seconds = static_cast<time_t>(timeout_ms / 1000);
+        auto usec = static_cast<time_t>((timeout_ms % 1000) * 1000);
+        for (const auto& peer : options.peers) {
+            auto client = std::make_unique<httplib::Client>(peer);
+            client->set_keep_alive(true);
+            client->set_connection_timeout(seconds, usec);
+            client->set_read_timeout(seconds, usec);
+            client->set_write_timeout(seconds, usec);
+            clients.push_back(std::move(client));
+        }
+        otel::MetricsRegistry& registry = otel::MetricsRegistry::Instance();
+        std::shared_ptr<Stats> shared = stats;
+        registry.CreateObservableCounter("webserver_cluster_gossip_sent_total",
+            "Messaggi di gossip consegnati ai peer",
+            [shared] { return shared->sent.load(std::memory_order_relaxed); });
+        registry.CreateObservableCounter("webserver_cluster_gossip_failures_total",
+            "Messaggi di gossip non consegnati (peer irraggiungibile o errore)",
+            [shared] { return shared->failures.load(std::memory_order_relaxed); });
+        registry.CreateObservableCounter("webserver_cluster_gossip_received_total",
+            "Messaggi di gossip ricevuti dai peer",
+            [shared] { return shared->received.load(std::memory_order_relaxed); });
+        registry.CreateObservableGauge("webserver_cluster_remote_nodes",
+            "Nodi remoti (ID stabili) nel G-counter",
+            [shared] { return shared->nodes.load(std::memory_order_relaxed); });
+        registry.CreateObservableCounter("webserver_cluster_gossip_dropped_nodes_total",
+            "Voci di nodi scartate perché il G-counter ha raggiunto il limite di nodi",
+            [shared] { return shared->dropped.load(std::memory_order_relaxed); });
+    }
+
+    ClusterAggregator(const ClusterAggregator&) = delete;
+    ClusterAggregator& operator=(const ClusterAggregator&) = delete;
+
+    ~ClusterAggregator() {
+        Shutdown();
+    }
+
+    const std::string& NodeId() const { return options.node_id; }
+
+    // Verifica il token condiviso del messaggio; senza token configurato nessun messaggio è accettato.
+    bool Authorized(const httplib::Request& req) const {
+        return !options.token.empty() && req.get_header_value("X-Cluster-Token") == options.token;
+    }
+
+    // Unisce un messaggio di gossip allo stato (massimo elemento per elemento). Le voci
+    // dell'incarnazione locale vengono ignorate: i suoi valori sono sempre quelli del VisitCounter.
+    // Un'incarnazione più recente di quella nota ritira la precedente (i suoi contatori passano
+    // nella somma ritirata); le voci di incarnazioni già ritirate vengono ignorate.
+    // Oltre kMaxNodes le voci di nodi nuovi sono scartate; oltre kMaxPaths percorsi per nodo i
+    // percorsi nuovi confluiscono (sempre col massimo) nel "__other__" del nodo.
+    // Restituisce false se il messaggio è malformato (le righe valide precedenti restano applicate).
+    bool Merge(std::string_view message) {
+        stats->received.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(state_mutex);
+        Counts* counts = nullptr; // Destinazione delle righe P (corrente) o Q (ritirata)
+        bool retired = false;
+        auto find_node = [this](std::string_view id) -> NodeState* {
+            auto it = remote.find(std::string(id));
+            if (it == remote.end()) {
+                if (remote.size() >= kMaxNodes) {
+                    stats->dropped.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                it = remote.emplace(std::string(id), NodeState()).first;
+                // Per l'ID locale la corrente è l'incarnazione locale: le precedenti risultano ritirate
+                if (it->first == local_id) it->second.incarnation = local_incarnation;
+            }
+            return &it->second;
+        };
+        while (!message.empty()) {
+            size_t end = message.find('\n');
+            std::string_view line = message.substr(0, end);
+            message.remove_prefix(end == std::string_view::npos ? message.size() : end + 1);
+            if (line.size() < 2 || line[1] != ' ') return false;
+            const bool node_line = line[0] == 'N' || line[0] == 'R';
+            std::string_view rest = line.substr(2);
+            size_t space = node_line ? rest.rfind(' ') : rest.find(' ');
+            if (space == std::string_view::npos) return false;
+            std::string_view number = node_line ? rest.substr(space + 1) : rest.substr(0, space);
+            std::string_view text = node_line ? rest.substr(0, space) : rest.substr(space + 1);
+            int64_t value = 0;
+            auto parsed = std::from_chars(number.data(), number.data() + number.size(), value);
+            if (parsed.ec != std::errc() || parsed.ptr != number.data() + number.size() || value < 0) return false;
+            if (line[0] == 'N') {
+                counts = nullptr;
+                retired = false;
+                auto [id, incarnation] = SplitIncarnation(text);
+                if (id == local_id && incarnation == local_incarnation) continue;
+                NodeState* node = find_node(id);
+                if (!node || incarnation < node->incarnation) continue; // Scartato o già ritirato
+                if (incarnation > node->incarnation) {
+                    if (!node->current.Empty()) node->retired.Add(node->current);
+                    node->current = Counts();
+                    node->incarnation = incarnation;
+                    remote_changed = true;
+                }
+                counts = &node->current;
+                if (counts->MergeTotal(value)) remote_changed = true;
+            }
+            else if (line[0] == 'R') {
+                NodeState* node = find_node(text);
+                counts = node ? &node->retired : nullptr;
+                retired = true;
+                if (counts && counts->MergeTotal(value)) remote_changed = true;
+            }
+            else if (line[0] == 'P' || line[0] == 'Q') {
+                if (retired != (line[0] == 'Q')) return false;
+                if (!counts) continue; // Percorso del nodo locale, scartato o prima di una riga N/R
+                if (counts->MergePath(text, value)) remote_changed = true;
+            }
+            else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Visite totali degli altri nodi (ultima vista pubblicata). Un load relaxed.
+    int64_t RemoteTotal() const { return remote_total.load(std::memory_order_relaxed); }
+
+    // Ultima vista pubblicata; lo snapshot resta valido finché il chiamante lo conserva.
+    std::shared_ptr<const RemoteView> View() const {
+        std::lock_guard<std::mutex> lock(view_mutex);
+        return view;
+    }
+
+    // Unisce (somma) i contatori locali ordinati con quelli remoti: il risultato è ancora
+    // ordinato e allocato in `resource`. Le viste puntano in `local` e in `remote_view`.
+    static std::pmr::vector<std::pair<std::string_view, int64_t>> MergePaths(
+        const std::pmr::vector<std::pair<std::string_view, int64_t>>& local, const RemoteView& remote_view,
+        std::pmr::memory_resource* resource) {
+        std::pmr::vector<std::pair<std::string_view, int64_t>> merged(resource);
+        merged.reserve(local.size() + remote_view.paths.size());
+        auto l = local.begin();
+        auto r = remote_view.paths.begin();
+        while (l != local.end() || r != remote_view.paths.end()) {
+            if (r == remote_view.paths.end() || (l != local.end() && l->first < r->first)) {
+                merged.push_back(*l++);
+            }
+            else if (l == local.end() || r->first < l->first) {
+                merged.emplace_back(r->first, r->second);
+                ++r;
+            }
+            else {
+                merged.emplace_back(l->first, SaturatingAdd(l->second, r->second));
+                ++l;
+                ++r;
+            }
+        }
+        return merged;
+    }
+
+    // Avvia il thread di gossip.
+    void Start() {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        if (running) return;
+        running = true;
+        worker = std::thread(&ClusterAggregator::WorkerLoop, this);
+    }
+
+    // Ferma il thread dopo un ultimo round, così i peer ricevono le visite finali. Idempotente.
+    void Shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(worker_mutex);
+            if (!running) return;
+            running = false;
+        }
+        worker_cv.notify_one();
+        if (worker.joinable()) worker.join();
+        GossipRound();
+    }
+};
+
+// --- Arena per richiesta ---
+
+// Arena a incremento (bump allocator) del worker corrente, per i dati temporanei di una
+// richiesta: contenitori pmr degli handler, corpo renderizzato e sua versione compressa.
+// Ogni thread ha un blocco iniziale di kInitialBytes allocato una sola volta; le richieste
+// più grandi proseguono in blocchi chiesti all'heap (contati in SelfTelemetry). Non si
+// libera nulla singolarmente: Reset() restituisce tutto in un colpo solo.
+//
+// Il reset avviene all'inizio della richiesta successiva sullo stesso worker (ArenaMiddleware)
+// e non alla fine dell'handler, perché httplib invia il corpo dopo che l'handler è tornato:
+// fino ad allora la memoria deve restare valida. Un worker gestisce una richiesta alla volta,
+// quindi nessun'altra richiesta può azzerare l'arena mentre un corpo è in invio.
+class RequestArena {
+private:
+    static constexpr size_t kInitialBytes = 64 * 1024;
+
+    // Upstream dell'arena: heap, con il conteggio dei byte che non sono entrati nel blocco iniziale.
+    class CountingUpstream : public std::pmr::memory_resource {
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            otel::SelfTelemetry::Instance().arena_upstream_bytes.Add(static_cast<int64_t>(bytes));
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    struct State {
+        std::unique_ptr<std::byte[]> buffer{ new std::byte[kInitialBytes] };
+        CountingUpstream upstream;
+        std::pmr::monotonic_buffer_resource resource{ buffer.get(), kInitialBytes, &upstream };
+    };
+
+    static State& ThisThread() {
+        thread_local State state;
+        return state;
+    }
+
+public:
+    static std::pmr::memory_resource* Resource() { return &ThisThread().resource; }
+
+    // Libera tutto ciò che è stato allocato dall'ultimo reset (i blocchi extra tornano all'heap,
+    // il blocco iniziale viene riutilizzato).
+    static void Reset() { ThisThread().resource.release(); }
+
+    // Stringa allocata (oggetto e contenuto) nell'arena: resta valida fino al prossimo reset,
+    // quindi anche mentre httplib invia il corpo dopo il ritorno dell'handler. Non viene mai
+    // distrutta: il rilascio dell'arena recupera tutta la memoria.
+    static std::pmr::string& NewString(std::pmr::memory_resource* arena) {
+        return *new (arena->allocate(sizeof(std::pmr::string), alignof(std::pmr::string)))
+            std::pmr::string(arena);
+    }
+};
+
+// --- Template HTML pre-compilati ---
+
+// Pagine HTML di homepage, /stats e /traces: con WEBSERVER_ENABLE_HTML_PAGES=0 (build edge)
+// gli stessi endpoint rispondono in testo semplice e markup e CSS non entrano nel binario.
+constexpr bool kHtmlPages = WEBSERVER_ENABLE_HTML_PAGES != 0;
+constexpr const char* kPageContentType = kHtmlPages ? "text/html; charset=UTF-8" : "text/plain; charset=UTF-8";
+
+// Template HTML compilato una sola volta all'avvio: il testo viene diviso nei frammenti
+// statici che circondano i segnaposto {{nome}}. Render() scrive in sequenza frammenti
+// e valori dinamici (nell'ordine dei segnaposto) in un'unica stringa, senza stringstream.
+class HtmlTemplate {
+private:
+    std::vector<std::string> fragments; // Segnaposto N si trova tra fragments[N] e fragments[N+1]
+    std::vector<std::string> slot_names;
+    size_t static_size = 0;
+    // Dimensione dell'ultimo rendering: usata per riservare subito lo spazio del successivo
+    mutable std::atomic<size_t> last_size{ 0 };
+
+    // Le funzioni di scrittura accettano qualsiasi stringa con append (std::string o
+    // std::pmr::string, per rendere direttamente nell'arena della richiesta).
+    template <typename String>
+    static void AppendValue(String& out, std::string_view value) {
+        out.append(value.data(), value.size());
+    }
+
+    template <typename String>
+    static void AppendValue(String& out, const char* value) {
+        out += value;
+    }
+
+    template <typename String, typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    static void AppendValue(String& out, T value) {
+        char buffer[24];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, result.ptr);
+    }
+
+    // Valore prodotto da una funzione che scrive direttamente nel buffer (es. righe di tabella)
+    template <typename String, typename Fn>
+    static auto AppendValue(String& out, const Fn& write) -> decltype(write(out), void()) {
+        write(out);
+    }
+
+public:
+    explicit HtmlTemplate(std::string_view source) {
+        size_t pos = 0;
+        for (;;) {
+            size_t open = source.find("{{", pos);
+            size_t close = open == std::string_view::npos ? open : source.find("}}", open + 2);
+            if (close == std::string_view::npos) {
+                fragments.emplace_back(source.substr(pos));
+                break;
+            }
+            fragments.emplace_back(source.substr(pos, open - pos));
+            slot_names.emplace_back(source.substr(open + 2, close - open - 2));
+            pos = close + 2;
+        }
+        for (const auto& fragment : fragments) static_size += fragment.size();
+    }
+
+    HtmlTemplate(const HtmlTemplate&) = delete;
+    HtmlTemplate& operator=(const HtmlTemplate&) = delete;
+
+    const std::vector<std::string>& SlotNames() const { return slot_names; }
+
+    // Un argomento per segnaposto: stringhe, interi o callable void(String&).
+    // Scrive in `out` (vuota), ad esempio una std::pmr::string sull'arena della richiesta.
+    template <typename String, typename... Values>
+    void RenderTo(String& out, const Values&... values) const {
+        out.reserve(std::max(static_size, last_size.load(std::memory_order_relaxed)));
+        if (sizeof...(Values) != slot_names.size()) {
+            // Errore di programmazione: si restituiscono i soli frammenti statici
+            for (const auto& fragment : fragments) out += fragment;
+            return;
+        }
+        size_t index = 0;
+        out += fragments[0];
+        ((AppendValue(out, values), out += fragments[++index]), ...);
+        last_size.store(out.size(), std::memory_order_relaxed);
+    }
+
+    template <typename... Values>
+    std::string Render(const Values&... values) const {
+        std::string out;
+        RenderTo(out, values...);
+        return out;
+    }
+};
+
+// Aggiunge `text` con l'escape dei caratteri speciali HTML.
+template <typename String>
+inline void AppendHtmlEscaped(String& out, std::string_view text) {
+    for (char c : text) {
+        switch (c) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        case '\'': out += "&#39;"; break;
+        default: out += c;
+        }
+    }
+}
+
+// --- Compressione delle risposte ---
+
+// Codifiche di contenuto supportate; l'indice è usato per le varianti pre-compresse.
+enum class ContentEncoding { Identity = 0, Gzip = 1, Zstd = 2 };
+constexpr size_t kContentEncodings = 3;
+
+inline const char* ContentEncodingName(ContentEncoding encoding) {
+    switch (encoding) {
+    case ContentEncoding::Gzip: return "gzip";
+    case ContentEncoding::Zstd: return "zstd";
+    default: return "identity";
+    }
+}
+
+// La codifica è compilata in questa build? (gzip richiede zlib, zstd richiede libzstd)
+constexpr bool ContentEncodingAvailable(ContentEncoding encoding) {
+    switch (encoding) {
+#ifdef OTEL_HAVE_ZLIB
+    case ContentEncoding::Gzip: return true;
+#endif
+#ifdef OTEL_HAVE_ZSTD
+    case ContentEncoding::Zstd: return true;
+#endif
+    case ContentEncoding::Identity: return true;
+    default: return false;
+    }
+}
+
+// Livello di compressione indipendente dal codec: Fast per i corpi generati a ogni
+// richiesta, Default per la cache di /metrics, Best per le pagine compresse all'avvio.
+enum class CompressionLevel { Fast, Default, Best };
+
+// Sceglie la codifica dall'header Accept-Encoding: quella disponibile con la qualità più
+// alta, a parità di qualità zstd prima di gzip. q=0 esclude una codifica, "*" vale per
+// quelle non citate; senza header (o senza codifiche utilizzabili) si risponde identity.
+inline ContentEncoding NegotiateContentEncoding(const httplib::Request& req) {
+    auto it = req.headers.find("Accept-Encoding");
+    if (it == req.headers.end()) return ContentEncoding::Identity;
+
+    double quality[kContentEncodings] = { -1, -1, -1 }; // -1: non citata
+    double wildcard = -1;
+    std::string_view value = it->second;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view name = item.substr(0, semicolon);
+        while (!name.empty() && std::isspace(static_cast<unsigned char>(name.front()))) name.remove_prefix(1);
+        while (!name.empty() && std::isspace(static_cast<unsigned char>(name.back()))) name.remove_suffix(1);
+        double q = 1.0;
+        if (semicolon != std::string_view::npos) {
+            std::string params(item.substr(semicolon + 1));
+            size_t pos = params.find("q=");
+            if (pos != std::string::npos) q = std::strtod(params.c_str() + pos + 2, nullptr);
+        }
+
+        auto equals = [&](std::string_view token) { // I nomi delle codifiche non distinguono le maiuscole
+            return name.size() == token.size() && std::equal(name.begin(), name.end(), token.begin(),
+                [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+        };
+        if (equals("gzip") || equals("x-gzip")) quality[static_cast<size_t>(ContentEncoding::Gzip)] = q;
+        else if (equals("zstd")) quality[static_cast<size_t>(ContentEncoding::Zstd)] = q;
+        else if (equals("identity")) quality[static_cast<size_t>(ContentEncoding::Identity)] = q;
+        else if (name == "*") wildcard = q;
+    }
+
+    ContentEncoding best = ContentEncoding::Identity;
+    double best_quality = 0;
+    for (ContentEncoding candidate : { ContentEncoding::Zstd, ContentEncoding::Gzip }) {
+        if (!ContentEncodingAvailable(candidate)) continue;
+        double q = quality[static_cast<size_t>(candidate)];
+        if (q < 0) q = wildcard;
+        if (q > best_quality) {
+            best = candidate;
+            best_quality = q;
+        }
+    }
+    return best;
+}
+
+// Comprime `input` con la codifica indicata. Restituisce false se la codifica non è
+// disponibile, se la compressione fallisce o se non riduce la dimensione del corpo.
+template <typename String>
+inline bool CompressContent(ContentEncoding encoding, std::string_view input, String& output,
+    CompressionLevel level) {
+    (void)level; // Inutilizzato senza zlib né zstd
+    bool ok = false;
+    switch (encoding) {
+#ifdef OTEL_HAVE_ZLIB
+    case ContentEncoding::Gzip:
+        ok = otel::GzipCompress(input, output,
+            level == CompressionLevel::Fast ? Z_BEST_SPEED :
+            level == CompressionLevel::Best ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION);
+        break;
+#endif
+#ifdef OTEL_HAVE_ZSTD
+    case ContentEncoding::Zstd: {
+        output.resize(ZSTD_compressBound(input.size()));
+        size_t written = ZSTD_compress(&output[0], output.size(), input.data(), input.size(),
+            level == CompressionLevel::Fast ? 1 : level == CompressionLevel::Best ? 19 : 3);
+        ok = !ZSTD_isError(written);
+        output.resize(ok ? written : 0);
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    return ok && output.size() < input.size();
+}
+
+// Serve `body` senza copiarlo in res.body: httplib lo legge con un content provider durante
+// l'invio, dopo il ritorno dell'handler, quindi la memoria deve restare valida fino ad allora
+// (arena della richiesta, pagine statiche). `owner` (es. uno shared_ptr) la tiene in vita.
+inline void SetBorrowedContent(httplib::Response& res, std::string_view body, const char* content_type) {
+    res.set_content_provider(body.size(), content_type,
+        [body](size_t offset, size_t length, httplib::DataSink& sink) {
+            return sink.write(body.data() + offset, length);
+        });
+}
+
+template <typename Owner>
+inline void SetBorrowedContent(httplib::Response& res, std::string_view body, const char* content_type, Owner owner) {
+    res.set_content_provider(body.size(), content_type,
+        [body, owner = std::move(owner)](size_t offset, size_t length, httplib::DataSink& sink) {
+            return sink.write(body.data() + offset, length);
+        });
+}
+
+// Imposta un corpo generato per la richiesta corrente, compresso al volo (livello Fast)
+// se il client lo accetta e il corpo supera `min_size`: sotto qualche centinaio di byte
+// l'header gzip e il costo della compressione non ripagano. Il corpo (di norma già
+// nell'arena) e la versione compressa, allocata in `arena`, sono serviti senza copie:
+// entrambi devono restare validi fino all'invio della risposta.
+inline void SetNegotiatedContent(const httplib::Request& req, httplib::Response& res,
+    std::string_view body, const char* content_type, size_t min_size, std::pmr::memory_resource* arena) {
+    res.set_header("Vary", "Accept-Encoding");
+    if (body.size() >= min_size) {
+        ContentEncoding encoding = NegotiateContentEncoding(req);
+        if (encoding != ContentEncoding::Identity) {
+            auto& compressed = RequestArena::NewString(arena);
+            if (CompressContent(encoding, body, compressed, CompressionLevel::Fast)) {
+                res.set_header("Content-Encoding", ContentEncodingName(encoding));
+                SetBorrowedContent(res, compressed, content_type);
+                return;
+            }
+        }
+    }
+    SetBorrowedContent(res, body, content_type);
+}
+
+// Pagina completamente statica: il corpo e le sue versioni compresse (gzip e zstd, se
+// disponibili) vengono preparati una sola volta all'avvio, ognuno con il proprio ETag.
+// Le richieste con If-None-Match corrispondente ricevono 304 senza corpo.
+class StaticPage {
+private:
+    struct Variant {
+        std::string body; // Vuoto se la codifica non è disponibile o non conviene
+        std::string etag;
+    };
+
+    std::string content_type;
+    Variant variants[kContentEncodings];
+    bool compressed = false; // Almeno una variante compressa: la risposta dipende da Accept-Encoding
+
+    // ETag forte: hash FNV-1a a 64 bit del contenuto
+    static std::string MakeETag(std::string_view data, const char* suffix) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        uint8_t bytes[8];
+        std::memcpy(bytes, &hash, sizeof(bytes));
+        std::string out = "\"";
+        otel::AppendHex(out, bytes, sizeof(bytes));
+        out += suffix;
+        out += '"';
+        return out;
+    }
+
+    static bool Matches(const httplib::Request& req, const std::string& tag) {
+        auto it = req.headers.find("If-None-Match");
+        if (it == req.headers.end()) return false;
+        return it->second == "*" || it->second.find(tag) != std::string::npos;
+    }
+
+public:
+    StaticPage(std::string page, std::string type) : content_type(std::move(type)) {
+        Variant& identity = variants[static_cast<size_t>(ContentEncoding::Identity)];
+        identity.etag = MakeETag(page, "");
+        for (ContentEncoding encoding : { ContentEncoding::Gzip, ContentEncoding::Zstd }) {
+            Variant& variant = variants[static_cast<size_t>(encoding)];
+            if (CompressContent(encoding, page, variant.body, CompressionLevel::Best)) {
+                variant.etag = MakeETag(page, (std::string("-") + ContentEncodingName(encoding)).c_str());
+                compressed = true;
+            }
+            else {
+                variant.body.clear();
+            }
+        }
+        identity.body = std::move(page);
+    }
+
+    // Imposta la risposta: 304 se il client ha già la versione corrente, altrimenti
+    // il corpo pre-compresso o quello originale. no-cache forza la rivalidazione,
+    // così ogni visita raggiunge comunque il server (e viene conteggiata).
+    void Serve(const httplib::Request& req, httplib::Response& res) const {
+        ContentEncoding encoding = compressed ? NegotiateContentEncoding(req) : ContentEncoding::Identity;
+        if (variants[static_cast<size_t>(encoding)].body.empty()) encoding = ContentEncoding::Identity;
+        const Variant& variant = variants[static_cast<size_t>(encoding)];
+        res.set_header("ETag", variant.etag);
+        res.set_header("Cache-Control", "no-cache");
+        if (compressed) res.set_header("Vary", "Accept-Encoding");
+        if (Matches(req, variant.etag)) {
+            res.status = 304;
+            return;
+        }
+        if (encoding != ContentEncoding::Identity) {
+            res.set_header("Content-Encoding", ContentEncodingName(encoding));
+        }
+        // La pagina vive quanto il server: il corpo viene inviato senza copiarlo
+        SetBorrowedContent(res, variant.body, content_type.c_str());
+    }
+};
+
+// Cache di un corpo generato (l'uscita di /metrics) con le sue versioni compresse.
+// Uno snapshot resta valido per `ttl`: le richieste che arrivano nel frattempo (più
+// istanze di Prometheus che fanno scrape dello stesso target) condividono lo stesso
+// render e la stessa compressione. Alla scadenza un solo thread rigenera il corpo,
+// gli altri attendono sul mutex e servono lo snapshot appena prodotto. Le versioni
+// compresse sono calcolate alla prima richiesta che le negozia. ttl = 0 disabilita la cache.
+class CompressedResponseCache {
+private:
+    struct Snapshot {
+        std::chrono::steady_clock::time_point created;
+        std::string body;
+        std::string encoded[kContentEncodings]; // Vuota: compressione non disponibile o non conveniente
+        std::once_flag encode_once[kContentEncodings];
+    };
+
+    std::function<std::string()> render;
+    std::string content_type;
+    std::chrono::milliseconds ttl;
+    std::mutex render_mutex;                  // Serializza la rigenerazione dello snapshot
+    mutable std::mutex snapshot_mutex;        // Protegge solo lo scambio del puntatore
+    std::shared_ptr<Snapshot> current;
+
+    std::shared_ptr<Snapshot> Load() const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        return current;
+    }
+
+    bool Fresh(const std::shared_ptr<Snapshot>& snapshot, std::chrono::steady_clock::time_point now) const {
+        return snapshot && now - snapshot->created < ttl;
+    }
+
+public:
+    CompressedResponseCache(std::function<std::string()> r, std::string type, std::chrono::milliseconds t)
+        : render(std::move(r)), content_type(std::move(type)), ttl(t) {}
+
+    // Imposta la risposta dallo snapshot corrente, rigenerandolo se scaduto.
+    // Restituisce true se il corpo è stato servito dalla cache senza un nuovo render.
+    bool Serve(const httplib::Request& req, httplib::Response& res) {
+        auto now = std::chrono::steady_clock::now();
+        std::shared_ptr<Snapshot> snapshot = Load();
+        bool hit = Fresh(snapshot, now);
+        if (!hit) {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            snapshot = Load();
+            hit = Fresh(snapshot, now); // Rigenerato da un altro thread mentre si attendeva
+            if (!hit) {
+                auto fresh = std::make_shared<Snapshot>();
+                fresh->body = render();
+                fresh->created = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> swap(snapshot_mutex);
+                current = fresh;
+                snapshot = std::move(fresh);
+            }
+        }
+
+        res.set_header("Vary", "Accept-Encoding");
+        ContentEncoding encoding = NegotiateContentEncoding(req);
+        if (encoding != ContentEncoding::Identity) {
+            const size_t index = static_cast<size_t>(encoding);
+            Snapshot& s = *snapshot;
+            std::call_once(s.encode_once[index], [&] {
+                if (!CompressContent(encoding, s.body, s.encoded[index], CompressionLevel::Default)) {
+                    s.encoded[index].clear();
+                }
+            });
+            if (!s.encoded[index].empty()) {
+                res.set_header("Content-Encoding", ContentEncodingName(encoding));
+                SetBorrowedContent(res, s.encoded[index], content_type.c_str(), std::move(snapshot));
+                return hit;
+            }
+        }
+        // Lo snapshot resta vivo (anche se sostituito nel frattempo) finché il corpo non è inviato
+        std::string_view body = snapshot->body;
+        SetBorrowedContent(res, body, content_type.c_str(), std::move(snapshot));
+        return hit;
+    }
+};
+
+// Formato di /metrics richiesto dallo scraper con l'header Accept. Prometheus elenca i
+// formati che sa leggere con la rispettiva qualità, ad esempio:
+//   application/openmetrics-text;version=1.0.0,text/plain;version=0.0.4;q=0.5,*/*;q=0.1
+// Vince il formato con q più alta (a parità il primo elencato); il protobuf è accettato
+// solo con proto=io.prometheus.client.MetricFamily ed encoding=delimited.
+// Senza header, o con tipi sconosciuti, si risponde con il testo 0.0.4.
+inline otel::ExpositionFormat NegotiateExpositionFormat(const httplib::Request& req) {
+    auto it = req.headers.find("Accept");
+    if (it == req.headers.end()) return otel::ExpositionFormat::PrometheusText;
+
+    otel::ExpositionFormat best = otel::ExpositionFormat::PrometheusText;
+    double best_quality = 0;
+    std::string_view value = it->second;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string item(value.substr(0, comma));
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+        std::transform(item.begin(), item.end(), item.begin(),
+            [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        item.erase(std::remove_if(item.begin(), item.end(),
+            [](unsigned char c) { return std::isspace(c) != 0; }), item.end());
+
+        std::string_view media(item);
+        media = media.substr(0, media.find(';'));
+        double q = 1.0;
+        size_t pos = item.find(";q=");
+        if (pos != std::string::npos) q = std::strtod(item.c_str() + pos + 3, nullptr);
+
+        otel::ExpositionFormat format;
+        if (media == "application/vnd.google.protobuf") {
+            if (item.find("proto=io.prometheus.client.metricfamily") == std::string::npos ||
+                item.find("encoding=delimited") == std::string::npos) {
+                continue;
+            }
+            format = otel::ExpositionFormat::PrometheusProtobuf;
+        }
+        else if (media == "application/openmetrics-text") {
+            format = otel::ExpositionFormat::OpenMetricsText;
+        }
+        else if (media == "text/plain" || media == "text/*" || media == "*/*") {
+            format = otel::ExpositionFormat::PrometheusText;
+        }
+        else {
+            continue;
+        }
+        if (q > best_quality) {
+            best = format;
+            best_quality = q;
+        }
+    }
+    return best;
+}
+
+// --- Configurazione del server HTTP ---
+
+// Parametri del server, letti dall'ambiente (WEBSERVER_*). I default sono pensati
+// per un nodo multi-core: un worker per core e connessioni keep-alive riusate a lungo.
+struct ServerOptions {
+    std::string host = "0.0.0.0";
+    int port = 8080;
+    size_t worker_threads = 0;         // 0: un worker per core (almeno 8, come httplib)
+    size_t listeners = 1;              // >1: più socket sulla stessa porta con SO_REUSEPORT
+    size_t max_queued_connections = 0; // Connessioni in attesa di un worker (0: illimitate)
+    size_t keep_alive_max_count = 100; // Richieste massime per connessione keep-alive
+    time_t keep_alive_timeout = 5;     // Secondi di inattività prima di chiudere la connessione
+    time_t read_timeout = 5;
+    time_t write_timeout = 5;
+    bool work_stealing = true;         // false: httplib::ThreadPool (coda unica condivisa)
+    std::chrono::milliseconds metrics_cache_ttl{ 1000 }; // Validità dell'uscita di /metrics in cache (0: nessuna cache)
+    size_t compression_min_size = 1024; // Corpi dinamici più piccoli non vengono compressi
+    bool reuse_port = false;           // SO_REUSEPORT anche con un solo listener (riavvio con sovrapposizione)
+    std::chrono::milliseconds shutdown_delay{ 0 };      // Attesa tra SIGTERM e chiusura dei listener
+    std::chrono::milliseconds shutdown_timeout{ 10000 }; // Durata massima dell'arresto
+    std::string runtime_config;        // File delle impostazioni ricaricate con SIGHUP
+    std::string loglevel_token;        // Richiesto in X-Debug-Token da PUT /loglevel (vuoto: PUT rifiutato)
+
+    // Variabili: WEBSERVER_HOST, WEBSERVER_PORT, WEBSERVER_THREADS, WEBSERVER_LISTENERS,
+    // WEBSERVER_MAX_QUEUED, WEBSERVER_KEEPALIVE_MAX, WEBSERVER_KEEPALIVE_TIMEOUT,
+    // WEBSERVER_READ_TIMEOUT, WEBSERVER_WRITE_TIMEOUT, WEBSERVER_TASK_QUEUE (stealing|pool),
+    // WEBSERVER_METRICS_CACHE_MS, WEBSERVER_COMPRESSION_MIN_SIZE, WEBSERVER_REUSE_PORT (0|1),
+    // WEBSERVER_SHUTDOWN_DELAY_MS, WEBSERVER_SHUTDOWN_TIMEOUT_MS, WEBSERVER_RUNTIME_CONFIG,
+    // WEBSERVER_LOGLEVEL_TOKEN.
+    static ServerOptions FromEnvironment() {
+        ServerOptions options;
+        if (const char* v = config::Get("WEBSERVER_HOST")) options.host = v;
+        if (const char* v = config::Get("WEBSERVER_PORT")) options.port = std::atoi(v);
+        if (const char* v = config::Get("WEBSERVER_THREADS")) options.worker_threads = std::strtoul(v, nullptr, 10);
+        if (const char* v = config::Get("WEBSERVER_LISTENERS")) options.listeners = std::max<size_t>(1, std::strtoul(v, nullptr, 10));
+        if (const char* v = config::Get("WEBSERVER_MAX_QUEUED")) options.max_queued_connections = std::strtoul(v, nullptr, 10);
+        if (const char* v = config::Get("WEBSERVER_KEEPALIVE_MAX")) options.keep_alive_max_count = std::strtoul(v, nullptr, 10);
+        if (const char* v = config::Get("WEBSERVER_KEEPALIVE_TIMEOUT")) options.keep_alive_timeout = std::atol(v);
+        if (const char* v = config::Get("WEBSERVER_READ_TIMEOUT")) options.read_timeout = std::atol(v);
+        if (const char* v = config::Get("WEBSERVER_WRITE_TIMEOUT")) options.write_timeout = std::atol(v);
+        if (const char* v = config::Get("WEBSERVER_TASK_QUEUE")) options.work_stealing = std::string(v) != "pool";
+        if (const char* v = config::Get("WEBSERVER_METRICS_CACHE_MS")) options.metrics_cache_ttl = std::chrono::milliseconds(std::atol(v));
+        if (const char* v = config::Get("WEBSERVER_COMPRESSION_MIN_SIZE")) options.compression_min_size = std::strtoul(v, nullptr, 10);
+        if (const char* v = config::Get("WEBSERVER_REUSE_PORT")) options.reuse_port = std::atoi(v) != 0;
+        if (const char* v = config::Get("WEBSERVER_SHUTDOWN_DELAY_MS")) options.shutdown_delay = std::chrono::milliseconds(std::atol(v));
+        if (const char* v = config::Get("WEBSERVER_SHUTDOWN_TIMEOUT_MS")) options.shutdown_timeout = std::chrono::milliseconds(std::atol(v));
+        if (const char* v = config::Get("WEBSERVER_RUNTIME_CONFIG")) options.runtime_config = v;
+        if (const char* v = config::Get("WEBSERVER_LOGLEVEL_TOKEN")) options.loglevel_token = v;
+        return options;
+    }
+
+    size_t EffectiveWorkerThreads() const {
+        if (worker_threads > 0) return worker_threads;
+        size_t cores = std::thread::hardware_concurrency();
+        return std::max<size_t>(8, cores > 1 ? cores - 1 : 1);
+    }
+};
+
+// Coda di task per httplib::Server con work stealing. Ogni worker ha la propria deque:
+// i nuovi task (una connessione accettata) vengono distribuiti round-robin, il worker
+// estrae dalla testa della propria deque e, quando è vuota, ruba dalla coda delle altre.
+// Rispetto a httplib::ThreadPool non c'è un unico mutex conteso da tutti i worker.
+class WorkStealingTaskQueue : public httplib::TaskQueue {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    size_t max_queued;
+    std::atomic<size_t> next_worker{ 0 };
+    std::atomic<size_t> pending{ 0 }; // Task accodati e non ancora estratti (incrementato prima del push)
+    std::atomic<bool> stopping{ false };
+
+    // Solo per addormentare i worker senza task (nessun task da rubare)
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+
+    bool TryPop(size_t self, std::function<void()>& task) {
+        for (size_t i = 0; i < workers.size(); ++i) {
+            Worker& worker = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            else {
+                task = std::move(worker.tasks.back()); // Furto dalla coda opposta
+                worker.tasks.pop_back();
+            }
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(size_t self) {
+        std::function<void()> task;
+        for (;;) {
+            if (TryPop(self, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleep_cv.wait(lock, [this] {
+                return pending.load(std::memory_order_acquire) > 0 || stopping.load(std::memory_order_acquire);
+            });
+            if (stopping.load(std::memory_order_acquire) && pending.load(std::memory_order_acquire) == 0) return;
+        }
+    }
+
+public:
+    explicit WorkStealingTaskQueue(size_t thread_count, size_t max_queued_tasks = 0)
+        : max_queued(max_queued_tasks) {
+        thread_count = std::max<size_t>(1, thread_count);
+        for (size_t i = 0; i < thread_count; ++i) workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < thread_count; ++i) threads.emplace_back(&WorkStealingTaskQueue::WorkerLoop, this, i);
+    }
+
+    ~WorkStealingTaskQueue() override {
+        shutdown();
+    }
+
+    // Restituisce false (httplib chiude la connessione) se la coda ha raggiunto max_queued.
+    // Il posto si riserva in `pending` prima del push: un worker che estrae il task subito
+    // dopo il push non può decrementare il contatore prima dell'incremento (underflow).
+    bool enqueue(std::function<void()> fn) override {
+        if (stopping.load(std::memory_order_acquire)) return false;
+        size_t queued = pending.fetch_add(1, std::memory_order_release);
+        if (max_queued > 0 && queued >= max_queued) {
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        Worker& worker = *workers[next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(fn));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        sleep_cv.notify_one();
+        return true;
+    }
+
+    // Completa i task già accodati e termina i worker. Idempotente.
+    void shutdown() override {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            if (stopping.exchange(true, std::memory_order_acq_rel)) return;
+        }
+        sleep_cv.notify_all();
+        for (auto& thread : threads) {
+            if (thread.joinable()) thread.join();
+        }
+    }
+};
+
+// Applica le opzioni a un httplib::Server: pool di worker, keep-alive, timeout
+// e, con più listener, SO_REUSEPORT (il kernel distribuisce le connessioni tra i socket,
+// quindi ogni listener ha la propria coda di accept e il proprio pool). Con reuse_port
+// SO_REUSEPORT si usa anche con un solo listener, per sovrapporre vecchio e nuovo processo.
+inline void ConfigureServer(httplib::Server& server, const ServerOptions& options) {
+    size_t threads = std::max<size_t>(1, options.EffectiveWorkerThreads() / options.listeners);
+    size_t max_queued = options.max_queued_connections / options.listeners;
+    bool work_stealing = options.work_stealing;
+    server.new_task_queue = [threads, max_queued, work_stealing]() -> httplib::TaskQueue* {
+        if (work_stealing) return new WorkStealingTaskQueue(threads, max_queued);
+        return new httplib::ThreadPool(threads, max_queued);
+    };
+    server.set_keep_alive_max_count(options.keep_alive_max_count);
+    server.set_keep_alive_timeout(options.keep_alive_timeout);
+    server.set_read_timeout(options.read_timeout);
+    server.set_write_timeout(options.write_timeout);
+    server.set_tcp_nodelay(true);
+
+    bool reuse_port = options.listeners > 1 || options.reuse_port;
+    server.set_socket_options([reuse_port](httplib::socket_t sock) {
+        int yes = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&yes), sizeof(yes));
+#ifdef SO_REUSEPORT
+        if (reuse_port) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char*>(&yes), sizeof(yes));
+#endif
+    });
+}
+
+// --- Endpoint di profilazione (/debug/pprof) ---
+// Opt-in con WEBSERVER_PPROF=1: all'avvio si attivano i profili continui di heap e contesa,
+// il profilo CPU viene raccolto a richiesta. Le risposte sono profili pprof da aprire con
+//   go tool pprof -http=: http://nodo:8080/debug/pprof/profile?seconds=30
+// Non va esposto pubblicamente: con WEBSERVER_PPROF_TOKEN serve l'header X-Debug-Token.
+struct ProfilerOptions {
+    bool enabled = false;
+    std::string token;                   // Richiesto in X-Debug-Token; vuoto: endpoint disattivati
+    size_t heap_interval = 512 * 1024;   // Byte allocati tra due campioni dell'heap (0: profilo heap spento)
+    int cpu_hz = 99;                     // Campioni per secondo di CPU
+    std::chrono::seconds max_duration{ 120 }; // Durata massima di un profilo CPU
+
+    // Variabili: WEBSERVER_PPROF (0|1), WEBSERVER_PPROF_TOKEN, WEBSERVER_PPROF_HEAP_INTERVAL,
+    // WEBSERVER_PPROF_CPU_HZ, WEBSERVER_PPROF_MAX_SECONDS.
+    static ProfilerOptions FromEnvironment() {
+        ProfilerOptions options;
+        if (const char* v = config::Get("WEBSERVER_PPROF")) options.enabled = std::atoi(v) != 0;
+        if (const char* v = config::Get("WEBSERVER_PPROF_TOKEN")) options.token = v;
+        if (const char* v = config::Get("WEBSERVER_PPROF_HEAP_INTERVAL")) options.heap_interval = std::strtoul(v, nullptr, 10);
+        if (const char* v = config::Get("WEBSERVER_PPROF_CPU_HZ")) options.cpu_hz = std::max(1, std::atoi(v));
+        if (const char* v = config::Get("WEBSERVER_PPROF_MAX_SECONDS")) {
+            options.max_duration = std::chrono::seconds(std::max(1L, std::atol(v)));
+        }
+        return options;
+    }
+
+    // Stack, simboli e indirizzi di /proc/self/maps (che vanificano l'ASLR) sulla porta pubblica:
+    // senza token gli endpoint e i profili continui non vengono attivati.
+    bool Enabled() const { return enabled && !token.empty(); }
+};
+
+class ProfilerEndpoints {
+private:
+    ProfilerOptions options;
+
+    bool Authorized(const httplib::Request& req, httplib::Response& res) const {
+        if (req.get_header_value("X-Debug-Token") == options.token) return true;
+        res.status = 403;
+        return false;
+    }
+
+    static void SendProfile(httplib::Response& res, bool ok, std::string& profile, const std::string& error, const char* name) {
+        if (!ok) {
+            res.status = otel::profiling::kAvailable ? 503 : 501;
+            res.set_content(error + "\n", "text/plain");
+            return;
+        }
+        res.set_header("Content-Disposition", std::string("attachment; filename=\"") + name + ".pb.gz\"");
+        res.set_content(std::move(profile), "application/octet-stream");
+    }
+
+public:
+    explicit ProfilerEndpoints(const ProfilerOptions& opts) : options(opts) {}
+
+    // Attiva i profili continui; false (con l'errore) se non disponibili su questa build/piattaforma.
+    bool Start(std::string& error) {
+        return otel::profiling::StartContinuous(options.heap_interval, error);
+    }
+
+    // GET /debug/pprof/: elenco dei profili.
+    void HandleIndex(const httplib::Request& req, httplib::Response& res) const {
+        if (!Authorized(req, res)) return;
+        res.set_content(
+            "/debug/pprof/profile?seconds=N  CPU (campionamento SIGPROF, default 30s)\n"
+            "/debug/pprof/heap               allocazioni campionate per sito (alloc_objects, alloc_space)\n"
+            "/debug/pprof/mutex              acquisizioni contese dei lock (contentions, delay)\n",
+            "text/plain");
+    }
+
+    // GET /debug/pprof/profile?seconds=N: blocca il worker per la durata del campionamento.
+    void HandleCpu(const httplib::Request& req, httplib::Response& res) const {
+        if (!Authorized(req, res)) return;
+        long seconds = req.has_param("seconds") ? std::atol(req.get_param_value("seconds").c_str()) : 30;
+        seconds = std::clamp<long>(seconds, 1, static_cast<long>(options.max_duration.count()));
+        std::string profile, error;
+        bool ok = otel::profiling::CpuProfiler::Run(std::chrono::seconds(seconds), options.cpu_hz, profile, error);
+        SendProfile(res, ok, profile, error, "cpu");
+    }
+
+    void HandleHeap(const httplib::Request& req, httplib::Response& res) const {
+        if (!Authorized(req, res)) return;
+        std::string profile, error;
+        bool ok = otel::profiling::HeapProfile(profile, error);
+        SendProfile(res, ok, profile, error, "heap");
+    }
+
+    void HandleMutex(const httplib::Request& req, httplib::Response& res) const {
+        if (!Authorized(req, res)) return;
+        std::string profile, error;
+        bool ok = otel::profiling::ContentionProfile(profile, error);
+        SendProfile(res, ok, profile, error, "mutex");
+    }
+};
+
+// --- Richieste lente per route (/debug/slow) ---
+// Ogni route strumentata conserva le richieste più lente della finestra recente (di default le
+// 16 più lente dell'ultimo minuto) con trace ID, durata e attributi principali dello span: da un
+// picco di p99 in Grafana (o dall'esemplare di un bucket) si arriva a richieste concrete senza
+// conservare tutti gli span. Il percorso della richiesta non prende lock: con il buffer pieno
+// di richieste più lente e non scadute costa due load relaxed; altrimenti la richiesta prende il
+// posto della più veloce (o di una scaduta) con un seqlock, come gli esemplari degli istogrammi.
+struct SlowRequestOptions {
+    size_t capacity = 16;                        // Richieste conservate per route (0: disattivato)
+    std::chrono::seconds window{ 60 };           // Età oltre la quale una richiesta cede il posto
+    std::chrono::nanoseconds min_duration{ 0 };  // Durata minima per essere considerata
+    std::string token;                           // Richiesto in X-Debug-Token; vuoto: disattivato
+
+    // La risposta contiene indirizzi e percorsi dei client ed è servita sulla porta pubblica:
+    // senza token il buffer e l'endpoint non vengono attivati.
+    bool Enabled() const { return capacity > 0 && !token.empty(); }
+
+    // Variabili: WEBSERVER_SLOW_REQUESTS, WEBSERVER_SLOW_WINDOW_S, WEBSERVER_SLOW_MIN_MS,
+    // WEBSERVER_SLOW_TOKEN.
+    static SlowRequestOptions FromEnvironment() {
+        SlowRequestOptions options;
+        if (const char* v = config::Get("WEBSERVER_SLOW_REQUESTS")) {
+            options.capacity = std::min<size_t>(std::strtoul(v, nullptr, 10), 1024);
+        }
+        if (const char* v = config::Get("WEBSERVER_SLOW_WINDOW_S")) {
+            options.window = std::chrono::seconds(std::max(1L, std::atol(v)));
+        }
+        if (const char* v = config::Get("WEBSERVER_SLOW_MIN_MS")) {
+            options.min_duration = std::chrono::microseconds(static_cast<int64_t>(std::max(0.0, std::atof(v)) * 1000));
+        }
+        if (const char* v = config::Get("WEBSERVER_SLOW_TOKEN")) options.token = v;
+        return options;
+    }
+};
+
+// Richiesta registrata: campi a dimensione fissa, copiati a parole di 64 bit nello slot.
+struct SlowRequest {
+    otel::TraceId trace_id{};  // Zero se la richiesta non aveva una traccia (non campionata, senza traceparent)
+    otel::SpanId span_id{};
+    int64_t duration_ns = 0;
+    int64_t finished_ns = 0;   // Fine della richiesta (high_resolution_clock, come RequestContext::finished)
+    uint16_t status = 0;
+    uint16_t remote_port = 0;
+    bool sampled = false;      // Span campionato: la traccia arriva al collector
+    char method[8] = {};
+    char remote_addr[46] = {}; // INET6_ADDRSTRLEN
+    char path[64] = {};        // Troncato
+
+    static void CopyTruncated(char* out, size_t size, const std::string& text) {
+        size_t length = std::min(text.size(), size - 1);
+        std::memcpy(out, text.data(), length);
+        out[length] = '\0';
+    }
+};
+static_assert(std::is_trivially_copyable_v<SlowRequest>, "SlowRequest viene copiato a parole");
+
+class SlowRequestLog {
+private:
+    static constexpr size_t kWords = (sizeof(SlowRequest) + 7) / 8;
+
+    struct Slot {
+        std::atomic<uint32_t> sequence{ 0 };    // Dispari durante la scrittura, 0: mai scritto
+        std::atomic<int64_t> duration_ns{ 0 };  // Copie leggibili senza seqlock per scegliere
+        std::atomic<int64_t> finished_ns{ 0 };  // lo slot da sostituire
+        std::atomic<uint64_t> words[kWords];
+    };
+
+    const char* route;
+    const int64_t window_ns;
+    const int64_t min_duration_ns;
+    const size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    // Soglia d'ingresso: con tutti gli slot occupati, fino a floor_expiry_ns entra solo una
+    // richiesta più lenta di floor_ns (la più veloce conservata). Aggiornata senza
+    // sincronizzazione da chi scrive: una soglia momentaneamente vecchia sposta solo di quale
+    // richiesta viene conservata.
+    alignas(otel::kCacheLineSize) std::atomic<int64_t> floor_ns{ 0 };
+    std::atomic<int64_t> floor_expiry_ns{ 0 };
+
+    bool Expired(int64_t finished_ns, int64_t now_ns) const {
+        return finished_ns <= now_ns - window_ns;
+    }
+
+    void RefreshFloor(int64_t now_ns) {
+        int64_t floor = std::numeric_limits<int64_t>::max();
+        int64_t expiry = std::numeric_limits<int64_t>::max();
+        for (size_t i = 0; i < capacity; ++i) {
+            const int64_t finished = slots[i].finished_ns.load(std::memory_order_relaxed);
+            if (slots[i].sequence.load(std::memory_order_relaxed) == 0 || Expired(finished, now_ns)) {
+                floor = 0; // Posto libero: entra qualunque richiesta
+                expiry = 0;
+                break;
+            }
+            floor = std::min(floor, slots[i].duration_ns.load(std::memory_order_relaxed));
+            expiry = std::min(expiry, finished + window_ns);
+        }
+        floor_ns.store(floor, std::memory_order_relaxed);
+        floor_expiry_ns.store(expiry, std::memory_order_relaxed);
+    }
+
+public:
+    SlowRequestLog(const char* r, const SlowRequestOptions& options)
+        : route(r),
+        window_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(options.window).count()),
+        min_duration_ns(options.min_duration.count()),
+        capacity(options.capacity),
+        slots(new Slot[options.capacity]()) {} // () azzera gli atomici
+
+    const char* Route() const { return route; }
+
+    // Filtro del percorso veloce, prima di costruire la SlowRequest.
+    bool ShouldOffer(int64_t duration_ns, int64_t now_ns) const {
+        return duration_ns >= min_duration_ns &&
+            (duration_ns > floor_ns.load(std::memory_order_relaxed) ||
+                now_ns >= floor_expiry_ns.load(std::memory_order_relaxed));
+    }
+
+    // Conserva la richiesta al posto di uno slot libero o scaduto, altrimenti della più veloce
+    // se questa è più lenta. Se un altro thread sta scrivendo lo stesso slot si rinuncia.
+    void Offer(const SlowRequest& request) {
+        const int64_t now_ns = request.finished_ns;
+        size_t victim = capacity;
+        int64_t victim_duration = std::numeric_limits<int64_t>::max();
+        for (size_t i = 0; i < capacity; ++i) {
+            if (slots[i].sequence.load(std::memory_order_relaxed) == 0 ||
+                Expired(slots[i].finished_ns.load(std::memory_order_relaxed), now_ns)) {
+                victim = i;
+                victim_duration = -1;
+                break;
+            }
+            const int64_t duration = slots[i].duration_ns.load(std::memory_order_relaxed);
+            if (duration < victim_duration) {
+                victim = i;
+                victim_duration = duration;
+            }
+        }
+        if (victim == capacity || request.duration_ns <= victim_duration) {
+            RefreshFloor(now_ns);
+            return;
+        }
+        Slot& slot = slots[victim];
+        uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) != 0 ||
+            !slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire)) {
+            return;
+        }
+        uint64_t words[kWords] = {};
+        std::memcpy(words, &request, sizeof(request));
+        for (size_t w = 0; w < kWords; ++w) slot.words[w].store(words[w], std::memory_order_relaxed);
+        slot.duration_ns.store(request.duration_ns, std::memory_order_relaxed);
+        slot.finished_ns.store(request.finished_ns, std::memory_order_relaxed);
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+        RefreshFloor(now_ns);
+    }
+
+    // Richieste non scadute, dalla più lenta. Uno slot in scrittura viene saltato.
+    std::vector<SlowRequest> Snapshot(int64_t now_ns) const {
+        std::vector<SlowRequest> out;
+        for (size_t i = 0; i < capacity; ++i) {
+            const Slot& slot = slots[i];
+            for (int attempt = 0; attempt < 4; ++attempt) {
+                uint32_t before = slot.sequence.load(std::memory_order_acquire);
+                if (before == 0) break;
+                if ((before & 1) != 0) continue;
+                uint64_t words[kWords];
+                for (size_t w = 0; w < kWords; ++w) words[w] = slot.words[w].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) != before) continue;
+                SlowRequest request;
+                std::memcpy(&request, words, sizeof(request));
+                if (!Expired(request.finished_ns, now_ns)) out.push_back(request);
+                break;
+            }
+        }
+        std::sort(out.begin(), out.end(), [](const SlowRequest& a, const SlowRequest& b) {
+            return a.duration_ns > b.duration_ns;
+        });
+        return out;
+    }
+};
+
+// Log delle route strumentate (creati all'avvio, prima di accettare richieste) e /debug/slow.
+class SlowRequestTracker {
+private:
+    SlowRequestOptions options;
+    std::vector<std::unique_ptr<SlowRequestLog>> logs;
 
-namespace otel {
+    static void AppendTime(std::string& out, std::chrono::system_clock::time_point time) {
+        const int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+        std::time_t seconds = static_cast<std::time_t>(ms / 1000);
+        std::tm tm{};
+        gmtime_r(&seconds, &tm);
+        char buffer[40];
+        size_t size = std::strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &tm);
+        std::snprintf(buffer + size, sizeof(buffer) - size, ".%03dZ", static_cast<int>(ms % 1000));
+        out += '"';
+        out += buffer;
+        out += '"';
+    }
 
-    // Rappresenta il contesto di una traccia e di uno span.
-    // Identifica in modo univoco uno span e la traccia a cui appartiene.
-    class SpanContext {
-    public:
-        std::string trace_id; // Identificatore unico della traccia
-        std::string span_id;  // Identificatore unico dello span all'interno della traccia
+    static void AppendRequest(std::string& out, const SlowRequest& request, int64_t now_ns) {
+        char number[48];
+        const int64_t age_ns = std::max<int64_t>(0, now_ns - request.finished_ns);
+        std::snprintf(number, sizeof(number), "%.3f", static_cast<double>(request.duration_ns) / 1e6);
+        out += "{\"duration_ms\":";
+        out += number;
+        out += ",\"trace_id\":";
+        if (otel::IsZeroId(request.trace_id)) {
+            out += "null,\"span_id\":null";
+        }
+        else {
+            out += '"';
+            otel::AppendHex(out, request.trace_id.data(), request.trace_id.size());
+            out += "\",\"span_id\":\"";
+            otel::AppendHex(out, request.span_id.data(), request.span_id.size());
+            out += '"';
+        }
+        out += ",\"sampled\":";
+        out += request.sampled ? "true" : "false";
+        out += ",\"time\":";
+        AppendTime(out, std::chrono::system_clock::now() - std::chrono::nanoseconds(age_ns));
+        out += ",\"method\":";
+        logging::AppendJsonString(out, request.method);
+        out += ",\"path\":";
+        logging::AppendJsonString(out, request.path);
+        out += ",\"status\":";
+        out += std::to_string(request.status);
+        out += ",\"remote_addr\":";
+        logging::AppendJsonString(out, request.remote_addr);
+        out += ",\"remote_port\":";
+        out += std::to_string(request.remote_port);
+        out += '}';
+    }
+
+public:
+    explicit SlowRequestTracker(const SlowRequestOptions& opts) : options(opts) {}
+
+    bool Enabled() const { return options.Enabled(); }
 
-        SpanContext() {
-            // Generazione IDs casuali (semplice, non adatta a produzione)
-            // Gli IDs OpenTelemetry sono tipicamente generati in modo distribuito e sicuro.
-            char trace_id_buffer[33]; // 32 caratteri esadecimali + null terminator
-            char span_id_buffer[17];  // 16 caratteri esadecimali + null terminator
-            // %032x formatta un intero come esadecimale con leading zeros fino a 32 caratteri
-            std::snprintf(trace_id_buffer, sizeof(trace_id_buffer), "%032x", std::rand());
-            std::snprintf(span_id_buffer, sizeof(span_id_buffer), "%016x", std::rand());
-            trace_id = trace_id_buffer;
-            span_id = span_id_buffer;
+    // Log della route; nullptr se disattivato (il middleware allora non fa nulla).
+    SlowRequestLog* ForRoute(const char* route) {
+        if (!Enabled()) return nullptr;
+        logs.push_back(std::make_unique<SlowRequestLog>(route, options));
+        return logs.back().get();
+    }
+
+    // GET /debug/slow[?route=/stats]: richieste più lente per route, in JSON.
+    void Handle(const httplib::Request& req, httplib::Response& res) const {
+        if (req.get_header_value("X-Debug-Token") != options.token) {
+            res.status = 403;
+            return;
         }
-    };
+        const std::string filter = req.has_param("route") ? req.get_param_value("route") : std::string();
+        const int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+        std::string out = "{\"window_seconds\":" + std::to_string(options.window.count()) +
+            ",\"capacity\":" + std::to_string(options.capacity) + ",\"routes\":[";
+        bool first_route = true;
+        for (const auto& log : logs) {
+            if (!filter.empty() && filter != log->Route()) continue;
+            if (!first_route) out += ',';
+            first_route = false;
+            out += "{\"route\":";
+            logging::AppendJsonString(out, log->Route());
+            out += ",\"requests\":[";
+            bool first = true;
+            for (const SlowRequest& request : log->Snapshot(now_ns)) {
+                if (!first) out += ',';
+                first = false;
+                AppendRequest(out, request, now_ns);
+            }
+            out += "]}";
+        }
+        out += "]}\n";
+        res.set_content(std::move(out), "application/json");
+    }
+};
 
-    // Rappresenta un attributo chiave-valore associato a uno span o una metrica.
-    struct Attribute {
-        std::string key;
-        std::string value;
+// --- Ciclo di vita del processo ---
+// SIGTERM/SIGINT avviano un arresto ordinato: (dopo shutdown_delay) i listener smettono di
+// accettare connessioni, le richieste in corso vengono completate, poi si esportano span e
+// metriche e si scrivono gli ultimi log, il tutto entro shutdown_timeout. Un secondo segnale
+// di terminazione, o la scadenza del timeout, chiude subito il processo.
+// SIGHUP ricarica le impostazioni modificabili a runtime (livello e formato dei log,
+// campionamento) dal file WEBSERVER_RUNTIME_CONFIG.
+//
+// Per un riavvio senza interruzioni con WEBSERVER_REUSE_PORT=1 il nuovo processo apre la
+// stessa porta (SO_REUSEPORT) mentre il vecchio è ancora attivo; quando il nuovo è pronto
+// si invia SIGTERM al vecchio, che con shutdown_delay continua a servire finché il
+// bilanciatore non si è accorto del cambio.
 
-        // Costruttori per diversi tipi di valore
-        Attribute(const std::string& k, const std::string& v) : key(k), value(v) {}
-        Attribute(const std::string& k, int v) : key(k), value(std::to_string(v)) {}
-        Attribute(const std::string& k, long v) : key(k), value(std::to_string(v)) {}
-        Attribute(const std::string& k, double v) : key(k), value(std::to_string(v)) {}
-    };
+// Impostazioni ricaricabili, nello stesso formato dei file di configurazione (JSON, YAML o
+// righe NOME=valore, vedi config::LoadFile). Le impostazioni assenti dal file ricadono sulla
+// configurazione di avvio, così il file può contenere solo ciò che si vuole cambiare.
+class RuntimeConfig {
+private:
+    config::Values values;
 
-    // Rappresenta uno Span, un'unità di lavoro discreta in una traccia.
-    // Ha un nome, un contesto, un tempo di inizio/fine e attributi.
-    class Span {
-    private:
-        std::string name;       // Nome dello span (es. "handle_request", "database_query")
-        SpanContext context;    // Contesto di traccia/span
-        std::chrono::time_point<std::chrono::high_resolution_clock> start_time; // Tempo di inizio dello span
-        std::vector<Attribute> attributes; // Attributi associati allo span
-        bool ended = false;     // Flag per assicurarsi che End() sia chiamato una sola volta
+public:
+    // Legge il file; false (con l'errore in `error`) se non è leggibile o non è valido.
+    bool Load(const std::string& path, std::string& error) {
+        config::Values loaded;
+        if (!config::LoadFile(path, loaded, error)) return false;
+        values = std::move(loaded);
+        return true;
+    }
 
-    public:
-        // Costruttore: Inizia lo span registrando il tempo corrente.
-        Span(const std::string& n) : name(n), start_time(std::chrono::high_resolution_clock::now()) {}
+    // Valore dell'impostazione dal file, altrimenti dalla configurazione di avvio; nullptr se assente.
+    const char* Get(const char* name) const {
+        auto it = values.find(name);
+        return it != values.end() ? it->second.c_str() : config::Get(name);
+    }
+};
 
-        // Metodi per aggiungere attributi allo span.
-        void SetAttribute(const std::string& key, const std::string& value) {
-            attributes.push_back(Attribute(key, value));
-        }
+// Riceve i segnali di terminazione (SIGTERM, SIGINT) e di ricarica (SIGHUP) su un thread
+// dedicato, dove le callback possono fare qualsiasi cosa (non sono signal handler).
+// Va costruito all'inizio di main(), prima di creare altri thread: su POSIX blocca i segnali
+// nel thread corrente e tutti i thread creati dopo ereditano la maschera, quindi solo
+// sigwait() li riceve. Su Windows non esiste SIGHUP e SIGINT/SIGTERM impostano un flag
+// controllato periodicamente.
+class SignalWatcher {
+private:
+    std::function<void()> on_terminate;
+    std::function<void()> on_reload;
+    std::atomic<bool> stopping{ false };
+    std::atomic<int> terminate_requests{ 0 };
+    std::thread worker;
+    std::thread terminator; // Esegue on_terminate, così il watcher resta in ascolto di un secondo segnale
+#ifndef _WIN32
+    sigset_t signals;
+#else
+    static std::atomic<int>& PendingSignal() {
+        static std::atomic<int> pending{ 0 };
+        return pending;
+    }
+#endif
 
-        void SetAttribute(const std::string& key, int value) {
-            attributes.push_back(Attribute(key, value));
+    void HandleTerminate() {
+        if (terminate_requests.fetch_add(1) == 0) {
+            terminator = std::thread(on_terminate);
+            return;
         }
+        std::cerr << "Secondo segnale di terminazione: uscita immediata" << std::endl;
+        std::_Exit(1);
+    }
 
-        void SetAttribute(const std::string& key, long value) {
-            attributes.push_back(Attribute(key, value));
+    void WorkerLoop() {
+#ifndef _WIN32
+        while (!stopping.load(std::memory_order_acquire)) {
+            int signal_number = 0;
+            if (sigwait(&signals, &signal_number) != 0) continue;
+            if (stopping.load(std::memory_order_acquire)) break;
+            if (signal_number == SIGHUP) on_reload();
+            else HandleTerminate();
         }
-
-        void SetAttribute(const std::string& key, double value) {
-            attributes.push_back(Attribute(key, value));
+#else
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (PendingSignal().exchange(0) != 0) HandleTerminate();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
+#endif
+    }
 
-        // Termina lo span: calcola la durata e "esporta" (in questo caso, logga) le informazioni.
-        void End() {
-            if (ended) return; // Evita doppie chiamate a End
+public:
+    SignalWatcher() {
+#ifndef _WIN32
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+    }
 
-            auto end_time = std::chrono::high_resolution_clock::now();
-            // Calcola la durata in millisecondi
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+    SignalWatcher(const SignalWatcher&) = delete;
+    SignalWatcher& operator=(const SignalWatcher&) = delete;
 
-            // Log delle informazioni dello span su console.
-            // In una vera integrazione, questi dati verrebbero inviati a un OpenTelemetry Collector.
-            std::cout << "[OTEL] Span: " << name
-                << ", TraceID: " << context.trace_id
-                << ", SpanID: " << context.span_id
-                << ", Duration: " << duration << "ms" << std::endl;
+    ~SignalWatcher() {
+        Stop();
+    }
 
-            std::cout << "[OTEL] Attributes: ";
-            for (const auto& attr : attributes) {
-                std::cout << attr.key << "=" << attr.value << " ";
-            }
-            std::cout << std::endl;
+    // Avvia la ricezione dei segnali. Le callback sono eseguite sul thread del watcher.
+    void Start(std::function<void()> terminate, std::function<void()> reload) {
+        on_terminate = std::move(terminate);
+        on_reload = std::move(reload);
+#ifdef _WIN32
+        std::signal(SIGINT, [](int) { PendingSignal().store(1); });
+        std::signal(SIGTERM, [](int) { PendingSignal().store(1); });
+#endif
+        worker = std::thread(&SignalWatcher::WorkerLoop, this);
+    }
 
-            ended = true;
-        }
+    bool TerminateRequested() const { return terminate_requests.load() > 0; }
 
-        // Distruttore: Assicura che End() venga chiamato automaticamente
-        // quando lo span esce dallo scope (es. alla fine di una funzione o handler).
-        // Questo implementa il pattern RAII (Resource Acquisition Is Initialization).
-        ~Span() {
-            if (!ended) {
-                End();
-            }
-        }
-    };
+    // Ferma il thread del watcher (svegliandolo con un segnale che poi ignora) e attende
+    // la callback di terminazione, se in corso. Idempotente.
+    void Stop() {
+        if (stopping.exchange(true, std::memory_order_acq_rel) || !worker.joinable()) return;
+#ifndef _WIN32
+        pthread_kill(worker.native_handle(), SIGHUP);
+#endif
+        worker.join();
+        if (terminator.joinable()) terminator.join();
+    }
+};
 
-    // Rappresenta una Metrica (contatore) in stile OpenTelemetry minimale.
-    // Supporta label per distinguere valori diversi della stessa metrica.
-    class Metric {
-    private:
-        std::string name;        // Nome della metrica (es. "request_count")
-        std::string description; // Descrizione della metrica
-        // Memorizza i valori della metrica associati a diverse combinazioni di label.
-        // Le label vengono concatenate in una singola stringa chiave per l'unordered_map.
-        std::unordered_map<std::string, int64_t> values;
-        std::mutex mutex;        // Mutex per proteggere l'accesso concorrente alla mappa values
+// Limite di tempo dell'arresto: se lo spegnimento (drenaggio, flush degli exporter)
+// non termina entro il timeout, il processo esce comunque con codice 1.
+class ShutdownDeadline {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread worker;
 
-    public:
-        // Costruttore: Inizializza nome e descrizione della metrica.
-        Metric(const std::string& n, const std::string& desc) : name(n), description(desc) {}
+public:
+    ShutdownDeadline() = default;
+    ShutdownDeadline(const ShutdownDeadline&) = delete;
+    ShutdownDeadline& operator=(const ShutdownDeadline&) = delete;
 
-        // Aggiunge un valore al contatore, opzionalmente con label.
-        // Utilizza un mutex per garantire thread-safety.
-        void Add(int64_t value, const std::unordered_map<std::string, std::string>& labels = {}) {
-            std::lock_guard<std::mutex> lock(mutex); // Blocca il mutex per accesso esclusivo
+    ~ShutdownDeadline() {
+        Cancel();
+    }
 
-            // Costruisce una chiave stringa unica basata sulle label fornite.
-            // L'ordine delle label nella chiave influenza se le metriche vengono raggruppate correttamente
-            // se si usassero unordered_map all'esterno. Usiamo un map per l'output Prometheus
-            // per garantire un ordine coerente delle label, ma l'unordered_map interna è per l'aggiunta.
-            std::string label_key = "";
-            // Ordina le label per garantire una chiave consistente
-            std::map<std::string, std::string> sorted_labels(labels.begin(), labels.end());
-            for (const auto& label : sorted_labels) {
-                // Formato chiave: key1:value1;key2:value2;
-                label_key += label.first + ":" + label.second + ";";
+    // Avvia il conto alla rovescia (solo la prima chiamata ha effetto).
+    void Start(std::chrono::milliseconds timeout) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (worker.joinable() || done) return;
+        worker = std::thread([this, timeout] {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!cv.wait_for(lock, timeout, [this] { return done; })) {
+                std::cerr << "Arresto non completato entro " << timeout.count() << "ms: uscita forzata" << std::endl;
+                std::_Exit(1);
             }
+        });
+    }
 
-            // Incrementa il valore per la combinazione di label specificata.
-            values[label_key] += value;
+    // Arresto completato: ferma il conto alla rovescia. Idempotente.
+    void Cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
         }
+        cv.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+};
 
-        // Restituisce le metriche in formato testo compatibile con Prometheus.
-        // Link utile: https://prometheus.io/docs/instrumenting/exposition_formats/
-        std::string GetPrometheusFormat() const {
-            std::stringstream ss;
-
-            // Linee HELP e TYPE per la metrica
-            ss << "# HELP " << name << " " << description << "\n";
-            ss << "# TYPE " << name << " counter\n"; // Questa implementazione gestisce solo contatori
-
-            // Output dei valori per ogni combinazione di label
-            // Utilizziamo un map temporaneo per ordinare le label per l'output Prometheus
-            std::map<std::string, int64_t> ordered_values(values.begin(), values.end());
-
-            for (const auto& pair : ordered_values) {
-                ss << name;
-
-                // Aggiunge le label se presenti
-                if (!pair.first.empty()) {
-                    ss << "{";
-                    bool first = true;
-                    std::string label_str = pair.first;
-                    std::string delimiter = ";";
-                    size_t pos = 0;
-                    std::string token;
-
-                    // Parsa la chiave delle label (es. "path:/;")
-                    while ((pos = label_str.find(delimiter)) != std::string::npos) {
-                        token = label_str.substr(0, pos);
-                        if (!token.empty()) {
-                            size_t colon_pos = token.find(":");
-                            if (colon_pos != std::string::npos) {
-                                std::string key = token.substr(0, colon_pos);
-                                std::string value = token.substr(colon_pos + 1);
-
-                                if (!first) {
-                                    ss << ",";
-                                }
-                                // Formato label Prometheus: key="value"
-                                ss << key << "=\"" << value << "\"";
-                                first = false;
-                            }
-                        }
-                        label_str.erase(0, pos + delimiter.length());
-                    }
-                    ss << "}";
-                }
+// Estrae il contesto W3C (traceparent/tracestate) dagli header della richiesta.
+// La ricerca avviene direttamente nella mappa degli header, senza copiarne i valori.
+static otel::SpanContext ExtractTraceContext(const httplib::Request& req) {
+    auto traceparent = req.headers.find("traceparent");
+    if (traceparent == req.headers.end()) return otel::SpanContext();
+    auto tracestate = req.headers.find("tracestate");
+    return otel::TraceContext::Extract(traceparent->second,
+        tracestate != req.headers.end() ? tracestate->second : std::string());
+}
 
-                // Aggiunge il valore della metrica
-                ss << " " << pair.second << "\n";
-            }
+// Restituisce al client il contesto dello span server (header traceresponse,
+// W3C Trace Context Level 2), così nginx o il chiamante possono collegare i propri log alla traccia.
+static void InjectTraceResponse(const otel::Span& span, httplib::Response& res) {
+    if (span.GetContext().IsValid()) {
+        // emplace sposta il valore nell'header invece di copiarlo (set_header prende const&)
+        res.headers.emplace("traceresponse", otel::TraceContext::Traceparent(span.GetContext()));
+    }
+}
+
+// --- Pipeline di middleware delle route ---
+// Ogni route è un handler avvolto da una catena di middleware composta a tempo di
+// compilazione: Route<Handler, M1, M2, ...> invoca M1, che riceve come `next` una lambda
+// verso M2 e così via fino all'handler. Tutti i tipi sono noti al compilatore, quindi la
+// catena viene espansa inline: nessuna chiamata virtuale né std::function tra un passo e
+// l'altro (resta solo quella di httplib::Server::Handler alla registrazione della route).
+// Una route senza un middleware (es. senza tracing) non ne paga alcun costo.
+//
+// Un middleware è un oggetto con:
+//   template <typename Next>
+//   void operator()(const httplib::Request&, httplib::Response&, RequestContext&, Next&& next) const;
+// che esegue il proprio lavoro prima e/o dopo next().
+
+// Stato della richiesta condiviso lungo la catena e con l'handler.
+struct RequestContext {
+    otel::Span* span = nullptr;  // Span server della richiesta (TracingMiddleware), se presente
+    std::pmr::memory_resource* arena = nullptr; // Arena della richiesta (ArenaMiddleware)
+    int64_t total_visits = 0;    // Visite totali dopo l'incremento (VisitMiddleware)
+    std::chrono::nanoseconds elapsed{ 0 }; // Durata dell'handler (LatencyMiddleware)
+    std::chrono::high_resolution_clock::time_point finished{}; // Fine dell'handler (LatencyMiddleware)
+};
 
-            return ss.str();
+template <typename Handler, typename... Middleware>
+class Route {
+private:
+    Handler handler;
+    std::tuple<Middleware...> middleware;
+
+    template <size_t I>
+    void Invoke(const httplib::Request& req, httplib::Response& res, RequestContext& context) const {
+        if constexpr (I == sizeof...(Middleware)) {
+            handler(req, res, context);
         }
-    };
+        else {
+            std::get<I>(middleware)(req, res, context, [&] { Invoke<I + 1>(req, res, context); });
+        }
+    }
 
-    // Registry Singleton per gestire tutte le metriche OpenTelemetry (minimali).
-    // Assicura che ci sia una singola istanza del registry per creare e accedere alle metriche.
-    class MetricsRegistry {
-    private:
-        // Mappa che memorizza le metriche per nome.
-        // std::unique_ptr assicura la corretta gestione della memoria.
-        std::unordered_map<std::string, std::unique_ptr<Metric>> metrics;
-        std::mutex mutex; // Mutex per proteggere l'accesso concorrente alla mappa metrics
+public:
+    Route(Handler h, Middleware... m) : handler(std::move(h)), middleware(std::move(m)...) {}
 
-        // Costruttore privato per impedire l'instanziazione diretta (Singleton).
-        MetricsRegistry() = default;
+    void operator()(const httplib::Request& req, httplib::Response& res) const {
+        RequestContext context;
+        Invoke<0>(req, res, context);
+    }
+};
 
-    public:
-        // Cancella costruttori di copia e assegnazione per garantire che sia Singleton.
-        MetricsRegistry(const MetricsRegistry&) = delete;
-        MetricsRegistry& operator=(const MetricsRegistry&) = delete;
-        MetricsRegistry(MetricsRegistry&&) = delete;
-        MetricsRegistry& operator=(MetricsRegistry&&) = delete;
+// Compone una route: i middleware sono elencati dal più esterno al più interno.
+template <typename Handler, typename... Middleware>
+Route<Handler, Middleware...> MakeRoute(Handler handler, Middleware... middleware) {
+    return Route<Handler, Middleware...>(std::move(handler), std::move(middleware)...);
+}
 
-        // Metodo statico per ottenere l'unica istanza del registry.
-        static MetricsRegistry& Instance() {
-            static MetricsRegistry instance; // Creata al primo utilizzo (thread-safe in C++11+)
-            return instance;
-        }
+// Azzera l'arena del worker (liberando i dati della richiesta precedente, ormai inviata)
+// e la mette a disposizione dei middleware successivi e dell'handler.
+struct ArenaMiddleware {
+    template <typename Next>
+    void operator()(const httplib::Request&, httplib::Response&, RequestContext& context, Next&& next) const {
+        RequestArena::Reset();
+        context.arena = RequestArena::Resource();
+        next();
+    }
+};
 
-        // Crea o restituisce un contatore esistente.
-        // Thread-safe grazie al mutex.
-        Metric* CreateCounter(const std::string& name, const std::string& description) {
-            std::lock_guard<std::mutex> lock(mutex); // Blocca il mutex
+// Registra in `allocations` le allocazioni eseguite dal thread durante il resto della catena
+// (span, log, rendering e risposta; escluso il parsing della richiesta di httplib).
+struct CountAllocationsMiddleware {
+    otel::BoundHistogram allocations;
 
-            // Se la metrica non esiste, la crea.
-            if (metrics.find(name) == metrics.end()) {
-                metrics[name] = std::make_unique<Metric>(name, description);
-            }
+    template <typename Next>
+    void operator()(const httplib::Request&, httplib::Response&, RequestContext&, Next&& next) const {
+        if constexpr (!otel::kAllocationCountingEnabled) {
+            next(); // Conteggio non compilato: l'istogramma resta vuoto
+        }
+        else {
+            uint64_t before = otel::ThisThreadAllocations();
+            next();
+            allocations.Record(otel::ThisThreadAllocations() - before);
+        }
+    }
+};
+
+// Span server della richiesta, sullo stack del worker: continua la traccia del chiamante
+// (traceparent), registra gli attributi HTTP e restituisce traceresponse. Il campionamento
+// resta quello del TracerProvider (per nome dello span con PerRouteSampler).
+// Le risposte 5xx marcano lo span come errore, così il tail sampling le conserva.
+struct TracingMiddleware {
+    otel::StaticString span_name;
+    const char* route;
 
-            // Restituisce un puntatore alla metrica.
-            return metrics[name].get();
+    template <typename Next>
+    void operator()(const httplib::Request& req, httplib::Response& res, RequestContext& context, Next&& next) const {
+        if constexpr (!otel::kTracingEnabled) {
+            // Build senza tracing: nessuno span, nessun header traceparent letto o scritto
+            next();
         }
+        else {
+            otel::Span span(span_name, ExtractTraceContext(req), otel::SpanKind::Server);
+            span.SetAttribute("http.method", req.method);
+            span.SetAttribute("http.path", route);
+            span.SetAttribute("http.remote_ip", req.remote_addr);
+            context.span = &span;
 
-        // Restituisce le metriche di tutte le metriche registrate in formato Prometheus.
-        std::string GetAllMetrics() const {
-            std::stringstream ss;
-            // Nota: L'accesso a 'metrics' qui non necessita di lock perché questo metodo
-            // viene chiamato solo da getPrometheusMetrics() che ha già un lock sul VisitCounter,
-            // e l'aggiunta di nuove metriche avviene solo in CreateCounter che ha il proprio lock.
-            // Tuttavia, in un sistema più complesso con letture/scritture più libere, un lock qui sarebbe necessario.
+            next();
 
-            for (const auto& metric_pair : metrics) {
-                // Chiama GetPrometheusFormat() per ogni metrica registrata
-                ss << metric_pair.second->GetPrometheusFormat() << "\n";
+            int status = res.status == -1 ? 200 : res.status; // httplib imposta 200 dopo l'handler
+            if (context.elapsed.count() > 0) {
+                // Durata in millisecondi con parte frazionaria: con la risoluzione intera quasi tutte le richieste risultavano 0ms
+                span.SetAttribute("http.response_time_ms", std::chrono::duration<double, std::milli>(context.elapsed).count());
             }
-
-            return ss.str();
+            span.SetAttribute("http.status_code", status);
+            if (status >= 500) span.SetStatus(otel::StatusCode::Error);
+            InjectTraceResponse(span, res);
+            context.span = nullptr;
         }
-    };
-} // namespace otel
+    }
+};
 
-// --- Classe per il conteggio delle visite ---
-// Questa classe gestisce il conteggio delle visite totali e per specifici percorsi.
-// È thread-safe per l'utilizzo in un server multi-thread.
-class VisitCounter {
-private:
-    // Contatore totale delle visite. Usiamo std::atomic per thread-safety senza mutex aggiuntivi
-    // per operazioni semplici di incremento/lettura.
-    std::atomic<int> total_counter{ 0 };
+// Durata del resto della catena nell'istogramma della route. Va messo dentro TracingMiddleware:
+// la registrazione avviene con lo span attivo, che diventa l'esemplare del bucket.
+struct LatencyMiddleware {
+    otel::BoundHistogram latency;
 
-    // Mutex per proteggere l'accesso alla mappa path_counters,
-    // poiché le operazioni sulla mappa (inserimento, accesso) non sono atomiche.
-    std::mutex path_mutex;
-    // Mappa che memorizza il numero di visite per ogni percorso visitato.
-    std::map<std::string, int> path_counters; // std::map mantiene i percorsi ordinati
+    template <typename Next>
+    void operator()(const httplib::Request&, httplib::Response&, RequestContext& context, Next&& next) const {
+        auto start = std::chrono::high_resolution_clock::now();
+        next();
+        context.finished = std::chrono::high_resolution_clock::now();
+        context.elapsed = context.finished - start;
+        latency.Record(context.elapsed);
+    }
+};
 
-    // Riferimenti ai contatori OpenTelemetry gestiti dal registry.
-    // Questi puntatori NON sono gestiti da questa classe (non li creiamo con new/delete),
-    // ma li otteniamo dal MetricsRegistry singleton.
-    otel::Metric* visit_counter; // Contatore OTEL per le visite totali
-    std::map<std::string, otel::Metric*> path_metrics; // Mappa per i contatori OTEL per percorso
+// Candida la richiesta al log delle richieste lente della route. Va messo tra TracingMiddleware
+// e LatencyMiddleware: usa durata e fine misurate da quest'ultimo e lo span ancora attivo.
+struct SlowRequestMiddleware {
+    SlowRequestLog* log; // nullptr: log disattivato
 
-public:
-    // Costruttore: Inizializza la classe e registra il contatore totale delle visite
-    // nel registry OpenTelemetry minimale.
-    VisitCounter() {
-        // Ottiene l'istanza unica del MetricsRegistry e crea (o ottiene) il contatore totale.
-        // Questo viene fatto una volta sola all'avvio del server.
-        visit_counter = otel::MetricsRegistry::Instance().CreateCounter(
-            "otel_visit_counter_total", "Numero totale di visite al server (OTEL)");
+    template <typename Next>
+    void operator()(const httplib::Request& req, httplib::Response& res, RequestContext& context, Next&& next) const {
+        next();
+        if (!log) return;
+        const int64_t finished_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            context.finished.time_since_epoch()).count();
+        if (!log->ShouldOffer(context.elapsed.count(), finished_ns)) return;
+        SlowRequest request;
+        if (context.span) {
+            request.trace_id = context.span->GetContext().trace_id;
+            request.span_id = context.span->GetContext().span_id;
+            request.sampled = context.span->IsRecording();
+        }
+        request.duration_ns = context.elapsed.count();
+        request.finished_ns = finished_ns;
+        request.status = static_cast<uint16_t>(res.status == -1 ? 200 : res.status);
+        request.remote_port = static_cast<uint16_t>(std::max(0, req.remote_port));
+        SlowRequest::CopyTruncated(request.method, sizeof(request.method), req.method);
+        SlowRequest::CopyTruncated(request.remote_addr, sizeof(request.remote_addr), req.remote_addr);
+        SlowRequest::CopyTruncated(request.path, sizeof(request.path), req.path);
+        log->Offer(request);
     }
+};
 
-    // Incrementa il contatore totale delle visite in modo thread-safe.
-    // Restituisce il valore DOPO l'incremento.
-    int incrementTotal() {
-        int count = ++total_counter; // Operazione atomica di pre-incremento
+// Contatori delle visite: totale e percorso già internato (nessuna ricerca per stringa).
+struct VisitMiddleware {
+    VisitCounter& counter;
+    VisitCounter::PathId path;
 
-        // Aggiorna il contatore OpenTelemetry corrispondente.
-        // Add(1) è thread-safe internamente alla classe Metric.
-        visit_counter->Add(1);
+    template <typename Next>
+    void operator()(const httplib::Request&, httplib::Response&, RequestContext& context, Next&& next) const {
+        context.total_visits = counter.incrementTotal();
+        counter.incrementPath(path);
+        next();
+    }
+};
 
-        return count;
+// Log di accesso asincrono: i campi vengono solo copiati nel ring buffer del thread,
+// formattazione e scrittura avvengono nel thread di logging. Con il livello filtrato
+// (es. Debug in produzione) costa un confronto.
+struct AccessLogMiddleware {
+    logging::Level level;
+    const char* route;
+
+    template <typename Next>
+    void operator()(const httplib::Request& req, httplib::Response&, RequestContext& context, Next&& next) const {
+        logging::Logger::Instance().Log(level, "Visita", [&](logging::Record& record) {
+            record.Field("remote_ip", req.remote_addr).Field("path", route);
+            if (context.total_visits > 0) record.Field("total_visits", context.total_visits);
+        });
+        next();
     }
+};
 
-    // Incrementa il contatore delle visite per un percorso specifico in modo thread-safe.
-    void incrementPath(const std::string& path) {
-        std::lock_guard<std::mutex> lock(path_mutex); // Blocca il mutex prima di accedere alla mappa
+// --- Funzione principale ---
+// Con WEBSERVER_NO_MAIN il file può essere incluso da altri programmi (es. bench/Microbenchmarks.cpp)
+// per riusarne le classi senza avviare il server.
+#ifndef WEBSERVER_NO_MAIN
+int main(int argc, char** argv) {
+    // Prima di creare qualsiasi thread: SIGTERM/SIGINT/SIGHUP vengono ricevuti solo dal watcher.
+    SignalWatcher signals;
+
+    // Riga di comando e file di configurazione, letti una sola volta: da qui in poi ogni
+    // *Options::FromEnvironment() vede flag, ambiente e file con la loro precedenza.
+    std::string config_error;
+    if (!config::Settings::Instance().Load(argc, argv, config_error)) {
+        std::cerr << config_error << "\n" << config::Settings::Usage();
+        return 2;
+    }
+    if (config::Settings::Instance().HelpRequested()) {
+        std::cout << config::Settings::Usage();
+        return 0;
+    }
+    if (!config::Settings::Instance().FilePath().empty()) {
+        std::cout << "Configurazione letta da " << config::Settings::Instance().FilePath() << std::endl;
+    }
 
-        path_counters[path]++; // Incrementa il contatore per il percorso specifico
+    // Parametri del server HTTP (porta, worker, keep-alive, listener SO_REUSEPORT, arresto) da WEBSERVER_*.
+    const ServerOptions server_options = ServerOptions::FromEnvironment();
+    const int PORT = server_options.port; // Porta su cui il server ascolterà
 
-        // Logica per aggiornare o creare un contatore OpenTelemetry per il percorso.
-        // Costruisce un nome metrico "pulito" dal percorso.
-        std::string metric_name = "otel_path_" + path.substr(1) + "_visits";
-        if (path == "/") {
-            metric_name = "otel_path_root_visits";
+    // Impostazioni ricaricabili con SIGHUP: dal file WEBSERVER_RUNTIME_CONFIG, se presente,
+    // altrimenti dalla configurazione di avvio. `setting` è usato all'avvio e a ogni ricarica.
+    RuntimeConfig runtime_config;
+    if (!server_options.runtime_config.empty()) {
+        std::string error;
+        if (!runtime_config.Load(server_options.runtime_config, error)) {
+            std::cerr << "Configurazione runtime non letta, uso quella di avvio: " << error << std::endl;
         }
-        else {
-            // Sostituisci '/' con '_' per nomi metrici validi Prometheus/OTEL
-            for (char& c : metric_name) {
-                if (c == '/') c = '_';
+    }
+    const auto setting = [&runtime_config](const char* name) { return runtime_config.Get(name); };
+
+    // Livello e formato dei log da LOG_LEVEL / LOG_FORMAT (modificabile poi via PUT /loglevel o SIGHUP).
+    logging::Logger::Instance().Configure(setting);
+
+    // Nota: gli ID di span e traccia usano un generatore per thread inizializzato
+    // con entropia del sistema (otel::IdGenerator), quindi non serve più std::srand.
+
+    // Campionamento in testa: sampler standard da OTEL_TRACES_SAMPLER/OTEL_TRACES_SAMPLER_ARG.
+    // Con OTEL_TRACES_SAMPLER_RATE_LIMIT (span radice al secondo) ogni route ha inoltre
+    // un proprio limite, così il traffico su "/" non esaurisce la quota delle altre pagine.
+    // Il sampler viene ricostruito a ogni SIGHUP e sostituito atomicamente.
+    const auto build_sampler = [](auto get) {
+        std::unique_ptr<otel::Sampler> sampler = otel::SamplerFromSettings(get);
+        if (const char* rate_limit = get("OTEL_TRACES_SAMPLER_RATE_LIMIT")) {
+            double per_second = std::atof(rate_limit);
+            otel::PerRouteSampler::Routes routes;
+            for (const char* route : { "handle_root_request", "handle_stats_request", "handle_metrics_request", "handle_traces_request" }) {
+                routes.emplace_back(route, std::make_unique<otel::RateLimitingSampler>(per_second, per_second));
             }
+            sampler = std::make_unique<otel::ParentBasedSampler>(
+                std::make_unique<otel::PerRouteSampler>(std::move(routes), std::move(sampler)));
         }
+        return sampler;
+    };
+    auto swappable_sampler = std::make_unique<otel::SwappableSampler>(build_sampler(setting));
+    otel::SwappableSampler* sampler = swappable_sampler.get();
 
+    // Coda e batch del processor (OTEL_BSP_*) e tail sampling opzionale.
+    const otel::BatchSpanProcessorOptions processor_options = otel::BatchSpanProcessorOptions::FromEnvironment();
 
-        // Se non esiste già un contatore OTEL per questo percorso, lo crea.
-        if (path_metrics.find(path) == path_metrics.end()) {
-            std::string description = "Visite al percorso " + path + " (OTEL)";
-            // Crea (o ottiene) il contatore OTEL specifico per questo percorso
-            path_metrics[path] = otel::MetricsRegistry::Instance().CreateCounter(metric_name, description);
+    // Inizializzazione della pipeline di tracing: gli span terminati vengono accodati
+    // ed esportati a batch da un thread in background. OTEL_TRACES_EXPORTER sceglie la
+    // destinazione: otlp (default se è configurato OTEL_EXPORTER_OTLP_ENDPOINT), console
+    // (default altrimenti) o none.
+    // Senza tracing compilato (build edge) non si crea alcun exporter né il thread del processor.
+    if constexpr (otel::kTracingEnabled) {
+        const char* traces_exporter = config::Get("OTEL_TRACES_EXPORTER");
+        const std::string traces_destination = traces_exporter ? traces_exporter
+            : config::Get("OTEL_EXPORTER_OTLP_ENDPOINT") ? "otlp" : "console";
+        std::unique_ptr<otel::SpanExporter> span_exporter;
+        if (traces_destination == "none") {
+            span_exporter = std::make_unique<otel::NoopSpanExporter>();
         }
-
-        // Aggiunge 1 al contatore OTEL per questo percorso, usando il percorso come label.
-        path_metrics[path]->Add(1, { {"path", path} });
+        else if (traces_destination == "otlp") {
+            const char* protocol = config::Get("OTEL_EXPORTER_OTLP_PROTOCOL");
+            if (protocol && std::string(protocol) == "grpc") {
+                std::cerr << "[OTEL] Protocollo OTLP gRPC non supportato, uso http/protobuf" << std::endl;
+            }
+            auto options = otel::OtlpHttpOptions::FromEnvironment();
+            std::cout << "[OTEL] Export OTLP/HTTP verso " << options.endpoint << std::endl;
+            span_exporter = std::make_unique<otel::OtlpHttpSpanExporter>(options);
+        }
+        else {
+            span_exporter = std::make_unique<otel::ConsoleSpanExporter>();
+        }
+        otel::TracerProvider::Instance().Init(std::move(span_exporter), processor_options, std::move(swappable_sampler));
     }
 
-    // Restituisce il contatore totale delle visite in modo thread-safe.
-    int getTotal() const {
-        return total_counter.load(); // Operazione atomica di lettura
-    }
+    // Costo della telemetria stessa (Span::End, lock delle metriche, rendering, code) su /metrics.
+    otel::RegisterSelfTelemetry();
+    otel::MetricsRegistry::Instance().CreateObservableCounter("otel_telemetry_log_dropped_lines_total",
+        "Righe di log scartate perche' il ring buffer del thread era pieno",
+        [] { return static_cast<int64_t>(logging::Logger::Instance().GetDroppedLines()); });
 
-    // Restituisce una copia della mappa dei contatori per percorso.
-    // La copia è necessaria per evitare modifiche alla mappa originale mentre viene letta.
-    // Viene usato il lock per garantire una copia consistente.
-    std::map<std::string, int> getPathCounters() {
-        std::lock_guard<std::mutex> lock(path_mutex); // Blocca il mutex durante la copia
-        return path_counters;
+    // Push periodico delle metriche via OTLP (OTEL_METRICS_EXPORTER=otlp, default se è configurato
+    // un endpoint; "none" per disattivarlo). /metrics resta disponibile per lo scrape Prometheus.
+    std::unique_ptr<otel::PeriodicMetricReader> metric_reader;
+    const char* metrics_exporter = config::Get("OTEL_METRICS_EXPORTER");
+    if (config::Get("OTEL_EXPORTER_OTLP_ENDPOINT") && (!metrics_exporter || std::string(metrics_exporter) == "otlp")) {
+        auto reader_options = otel::PeriodicMetricReaderOptions::FromEnvironment();
+        std::cout << "[OTEL] Push delle metriche ogni " << reader_options.interval.count() << "ms ("
+            << (reader_options.temporality == otel::AggregationTemporality::Delta ? "delta" : "cumulative") << ")" << std::endl;
+        metric_reader = std::make_unique<otel::PeriodicMetricReader>(
+            std::make_unique<otel::OtlpHttpMetricExporter>(otel::OtlpHttpOptions::FromEnvironment()), reader_options);
     }
 
-    // Genera le metriche in formato testo compatibile con Prometheus.
-    // Include sia i contatori "nativi" che quelli gestiti tramite l'OTEL Registry minimale.
-    // Protegge l'accesso ai contatori con il mutex path_mutex (che copre anche total_counter
-    // indirettamente per questo scopo specifico).
-    std::string getPrometheusMetrics() {
-        std::stringstream ss;
-        std::lock_guard<std::mutex> lock(path_mutex); // Blocca il mutex per leggere i contatori
+    // Inizializzazione dell'oggetto VisitCounter per tracciare le visite.
+    VisitCounter counter;
 
-        // --- Metriche "Native" (generate direttamente qui) ---
+    // Internamento dei percorsi noti: ogni handler usa direttamente il proprio PathId,
+    // senza ricerche per stringa né lock durante la gestione delle richieste.
+    const VisitCounter::PathId root_path = counter.registerPath("/");
+    const VisitCounter::PathId stats_path = counter.registerPath("/stats");
+    const VisitCounter::PathId metrics_path = counter.registerPath("/metrics");
+    const VisitCounter::PathId traces_path = counter.registerPath("/traces");
 
-        // Metrica totale visite
-        ss << "# HELP visit_counter_total Numero totale di visite al server\n";
-        ss << "# TYPE visit_counter_total counter\n";
-        ss << "visit_counter_total " << total_counter << "\n\n"; // Legge il valore atomico
-
-        // Metriche per percorso (dalla mappa path_counters)
-        ss << "# HELP path_visits_total Numero di visite per percorso\n";
-        ss << "# TYPE path_visits_total counter\n";
-        for (const auto& pair : path_counters) {
-            // Formato con label: metric_name{label_key="label_value"} value
-            ss << "path_visits_total{path=\"" << pair.first << "\"} " << pair.second << "\n";
+    // Istogramma della latenza delle richieste, registrata in nanosecondi ed esposta in secondi
+    // (http_server_request_duration_seconds_bucket/_sum/_count), con bucket esponenziali da 50us a ~1.6s.
+    // Gli handle per route vengono risolti una sola volta, alla composizione delle route.
+    otel::Histogram* request_duration = otel::MetricsRegistry::Instance().CreateHistogram(
+        "http_server_request_duration_seconds", "Durata della gestione delle richieste HTTP",
+        otel::ExponentialBuckets(50000, 2.0, 16), 1e-9);
+
+    // Allocazioni di memoria per richiesta (bucket 0, 1, 2, 4, ... 1024), misurate attorno all'handler.
+    std::vector<uint64_t> allocation_bounds = otel::ExponentialBuckets(1, 2.0, 11);
+    allocation_bounds.insert(allocation_bounds.begin(), 0);
+    otel::Histogram* request_allocations = otel::MetricsRegistry::Instance().CreateHistogram(
+        "http_server_request_allocations", "Allocazioni di memoria per richiesta HTTP", std::move(allocation_bounds));
+
+    // Richieste più lente di ogni route strumentata, esposte su /debug/slow (WEBSERVER_SLOW_REQUESTS=0 lo disattiva).
+    SlowRequestTracker slow_requests(SlowRequestOptions::FromEnvironment());
+
+    // Stato persistente dei contatori (WEBSERVER_STATE_FILE): ripristinato prima di accettare
+    // richieste, poi salvato periodicamente da un thread dedicato.
+    std::unique_ptr<CounterCheckpointer> checkpointer;
+    const StateOptions state_options = StateOptions::FromEnvironment();
+    if (!state_options.path.empty()) {
+        std::string error;
+        if (auto state_file = StateFile::Open(state_options.path, state_options.slot_bytes, error)) {
+            checkpointer = std::make_unique<CounterCheckpointer>(std::move(state_file), counter, state_options);
+            auto started = std::chrono::steady_clock::now();
+            size_t restored = checkpointer->Restore();
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+            std::cout << "Stato dei contatori: " << restored << " serie ripristinate da " << state_options.path
+                << " in " << elapsed.count() << "us, checkpoint ogni " << state_options.interval.count() << "ms" << std::endl;
+            checkpointer->Start();
         }
+        else {
+            std::cerr << "Persistenza dei contatori disattivata: " << error << std::endl;
+        }
+    }
 
-        // --- Metriche OpenTelemetry (dal Registry minimale) ---
-        // Aggiunge l'output delle metriche registrate tramite l'OTEL Registry.
-        // Queste sono già formattate in stile Prometheus dalla classe Metric.
-        ss << "\n" << otel::MetricsRegistry::Instance().GetAllMetrics();
+    // Modalità cluster (WEBSERVER_CLUSTER_PEERS): homepage e /stats mostrano le visite di tutte
+    // le repliche, aggregate con un G-counter scambiato in gossip dietro le quinte.
+    std::unique_ptr<ClusterAggregator> cluster;
+    const ClusterOptions cluster_options = ClusterOptions::FromEnvironment(PORT);
+    if (cluster_options.Enabled()) {
+        std::string error;
+        if (cluster_options.Validate(error)) {
+            cluster = std::make_unique<ClusterAggregator>(counter, cluster_options, checkpointer != nullptr);
+            std::cout << "Cluster: nodo " << cluster->NodeId() << ", " << cluster_options.peers.size()
+                << " peer, gossip ogni " << cluster_options.interval.count() << "ms" << std::endl;
+            cluster->Start();
+        }
+        else {
+            std::cerr << "Modalità cluster disattivata: " << error << std::endl;
+        }
+    }
 
-        return ss.str();
+    // Profilazione in-process su /debug/pprof (WEBSERVER_PPROF=1 e WEBSERVER_PPROF_TOKEN): heap e
+    // contesa dei lock da subito, CPU a richiesta.
+    std::unique_ptr<ProfilerEndpoints> profiler;
+    const ProfilerOptions profiler_options = ProfilerOptions::FromEnvironment();
+    if (profiler_options.enabled && !profiler_options.Enabled()) {
+        std::cerr << "Profilazione disattivata: WEBSERVER_PPROF_TOKEN obbligatorio con WEBSERVER_PPROF=1" << std::endl;
+    }
+    if (profiler_options.Enabled()) {
+        profiler = std::make_unique<ProfilerEndpoints>(profiler_options);
+        std::string error;
+        if (profiler->Start(error)) {
+            std::cout << "Profilazione attiva su /debug/pprof (heap: un campione ogni "
+                << profiler_options.heap_interval << " byte)" << std::endl;
+        }
+        else {
+            std::cerr << "Profilazione parziale: " << error << std::endl;
+        }
     }
-};
 
-// --- Funzione principale ---
-int main() {
-    // Inizializzazione del seed per la generazione di numeri casuali.
-    // Usato per generare gli ID di span e traccia nella implementazione OTEL minimale.
-    // È importante farlo una volta sola all'avvio del programma.
-    std::srand(static_cast<unsigned int>(std::time(nullptr)));
+    // Timestamp di avvio del processo (convenzione Prometheus), utile per riconoscere i riavvii.
+    otel::MetricsRegistry::Instance().CreateGauge("process_start_time_seconds",
+        "Istante di avvio del processo (secondi dall'epoch Unix)")->Bind().Set(std::time(nullptr));
 
-    // Inizializzazione del server HTTP con la libreria httplib.
-    httplib::Server server;
-    const int PORT = 8080; // Porta su cui il server ascolterà
+    // --- Pagine HTML ---
+    // Compilate una sola volta: a ogni richiesta vengono scritti solo i valori dinamici.
+    // Senza pagine HTML (kHtmlPages) i template sono le varianti in testo semplice.
 
-    // Inizializzazione dell'oggetto VisitCounter per tracciare le visite.
-    VisitCounter counter;
+    // Homepage: {{count}} = visite totali.
+    const HtmlTemplate home_page(!kHtmlPages ? "{{count}}\n" :
+        "<!DOCTYPE html>"
+        "<html><head><title>Contatore Visite</title>"
+        "<meta charset='UTF-8'>"
+        // Stili CSS semplici per rendere la pagina leggibile
+        "<style>"
+        "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
+        "h1 { color: #333; }"
+        ".counter { font-size: 2em; font-weight: bold; color: #2c3e50; }"
+        ".links { margin-top: 20px; }"
+        ".links a { margin-right: 15px; color: #3498db; text-decoration: none; }"
+        ".links a:hover { text-decoration: underline; }"
+        "</style></head><body>"
+        "<h1>Web Server C++ con monitoraggio visite</h1>"
+        "<p>Questa pagina &egrave; stata visitata <span class='counter'>{{count}}</span> volte.</p>"
+        "<div class='links'>"
+        // Link agli altri endpoint
+        "<a href='/stats'>Visualizza statistiche dettagliate</a> | "
+        "<a href='/metrics'>Metriche Prometheus</a> | "
+        "<a href='/traces'>Info sulle tracce OpenTelemetry</a>" // Link per info tracce
+        "</div></body></html>");
+
+    // Statistiche: {{total}} = visite totali, {{rows}} = righe della tabella per percorso.
+    const HtmlTemplate stats_page(!kHtmlPages ? "total {{total}}\n{{rows}}" :
+        "<!DOCTYPE html>"
+        "<html><head><title>Statistiche Visite</title>"
+        "<meta charset='UTF-8'>"
+        // Stili CSS per la tabella
+        "<style>"
+        "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
+        "h1, h2 { color: #333; }"
+        "table { border-collapse: collapse; width: 100%; margin-top: 20px; }"
+        "th, td { border: 1px solid #ddd; padding: 8px; text-align: left; }"
+        "th { background-color: #f2f2f2; }"
+        "tr:nth-child(even) { background-color: #f9f9f9; }" // Riga alternata
+        ".counter { font-size: 1.2em; font-weight: bold; color: #2c3e50; }"
+        ".back-link { margin-top: 20px; }"
+        ".back-link a { color: #3498db; text-decoration: none; }"
+        ".back-link a:hover { text-decoration: underline; }"
+        "</style></head><body>"
+        "<h1>Statistiche Dettagliate</h1>"
+        "<p>Visite totali: <span class='counter'>{{total}}</span></p>"
+        "<h2>Visite per percorso:</h2>"
+        "<table><tr><th>Percorso</th><th>Visite</th></tr>" // Intestazione tabella
+        "{{rows}}"
+        "</table>"
+        "<div class='back-link'><a href='/'>Torna alla home</a></div>" // Link per tornare indietro
+        "</body></html>");
+
+    // Info sulle tracce: nessun contenuto dinamico.
+    const StaticPage traces_page(!kHtmlPages ? "Span esportati via OTLP o su stdout (righe [OTEL])\n" :
+        "<!DOCTYPE html>"
+        "<html><head><title>OpenTelemetry Traces Info</title>"
+        "<meta charset='UTF-8'>"
+        "<style>"
+        "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
+        "h1 { color: #333; }"
+        ".note { background-color: #f8f9fa; border-left: 4px solid #4285f4; padding: 15px; margin-top: 20px; }"
+        ".note p { margin: 0 0 10px 0; }"
+        ".note p:last-child { margin-bottom: 0; }"
+        ".back-link { margin-top: 20px; }"
+        ".back-link a { color: #3498db; text-decoration: none; }"
+        ".back-link a:hover { text-decoration: underline; }"
+        "</style></head><body>"
+        "<h1>OpenTelemetry Traces</h1>"
+        "<div class='note'>"
+        "<p>Questa applicazione include una integrazione minimale di OpenTelemetry Tracing e Metrics.</p>"
+        "<p>A causa della sua implementazione semplice (non usa un OTel Collector reale), le informazioni delle tracce (Span) e delle metriche OpenTelemetry <strong>vengono stampate direttamente sulla console standard (stdout) del server</strong>.</p>"
+        "<p>Se stai eseguendo l'applicazione in un container Docker, puoi visualizzare le tracce usando il comando <code>docker logs [nome-del-container]</code>.</p>"
+        "<p>Cerca le linee che iniziano con <code>[OTEL]</code>.</p>"
+        "</div>"
+        "<div class='back-link'><a href='/'>Torna alla home</a></div>"
+        "</body></html>",
+        kPageContentType);
+
+    // Uscita di /metrics condivisa fra gli scraper per metrics_cache_ttl, con le versioni
+    // compresse: una cache per formato di esposizione (indice = ExpositionFormat).
+    auto metrics_renderer = [&counter](otel::ExpositionFormat format) {
+        return [&counter, format] {
+            otel::Span render_span("render_prometheus_metrics"); // Figlio dello span della richiesta che rigenera
+            return counter.getMetrics(format);
+        };
+    };
+    CompressedResponseCache metrics_caches[] = {
+        { metrics_renderer(otel::ExpositionFormat::PrometheusText),
+            otel::ExpositionContentType(otel::ExpositionFormat::PrometheusText), server_options.metrics_cache_ttl },
+        { metrics_renderer(otel::ExpositionFormat::OpenMetricsText),
+            otel::ExpositionContentType(otel::ExpositionFormat::OpenMetricsText), server_options.metrics_cache_ttl },
+        { metrics_renderer(otel::ExpositionFormat::PrometheusProtobuf),
+            otel::ExpositionContentType(otel::ExpositionFormat::PrometheusProtobuf), server_options.metrics_cache_ttl },
+    };
 
     // --- Definizione degli Endpoint ---
 
     // Endpoint principale ("/")
-    server.Get("/", [&](const httplib::Request& req, httplib::Response& res) {
-        // Avvia uno span OpenTelemetry minimale per questa richiesta.
-        // Lo span terminerà automaticamente quando unique_ptr span esce dallo scope
-        // alla fine di questo handler (grazie al distruttore dello Span).
-        auto span = std::make_unique<otel::Span>("handle_root_request");
-
-        // Aggiunge attributi standard HTTP allo span per fornire contesto sulla richiesta.
-        span->SetAttribute("http.method", "GET");
-        span->SetAttribute("http.path", "/");
-        span->SetAttribute("http.remote_ip", req.remote_addr); // Indirizzo IP del client
-
-        // Misura il tempo di inizio per calcolare la durata totale della gestione della richiesta.
-        // Questa misurazione è separata dalla durata dello span OTEL (anche se spesso coincidono).
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        // Incrementa i contatori delle visite (totale e per il percorso corrente).
-        int count = counter.incrementTotal();
-        counter.incrementPath("/");
-
-        // Logging della visita su console standard.
-        auto now = std::chrono::system_clock::now();
-        std::time_t time = std::chrono::system_clock::to_time_t(now);
-        std::cout << "[" << std::put_time(std::localtime(&time), "%F %T") << "] " // Formatta data e ora
-            << "Visita da " << req.remote_addr << " al percorso: / "
-            << "(Totale visite: " << count << ")" << std::endl;
-
-        // Generazione della risposta HTML per la homepage.
-        std::stringstream html;
-        html << "<!DOCTYPE html>"
-            << "<html><head><title>Contatore Visite</title>"
-            << "<meta charset='UTF-8'>"
-            // Stili CSS semplici per rendere la pagina leggibile
-            << "<style>"
-            << "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
-            << "h1 { color: #333; }"
-            << ".counter { font-size: 2em; font-weight: bold; color: #2c3e50; }"
-            << ".links { margin-top: 20px; }"
-            << ".links a { margin-right: 15px; color: #3498db; text-decoration: none; }"
-            << ".links a:hover { text-decoration: underline; }"
-            << "</style></head><body>"
-            << "<h1>Web Server C++ con monitoraggio visite</h1>"
-            << "<p>Questa pagina &egrave; stata visitata <span class='counter'>" << count << "</span> volte.</p>"
-            << "<div class='links'>"
-            // Link agli altri endpoint
-            << "<a href='/stats'>Visualizza statistiche dettagliate</a> | "
-            << "<a href='/metrics'>Metriche Prometheus</a> | "
-            << "<a href='/traces'>Info sulle tracce OpenTelemetry</a>" // Link per info tracce
-            << "</div></body></html>";
-
-        // Imposta il contenuto della risposta e il tipo MIME.
-        res.set_content(html.str(), "text/html; charset=UTF-8");
-
-        // Calcola la durata della gestione della richiesta.
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-
-        // Aggiunge attributi relativi alla risposta allo span OTEL.
-        span->SetAttribute("http.response_time_ms", duration);
-        span->SetAttribute("http.status_code", 200); // Stato HTTP 200 OK per successo
-
-        // Lo span (gestito da unique_ptr) esce dallo scope qui e il suo distruttore chiama End().
-        // L'informazione della traccia viene loggata.
-        });
+    // Span, latenza, contatori delle visite e log di accesso sono applicati dai middleware
+    // della route (vedi instrumented_route più sotto): l'handler genera solo la risposta.
+    const auto handle_root = [&](const httplib::Request& req, httplib::Response& res, RequestContext& context) {
+        // Generazione della risposta HTML per la homepage dal template pre-compilato:
+        // l'unico valore dinamico (il contatore) viene scritto tra i frammenti statici.
+        // In modalità cluster si aggiungono le visite delle altre repliche (un load atomico).
+        auto& body = RequestArena::NewString(context.arena);
+        home_page.RenderTo(body, ClusterAggregator::SaturatingAdd(context.total_visits, cluster ? cluster->RemoteTotal() : 0));
+        SetNegotiatedContent(req, res, body, kPageContentType,
+            server_options.compression_min_size, context.arena);
+        };
 
     // Endpoint per le statistiche dettagliate ("/stats")
-    server.Get("/stats", [&](const httplib::Request& req, httplib::Response& res) {
-        // Avvia uno span OpenTelemetry per questa richiesta.
-        auto span = std::make_unique<otel::Span>("handle_stats_request");
-
-        // Aggiunge attributi HTTP.
-        span->SetAttribute("http.method", "GET");
-        span->SetAttribute("http.path", "/stats");
-        span->SetAttribute("http.remote_ip", req.remote_addr);
-
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        // Incrementa i contatori.
-        int count = counter.incrementTotal();
-        counter.incrementPath("/stats");
-
-        // Logging della visita.
-        auto now = std::chrono::system_clock::now();
-        std::time_t time = std::chrono::system_clock::to_time_t(now);
-        std::cout << "[" << std::put_time(std::localtime(&time), "%F %T") << "] "
-            << "Visita da " << req.remote_addr << " al percorso: /stats "
-            << "(Totale visite: " << count << ")" << std::endl;
-
-        // Ottiene i contatori per percorso.
-        auto path_counters = counter.getPathCounters(); // Ottiene una copia della mappa
-
-        // Generazione della risposta HTML per le statistiche.
-        std::stringstream html;
-        html << "<!DOCTYPE html>"
-            << "<html><head><title>Statistiche Visite</title>"
-            << "<meta charset='UTF-8'>"
-            // Stili CSS per la tabella
-            << "<style>"
-            << "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
-            << "h1, h2 { color: #333; }"
-            << "table { border-collapse: collapse; width: 100%; margin-top: 20px; }"
-            << "th, td { border: 1px solid #ddd; padding: 8px; text-align: left; }"
-            << "th { background-color: #f2f2f2; }"
-            << "tr:nth-child(even) { background-color: #f9f9f9; }" // Riga alternata
-            << ".counter { font-size: 1.2em; font-weight: bold; color: #2c3e50; }"
-            << ".back-link { margin-top: 20px; }"
-            << ".back-link a { color: #3498db; text-decoration: none; }"
-            << ".back-link a:hover { text-decoration: underline; }"
-            << "</style></head><body>"
-            << "<h1>Statistiche Dettagliate</h1>"
-            << "<p>Visite totali: <span class='counter'>" << counter.getTotal() << "</span></p>"
-            << "<h2>Visite per percorso:</h2>"
-            << "<table><tr><th>Percorso</th><th>Visite</th></tr>"; // Intestazione tabella
-
-        // Popola la tabella con i dati dei contatori per percorso.
-        for (const auto& pair : path_counters) {
-            html << "<tr><td>" << pair.first << "</td><td>" << pair.second << "</td></tr>";
-        }
-
-        html << "</table>"
-            << "<div class='back-link'><a href='/'>Torna alla home</a></div>" // Link per tornare indietro
-            << "</body></html>";
-
-        res.set_content(html.str(), "text/html; charset=UTF-8");
-
-        // Calcola e registra la durata nello span OTEL.
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-        span->SetAttribute("http.response_time_ms", duration);
-        span->SetAttribute("http.status_code", 200); // Stato HTTP OK
+    const auto handle_stats = [&](const httplib::Request& req, httplib::Response& res, RequestContext& context) {
+        // Istantanea ordinata dei contatori per percorso, nell'arena della richiesta.
+        // In modalità cluster le si sommano le visite delle altre repliche (ultima vista del gossip).
+        auto path_counters = counter.getPathCounters(context.arena);
+        int64_t total = counter.getTotal();
+        std::shared_ptr<const ClusterAggregator::RemoteView> remote_view;
+        if (cluster) {
+            remote_view = cluster->View();
+            path_counters = ClusterAggregator::MergePaths(path_counters, *remote_view, context.arena);
+            total = ClusterAggregator::SaturatingAdd(total, remote_view->total);
+        }
+
+        // Generazione della risposta HTML per le statistiche dal template pre-compilato,
+        // tracciata come span figlio dello span della richiesta.
+        otel::Span render_span("render_stats_page");
+        auto& body = RequestArena::NewString(context.arena);
+        stats_page.RenderTo(body, total, [&](std::pmr::string& out) {
+            // Popola la tabella con i dati dei contatori per percorso.
+            char number[24];
+            for (const auto& pair : path_counters) {
+                if constexpr (kHtmlPages) {
+                    out += "<tr><td>";
+                    AppendHtmlEscaped(out, pair.first);
+                    out += "</td><td>";
+                    out.append(number, std::to_chars(number, number + sizeof(number), pair.second).ptr);
+                    out += "</td></tr>";
+                }
+                else {
+                    // Una riga "percorso visite" per percorso
+                    out.append(pair.first.data(), pair.first.size());
+                    out += ' ';
+                    out.append(number, std::to_chars(number, number + sizeof(number), pair.second).ptr);
+                    out += '\n';
+                }
+            }
         });
+        SetNegotiatedContent(req, res, body, kPageContentType,
+            server_options.compression_min_size, context.arena);
+        };
 
     // Endpoint per le metriche Prometheus ("/metrics")
-    server.Get("/metrics", [&](const httplib::Request& req, httplib::Response& res) {
-        // Avvia uno span OpenTelemetry per questa richiesta.
-        auto span = std::make_unique<otel::Span>("handle_metrics_request");
-
-        // Aggiunge attributi HTTP.
-        span->SetAttribute("http.method", "GET");
-        span->SetAttribute("http.path", "/metrics");
-        span->SetAttribute("http.remote_ip", req.remote_addr);
-
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        // Incrementa i contatori (anche la visita all'endpoint metrics conta).
-        counter.incrementTotal();
-        counter.incrementPath("/metrics");
-
-        // Logging della visita.
-        auto now = std::chrono::system_clock::now();
-        std::time_t time = std::chrono::system_clock::to_time_t(now);
-        std::cout << "[" << std::put_time(std::localtime(&time), "%F %T") << "] "
-            << "Visita da " << req.remote_addr << " al percorso: /metrics"
-            << std::endl;
-
-        // Genera e restituisce le metriche in formato Prometheus.
-        res.set_content(counter.getPrometheusMetrics(), "text/plain"); // Tipo MIME corretto per metriche
-
-        // Calcola e registra la durata nello span OTEL.
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-        span->SetAttribute("http.response_time_ms", duration);
-        span->SetAttribute("http.status_code", 200); // Stato HTTP OK
-        });
+    const auto handle_metrics = [&](const httplib::Request& req, httplib::Response& res, RequestContext& context) {
+        // Restituisce le metriche nel formato negoziato (Accept) dalla cache condivisa fra gli scraper:
+        // lo span figlio render_prometheus_metrics compare solo quando il corpo viene rigenerato.
+        otel::ExpositionFormat format = NegotiateExpositionFormat(req);
+        bool cached = metrics_caches[static_cast<size_t>(format)].Serve(req, res);
+        if (context.span) context.span->SetAttribute("http.response.cached", cached);
+        };
 
     // Endpoint informativo sulle tracce OpenTelemetry ("/traces")
     // Questo endpoint non mostra le tracce direttamente (dato che vanno su console),
     // ma spiega dove trovarle.
-    server.Get("/traces", [&](const httplib::Request& req, httplib::Response& res) {
-        // Avvia uno span per questa richiesta (anche questa richiesta viene tracciata).
-        auto span = std::make_unique<otel::Span>("handle_traces_request");
-        span->SetAttribute("http.method", "GET");
-        span->SetAttribute("http.path", "/traces");
-        span->SetAttribute("http.remote_ip", req.remote_addr);
-
-        // Incrementa i contatori.
-        counter.incrementTotal();
-        counter.incrementPath("/traces");
-
-        // Logging della visita (opzionale, già coperto dal logging generale).
-        // Potresti aggiungere un log specifico qui se necessario.
-
-        // Generazione della pagina HTML informativa.
-        std::stringstream html;
-        html << "<!DOCTYPE html>"
-            << "<html><head><title>OpenTelemetry Traces Info</title>"
-            << "<meta charset='UTF-8'>"
-            << "<style>"
-            << "body { font-family: Arial, sans-serif; margin: 40px; line-height: 1.6; }"
-            << "h1 { color: #333; }"
-            << ".note { background-color: #f8f9fa; border-left: 4px solid #4285f4; padding: 15px; margin-top: 20px; }"
-            << ".note p { margin: 0 0 10px 0; }"
-            << ".note p:last-child { margin-bottom: 0; }"
-            << ".back-link { margin-top: 20px; }"
-            << ".back-link a { color: #3498db; text-decoration: none; }"
-            << ".back-link a:hover { text-decoration: underline; }"
-            << "</style></head><body>"
-            << "<h1>OpenTelemetry Traces</h1>"
-            << "<div class='note'>"
-            << "<p>Questa applicazione include una integrazione minimale di OpenTelemetry Tracing e Metrics.</p>"
-            << "<p>A causa della sua implementazione semplice (non usa un OTel Collector reale), le informazioni delle tracce (Span) e delle metriche OpenTelemetry <strong>vengono stampate direttamente sulla console standard (stdout) del server</strong>.</p>"
-            << "<p>Se stai eseguendo l'applicazione in un container Docker, puoi visualizzare le tracce usando il comando <code>docker logs [nome-del-container]</code>.</p>"
-            << "<p>Cerca le linee che iniziano con <code>[OTEL]</code>.</p>"
-            << "</div>"
-            << "<div class='back-link'><a href='/'>Torna alla home</a></div>"
-            << "</body></html>";
-
-        res.set_content(html.str(), "text/html; charset=UTF-8");
-
-        // Registra lo stato HTTP nello span OTEL.
-        span->SetAttribute("http.status_code", 200); // Stato HTTP OK
+    const auto handle_traces = [&](const httplib::Request& req, httplib::Response& res, RequestContext&) {
+        // Pagina informativa completamente statica: corpo, versioni compresse ed ETag sono
+        // preparati all'avvio (304 Not Modified se il client ha già la versione corrente).
+        traces_page.Serve(req, res);
+        };
+
+    // Livello di log corrente (GET) e modifica a runtime (PUT con il nome del livello nel corpo).
+    // La porta è pubblica: PUT richiede WEBSERVER_LOGLEVEL_TOKEN nell'header X-Debug-Token, come
+    // gli endpoint di debug; senza token configurato resta disponibile solo SIGHUP.
+    const httplib::Server::Handler handle_get_loglevel = [&](const httplib::Request&, httplib::Response& res) {
+        res.set_content(std::string(logging::LevelName(logging::Logger::Instance().GetLevel())) + "\n", "text/plain");
+        };
+    const httplib::Server::Handler handle_put_loglevel = [&](const httplib::Request& req, httplib::Response& res) {
+        if (server_options.loglevel_token.empty() || req.get_header_value("X-Debug-Token") != server_options.loglevel_token) {
+            res.status = 403;
+            res.set_content(server_options.loglevel_token.empty()
+                ? "Modifica disattivata: impostare WEBSERVER_LOGLEVEL_TOKEN\n" : "Token non valido\n", "text/plain");
+            return;
+        }
+        std::string body = req.body;
+        while (!body.empty() && std::isspace(static_cast<unsigned char>(body.back()))) body.pop_back();
+        logging::Level level;
+        if (!logging::ParseLevel(body, level)) {
+            res.status = 400;
+            res.set_content("Livello non valido: usare debug, info, warn, error o off\n", "text/plain");
+            return;
+        }
+        logging::Logger::Instance().SetLevel(level);
+        logging::Logger::Instance().Log(logging::Level::Warn, "Livello di log modificato", [&](logging::Record& record) {
+            record.Field("level", logging::LevelName(level)).Field("remote_ip", req.remote_addr);
         });
+        res.set_content(body + "\n", "text/plain");
+        };
+
+    // Stato G-counter inviato dai peer del cluster (solo in modalità cluster).
+    const httplib::Server::Handler handle_cluster_gossip = [&](const httplib::Request& req, httplib::Response& res) {
+        if (!cluster->Authorized(req)) {
+            res.status = 403;
+            return;
+        }
+        res.status = cluster->Merge(req.body) ? 204 : 400;
+        };
+
+    // Catena di middleware comune alle pagine: allocazioni, arena della richiesta, span server,
+    // richieste lente, latenza, visite e log di accesso, dal più esterno al più interno.
+    const auto instrumented_route = [&](otel::StaticString span_name, const char* route, VisitCounter::PathId path,
+        logging::Level log_level, auto handler) {
+        return MakeRoute(std::move(handler),
+            CountAllocationsMiddleware{ request_allocations->Bind({ {"route", route} }) },
+            ArenaMiddleware{},
+            TracingMiddleware{ span_name, route },
+            SlowRequestMiddleware{ slow_requests.ForRoute(route) },
+            LatencyMiddleware{ request_duration->Bind({ {"route", route} }) },
+            VisitMiddleware{ counter, path },
+            AccessLogMiddleware{ log_level, route });
+    };
+    const auto root_route = instrumented_route("handle_root_request", "/", root_path, logging::Level::Info, handle_root);
+    const auto stats_route = instrumented_route("handle_stats_request", "/stats", stats_path, logging::Level::Info, handle_stats);
+    const auto metrics_route = instrumented_route("handle_metrics_request", "/metrics", metrics_path, logging::Level::Info, handle_metrics);
+    // Log di /traces a livello debug: di norma filtrato senza alcun costo.
+    const auto traces_route = instrumented_route("handle_traces_request", "/traces", traces_path, logging::Level::Debug, handle_traces);
+
+    // Inizializzazione dei server HTTP con la libreria httplib: uno per listener, tutti
+    // con gli stessi handler. Con più listener ognuno ha il proprio socket (SO_REUSEPORT),
+    // la propria coda di accept e il proprio pool di worker.
+    std::vector<std::unique_ptr<httplib::Server>> servers;
+    for (size_t i = 0; i < server_options.listeners; ++i) {
+        auto server = std::make_unique<httplib::Server>();
+        ConfigureServer(*server, server_options);
+        server->Get("/", root_route);
+        server->Get("/stats", stats_route);
+        server->Get("/metrics", metrics_route);
+        server->Get("/traces", traces_route);
+        server->Get("/loglevel", handle_get_loglevel);
+        server->Put("/loglevel", handle_put_loglevel);
+        if (cluster) server->Post("/cluster/gossip", handle_cluster_gossip);
+        if (slow_requests.Enabled()) {
+            server->Get("/debug/slow", [&](const httplib::Request& req, httplib::Response& res) { slow_requests.Handle(req, res); });
+        }
+        if (profiler) {
+            server->Get("/debug/pprof/", [&](const httplib::Request& req, httplib::Response& res) { profiler->HandleIndex(req, res); });
+            server->Get("/debug/pprof/profile", [&](const httplib::Request& req, httplib::Response& res) { profiler->HandleCpu(req, res); });
+            server->Get("/debug/pprof/heap", [&](const httplib::Request& req, httplib::Response& res) { profiler->HandleHeap(req, res); });
+            server->Get("/debug/pprof/mutex", [&](const httplib::Request& req, httplib::Response& res) { profiler->HandleMutex(req, res); });
+        }
+        servers.push_back(std::move(server));
+    }
 
     // Messaggi informativi all'avvio del server.
     std::cout << "Server avviato sulla porta " << PORT << std::endl;
@@ -626,19 +8141,101 @@ int main() {
     std::cout << "  - http://localhost:" << PORT << "/stats (Statistiche dettagliate per percorso)" << std::endl;
     std::cout << "  - http://localhost:" << PORT << "/metrics (Metriche in formato Prometheus)" << std::endl;
     std::cout << "  - http://localhost:" << PORT << "/traces (Info su dove trovare i dati OpenTelemetry)" << std::endl;
+    std::cout << "  - http://localhost:" << PORT << "/loglevel (Livello di log, modificabile con PUT)" << std::endl;
+    if (slow_requests.Enabled()) std::cout << "  - http://localhost:" << PORT << "/debug/slow (Richieste più lente per route, in JSON)" << std::endl;
+    if (profiler) std::cout << "  - http://localhost:" << PORT << "/debug/pprof/ (Profili CPU, heap e contesa in formato pprof)" << std::endl;
     std::cout << "  - OpenTelemetry integrato in modalità minimale (output su console)." << std::endl;
+    std::cout << "Worker: " << server_options.EffectiveWorkerThreads() << " ("
+        << (server_options.work_stealing ? "work stealing" : "thread pool") << "), listener: "
+        << server_options.listeners << std::endl;
+
+    // SIGHUP: rilegge WEBSERVER_RUNTIME_CONFIG e applica livello/formato dei log e campionamento.
+    const auto reload = [&] {
+        logging::Logger& logger = logging::Logger::Instance();
+        if (server_options.runtime_config.empty()) {
+            logger.Log(logging::Level::Warn, "SIGHUP ignorato: WEBSERVER_RUNTIME_CONFIG non impostato");
+            return;
+        }
+        RuntimeConfig next;
+        std::string error;
+        if (!next.Load(server_options.runtime_config, error)) {
+            logger.Log(logging::Level::Error, "Ricarica della configurazione fallita", [&](logging::Record& record) {
+                record.Field("error", error);
+            });
+            return;
+        }
+        runtime_config = std::move(next); // Letto solo all'avvio e da questo thread
+        logger.Configure(setting);
+        sampler->Set(build_sampler(setting));
+        logger.Log(logging::Level::Warn, "Configurazione ricaricata", [&](logging::Record& record) {
+            record.Field("file", server_options.runtime_config).Field("level", logging::LevelName(logger.GetLevel()));
+        });
+        };
+
+    // SIGTERM/SIGINT: dopo shutdown_delay chiude i listener; le richieste in corso vengono
+    // completate prima che listen ritorni. Un segnale arrivato durante l'avvio attende che
+    // ogni listener sia in ascolto (o che l'avvio sia fallito) prima di fermarlo.
+    ShutdownDeadline shutdown_deadline;
+    std::atomic<bool> listeners_done{ false };
+    const auto terminate = [&] {
+        logging::Logger::Instance().Log(logging::Level::Warn, "Arresto richiesto", [&](logging::Record& record) {
+            record.Field("delay_ms", static_cast<int64_t>(server_options.shutdown_delay.count()))
+                .Field("timeout_ms", static_cast<int64_t>(server_options.shutdown_timeout.count()));
+        });
+        shutdown_deadline.Start(server_options.shutdown_timeout);
+        std::this_thread::sleep_for(server_options.shutdown_delay);
+        for (auto& server : servers) {
+            while (!server->is_running() && !listeners_done.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            server->stop();
+        }
+        };
+    signals.Start(terminate, reload);
 
-    // Avvia il server in modalità di ascolto.
-    // "0.0.0.0" fa sì che il server ascolti su tutte le interfacce di rete disponibili,
-    // utile specialmente se eseguito all'interno di un container Docker.
-    bool success = server.listen("0.0.0.0", PORT);
+    // Avvia i server in modalità di ascolto.
+    // "0.0.0.0" (default di WEBSERVER_HOST) fa sì che il server ascolti su tutte le interfacce
+    // di rete disponibili, utile specialmente se eseguito all'interno di un container Docker.
+    // Tutti i socket vengono aperti prima di iniziare ad accettare connessioni, così un errore
+    // (es. porta già in uso) viene rilevato subito; il primo listener usa il thread principale.
+    bool success = true;
+    for (auto& server : servers) {
+        success = success && server->bind_to_port(server_options.host, PORT);
+    }
+    if (success) {
+        std::vector<std::thread> listener_threads;
+        for (size_t i = 1; i < servers.size(); ++i) {
+            listener_threads.emplace_back([&servers, i] { servers[i]->listen_after_bind(); });
+        }
+        success = servers[0]->listen_after_bind();
+        listeners_done = true;
+        for (auto& server : servers) server->stop();
+        for (auto& thread : listener_threads) thread.join();
+    }
+    listeners_done = true;
 
     // Se listen restituisce false, significa che c'è stato un errore (es. porta già in uso).
     if (!success) {
         std::cerr << "Errore nell'avvio del server sulla porta " << PORT << ". Assicurati che la porta non sia già in uso." << std::endl;
+        signals.Stop();
+        if (cluster) cluster->Shutdown();
+        if (checkpointer) checkpointer->Shutdown();
+        if (metric_reader) metric_reader->Shutdown();
+        otel::TracerProvider::Instance().Shutdown();
+        logging::Logger::Instance().Shutdown();
         return 1; // Indica un errore all'uscita
     }
 
+    // Listener chiusi e richieste in corso completate: invia ai peer le ultime visite, salva lo
+    // stato dei contatori, esporta le ultime metriche e gli span ancora in coda e scrive le
+    // ultime righe di log prima di terminare (entro shutdown_timeout, se avviato da un segnale).
+    signals.Stop();
+    if (cluster) cluster->Shutdown();
+    if (checkpointer) checkpointer->Shutdown();
+    if (metric_reader) metric_reader->Shutdown();
+    otel::TracerProvider::Instance().Shutdown();
+    logging::Logger::Instance().Shutdown();
+    shutdown_deadline.Cancel();
+
 
     return 0; // Indica che il programma è terminato con successo
 }
+#endif // WEBSERVER_NO_MAIN
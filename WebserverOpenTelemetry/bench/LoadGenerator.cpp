@@ -0,0 +1,215 @@
+// Generatore di carico HTTP per il web server (alternativa in C++ allo script k6 di base_implJS).
+// Ogni connessione è un thread con un proprio httplib::Client keep-alive che visita a rotazione
+// gli endpoint indicati. Al termine stampa, per endpoint, req/s e latenze p50/p99/p999.
+//
+// Modalità:
+//   - closed loop (default): ogni connessione invia la richiesta successiva appena riceve la
+//     risposta (più --think-ms di pausa); misura il throughput massimo sostenibile.
+//   - open loop (--rate=R): le richieste partono a ritmo fisso (R al secondo in totale) e la
+//     latenza è misurata dall'istante in cui la richiesta DOVEVA partire, così i ritardi
+//     accumulati dal server non vengono nascosti (coordinated omission).
+//
+// Esempi:
+//   ./webserver_loadgen --port=8080 --connections=32 --duration=30
+//   ./webserver_loadgen --endpoints=/,/metrics --rate=2000 --duration=60
+//   ./webserver_loadgen --port=80 --connections=50 --think-ms=1000   # come k6-script.js (50 VU, sleep 1s)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "httplib.h"
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        std::string host = "localhost";
+        int port = 8080;
+        std::vector<std::string> endpoints = { "/", "/stats", "/metrics", "/traces" };
+        int connections = 16;
+        double duration_seconds = 10;
+        double warmup_seconds = 2;
+        double rate = 0;   // Richieste al secondo in totale; 0 = closed loop
+        int think_ms = 0;  // Pausa tra due richieste della stessa connessione (solo closed loop)
+    };
+
+    std::vector<std::string> Split(const std::string& text, char separator) {
+        std::vector<std::string> parts;
+        size_t begin = 0;
+        while (begin <= text.size()) {
+            size_t end = text.find(separator, begin);
+            if (end == std::string::npos) end = text.size();
+            if (end > begin) parts.push_back(text.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return parts;
+    }
+
+    void PrintUsage(const char* program) {
+        std::cerr << "Uso: " << program << " [--host=H] [--port=P] [--endpoints=/,/stats,...]\n"
+            << "       [--connections=N] [--duration=S] [--warmup=S] [--rate=R] [--think-ms=MS]\n";
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            size_t eq = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+                std::cerr << "Argomento non valido: " << arg << "\n";
+                return false;
+            }
+            std::string key = arg.substr(2, eq - 2);
+            std::string value = arg.substr(eq + 1);
+            if (key == "host") options.host = value;
+            else if (key == "port") options.port = std::atoi(value.c_str());
+            else if (key == "endpoints") options.endpoints = Split(value, ',');
+            else if (key == "connections") options.connections = std::atoi(value.c_str());
+            else if (key == "duration") options.duration_seconds = std::atof(value.c_str());
+            else if (key == "warmup") options.warmup_seconds = std::atof(value.c_str());
+            else if (key == "rate") options.rate = std::atof(value.c_str());
+            else if (key == "think-ms") options.think_ms = std::atoi(value.c_str());
+            else {
+                std::cerr << "Opzione sconosciuta: --" << key << "\n";
+                return false;
+            }
+        }
+        return !options.endpoints.empty() && options.connections > 0 && options.duration_seconds > 0;
+    }
+
+    // Risultati di una connessione per un endpoint: solo le richieste completate dopo il warmup.
+    struct EndpointSamples {
+        std::vector<uint64_t> latencies_ns;
+        uint64_t errors = 0;
+    };
+
+    // Percentile (0..1) di un vettore ordinato, con il metodo "nearest rank".
+    double PercentileMs(const std::vector<uint64_t>& sorted, double quantile) {
+        if (sorted.empty()) return 0;
+        size_t rank = static_cast<size_t>(quantile * static_cast<double>(sorted.size()));
+        if (rank >= sorted.size()) rank = sorted.size() - 1;
+        return static_cast<double>(sorted[rank]) / 1e6;
+    }
+
+    // Corpo di una connessione: invia richieste fino a `stop_at`, registrando quelle partite dopo `measure_from`.
+    void RunConnection(const Options& options, int index, Clock::time_point measure_from,
+        Clock::time_point stop_at, std::vector<EndpointSamples>& samples) {
+        httplib::Client client(options.host, options.port);
+        client.set_keep_alive(true);
+        client.set_connection_timeout(5);
+        client.set_read_timeout(10);
+
+        // In open loop ogni connessione copre una quota uguale del ritmo totale
+        const auto interval = options.rate > 0
+            ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.connections / options.rate))
+            : Clock::duration::zero();
+        Clock::time_point scheduled = Clock::now() + interval * index / options.connections;
+
+        for (size_t request = static_cast<size_t>(index); ; ++request) {
+            size_t endpoint = request % options.endpoints.size();
+            Clock::time_point start;
+            if (options.rate > 0) {
+                if (scheduled >= stop_at) break;
+                std::this_thread::sleep_until(scheduled);
+                start = scheduled; // Il ritardo rispetto al piano fa parte della latenza
+                scheduled += interval;
+            }
+            else {
+                start = Clock::now();
+                if (start >= stop_at) break;
+            }
+
+            auto result = client.Get(options.endpoints[endpoint]);
+            Clock::time_point end = Clock::now();
+
+            if (start >= measure_from) {
+                EndpointSamples& target = samples[endpoint];
+                if (!result || result->status >= 400) {
+                    ++target.errors;
+                }
+                else {
+                    target.latencies_ns.push_back(static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                }
+            }
+
+            if (options.rate <= 0 && options.think_ms > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(options.think_ms));
+            }
+        }
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage(argv[0]);
+        return 2;
+    }
+
+    std::cout << "Target http://" << options.host << ":" << options.port
+        << " - " << options.connections << " connessioni, "
+        << (options.rate > 0 ? "open loop a " + std::to_string(static_cast<long>(options.rate)) + " req/s" : std::string("closed loop"))
+        << ", warmup " << options.warmup_seconds << "s, misura " << options.duration_seconds << "s" << std::endl;
+
+    const Clock::time_point begin = Clock::now();
+    const Clock::time_point measure_from = begin + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.warmup_seconds));
+    const Clock::time_point stop_at = measure_from + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.duration_seconds));
+
+    // Un vettore di campioni per connessione e per endpoint: nessuna sincronizzazione durante il test
+    std::vector<std::vector<EndpointSamples>> samples(options.connections,
+        std::vector<EndpointSamples>(options.endpoints.size()));
+    std::vector<std::thread> threads;
+    threads.reserve(options.connections);
+    for (int i = 0; i < options.connections; ++i) {
+        threads.emplace_back(RunConnection, std::cref(options), i, measure_from, stop_at, std::ref(samples[i]));
+    }
+    for (auto& thread : threads) thread.join();
+
+    const double seconds = options.duration_seconds;
+    std::printf("\n%-16s %10s %8s %10s %9s %9s %9s %9s\n",
+        "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+    uint64_t total_requests = 0;
+    uint64_t total_errors = 0;
+    std::vector<uint64_t> all;
+    for (size_t e = 0; e < options.endpoints.size(); ++e) {
+        std::vector<uint64_t> merged;
+        uint64_t errors = 0;
+        for (const auto& connection : samples) {
+            merged.insert(merged.end(), connection[e].latencies_ns.begin(), connection[e].latencies_ns.end());
+            errors += connection[e].errors;
+        }
+        std::sort(merged.begin(), merged.end());
+        std::printf("%-16s %10zu %8llu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+            options.endpoints[e].c_str(), merged.size(), static_cast<unsigned long long>(errors),
+            static_cast<double>(merged.size()) / seconds,
+            PercentileMs(merged, 0.50), PercentileMs(merged, 0.99), PercentileMs(merged, 0.999),
+            merged.empty() ? 0.0 : static_cast<double>(merged.back()) / 1e6);
+        total_requests += merged.size();
+        total_errors += errors;
+        all.insert(all.end(), merged.begin(), merged.end());
+    }
+
+    std::sort(all.begin(), all.end());
+    std::printf("%-16s %10llu %8llu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+        "TOTALE", static_cast<unsigned long long>(total_requests), static_cast<unsigned long long>(total_errors),
+        static_cast<double>(total_requests) / seconds,
+        PercentileMs(all, 0.50), PercentileMs(all, 0.99), PercentileMs(all, 0.999),
+        all.empty() ? 0.0 : static_cast<double>(all.back()) / 1e6);
+
+    // Codice di uscita non nullo se il server ha risposto con errori: utile in CI
+    return total_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,273 @@
+// Micro-benchmark (Google Benchmark) dei percorsi caldi del server: contatori,
+// esposizione Prometheus, creazione/chiusura degli span, pipeline delle route e generazione degli ID.
+//
+// Build ed esecuzione:
+//   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release
+//   cmake --build build --target bench
+// oppure direttamente ./build/webserver_microbench --benchmark_filter=Span
+//
+// Il file include WebServer.cpp senza la sua main(), così misura esattamente il codice servito.
+
+#define WEBSERVER_NO_MAIN
+#include "../WebServer.cpp"
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+    // Exporter che scarta gli span: misura la pipeline (Span -> coda -> batch) senza I/O su console.
+    class NullSpanExporter : public otel::SpanExporter {
+    public:
+        bool Export(const std::vector<otel::SpanData>& batch) override {
+            benchmark::DoNotOptimize(batch.data());
+            return true;
+        }
+    };
+
+    // Inizializza una sola volta il TracerProvider (la prima Init vince, come nel server).
+    void InitTracing() {
+        otel::BatchSpanProcessorOptions options;
+        options.max_queue_size = 8192;
+        otel::TracerProvider::Instance().Init(std::make_unique<NullSpanExporter>(), options);
+    }
+
+    // VisitCounter condiviso, con le stesse route registrate da main().
+    VisitCounter& SharedVisitCounter() {
+        static VisitCounter counter;
+        static const bool registered = [] {
+            for (const char* path : { "/", "/stats", "/metrics", "/traces" }) counter.registerPath(path);
+            return true;
+        }();
+        (void)registered;
+        return counter;
+    }
+
+} // namespace
+
+// --- Contatori ---
+
+// Metric::Add con label: risolve la serie a ogni chiamata (percorso "comodo").
+static void BM_MetricAdd(benchmark::State& state) {
+    otel::Metric* metric = otel::MetricsRegistry::Instance().CreateCounter("bench_metric_add_total", "Benchmark Metric::Add");
+    const otel::LabelSet labels = { {"path", "/stats"} };
+    for (auto _ : state) {
+        metric->Add(1, labels);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MetricAdd)->ThreadRange(1, 8);
+
+// BoundCounter::Add: handle pre-risolto, il percorso usato dagli handler.
+static void BM_BoundCounterAdd(benchmark::State& state) {
+    static const otel::BoundCounter bound = otel::MetricsRegistry::Instance()
+        .CreateCounter("bench_bound_counter_total", "Benchmark BoundCounter::Add")->Bind({ {"path", "/"} });
+    for (auto _ : state) {
+        bound.Add(1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BoundCounterAdd)->ThreadRange(1, 8);
+
+// VisitCounter::incrementPath con PathId già internato (handler delle route note).
+static void BM_VisitCounterIncrementPathId(benchmark::State& state) {
+    VisitCounter& counter = SharedVisitCounter();
+    const VisitCounter::PathId id = counter.registerPath("/stats");
+    for (auto _ : state) {
+        counter.incrementPath(id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_VisitCounterIncrementPathId)->ThreadRange(1, 8);
+
+// VisitCounter::incrementPath per stringa: ricerca nell'indice concorrente a ogni chiamata.
+static void BM_VisitCounterIncrementPathString(benchmark::State& state) {
+    VisitCounter& counter = SharedVisitCounter();
+    const std::string path = "/stats";
+    for (auto _ : state) {
+        counter.incrementPath(path);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_VisitCounterIncrementPathString)->ThreadRange(1, 8);
+
+// --- Esposizione Prometheus ---
+
+// GetPrometheusFormat di un contatore con state.range(0) serie.
+static void BM_GetPrometheusFormat(benchmark::State& state) {
+    const std::string name = "bench_exposition_" + std::to_string(state.range(0)) + "_total";
+    otel::Metric* metric = otel::MetricsRegistry::Instance().CreateCounter(name, "Benchmark GetPrometheusFormat");
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        metric->Add(i, { {"path", "/route/" + std::to_string(i)} });
+    }
+    size_t bytes = 0;
+    for (auto _ : state) {
+        std::string out = metric->GetPrometheusFormat();
+        bytes += out.size();
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+BENCHMARK(BM_GetPrometheusFormat)->RangeMultiplier(8)->Range(1, 512);
+
+// Risposta completa di /metrics (metriche native + registry + pipeline di tracing)
+// in ognuno dei formati negoziabili: 0 = testo 0.0.4, 1 = OpenMetrics, 2 = protobuf.
+static void BM_GetPrometheusMetrics(benchmark::State& state) {
+    InitTracing();
+    VisitCounter& counter = SharedVisitCounter();
+    const auto format = static_cast<otel::ExpositionFormat>(state.range(0));
+    size_t bytes = 0;
+    for (auto _ : state) {
+        std::string out = counter.getMetrics(format);
+        bytes += out.size();
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+BENCHMARK(BM_GetPrometheusMetrics)->DenseRange(0, 2);
+
+// Record di un istogramma dentro uno span campionato: include la scrittura dell'esemplare.
+static void BM_HistogramRecordInSpan(benchmark::State& state) {
+    InitTracing();
+    static otel::BoundHistogram histogram = otel::MetricsRegistry::Instance()
+        .CreateHistogram("bench_histogram_exemplar_seconds", "Benchmark esemplari",
+            otel::ExponentialBuckets(50000, 2, 16), 1e-9)->Bind();
+    otel::Span span("bench_exemplar_span");
+    uint64_t value = 0;
+    for (auto _ : state) {
+        histogram.Record(value);
+        value = (value + 100003) & ((1u << 24) - 1);
+    }
+}
+BENCHMARK(BM_HistogramRecordInSpan)->ThreadRange(1, 8);
+
+// --- Tracing ---
+
+// Span radice sullo stack: campionamento, ID, timestamp e accodamento al processor.
+static void BM_SpanCreateEnd(benchmark::State& state) {
+    InitTracing();
+    for (auto _ : state) {
+        otel::Span span("bench_span", otel::SpanKind::Server);
+        span.SetAttribute("http.method", "GET");
+        span.SetAttribute("http.status_code", 200);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpanCreateEnd)->ThreadRange(1, 8);
+
+// Come negli handler: span server allocato con make_unique (arena per thread) e uno span figlio.
+static void BM_SpanWithChild(benchmark::State& state) {
+    InitTracing();
+    for (auto _ : state) {
+        auto span = std::make_unique<otel::Span>("bench_parent", otel::SpanKind::Server);
+        {
+            otel::Span child("bench_child");
+        }
+        span->End();
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_SpanWithChild)->ThreadRange(1, 8);
+
+// Catena di middleware di una route attorno a un handler vuoto: il costo per richiesta della
+// strumentazione (span server, richieste lente, latenza, visite). state.range(0) = 0 misura la route senza middleware.
+static void BM_RoutePipeline(benchmark::State& state) {
+    InitTracing();
+    VisitCounter& counter = SharedVisitCounter();
+    static otel::Histogram* latency = otel::MetricsRegistry::Instance().CreateHistogram(
+        "bench_route_duration_seconds", "Benchmark pipeline", otel::ExponentialBuckets(50000, 2, 16), 1e-9);
+    static SlowRequestTracker slow_requests{ [] {
+        SlowRequestOptions options;
+        options.token = "bench"; // Senza token il buffer è disattivato
+        return options;
+    }() };
+    static SlowRequestLog* slow_log = slow_requests.ForRoute("/");
+    const auto handler = [](const httplib::Request&, httplib::Response& res, RequestContext&) { res.status = 200; };
+    const httplib::Server::Handler route = state.range(0) == 0
+        ? httplib::Server::Handler(MakeRoute(handler))
+        : httplib::Server::Handler(MakeRoute(handler,
+            TracingMiddleware{ "bench_route_request", "/" },
+            SlowRequestMiddleware{ slow_log },
+            LatencyMiddleware{ latency->Bind({ {"route", "/"} }) },
+            VisitMiddleware{ counter, counter.registerPath("/") }));
+    httplib::Request req;
+    req.method = "GET";
+    req.remote_addr = "127.0.0.1";
+    for (auto _ : state) {
+        httplib::Response res;
+        route(req, res);
+        benchmark::DoNotOptimize(res.status);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RoutePipeline)->Arg(0)->Arg(1)->ThreadRange(1, 8);
+
+// --- Rendering delle pagine ---
+
+// Rendering di una tabella di /stats con 64 percorsi: state.range(0) = 0 usa l'heap
+// (std::string e contatori in std::vector), 1 l'arena per richiesta come gli handler del server.
+static void BM_RenderStatsPage(benchmark::State& state) {
+    VisitCounter counter;
+    for (int i = 0; i < 64; ++i) counter.incrementPath(counter.registerPath("/page/" + std::to_string(i)));
+    const HtmlTemplate page("<html><p>{{total}}</p><table>{{rows}}</table></html>");
+    const auto fill = [&](auto& out, const auto& path_counters) {
+        for (const auto& [path, count] : path_counters) {
+            out += "<tr><td>";
+            AppendHtmlEscaped(out, path);
+            out += "</td><td>";
+            out += std::to_string(count);
+            out += "</td></tr>";
+        }
+    };
+    const bool use_arena = state.range(0) == 1;
+    for (auto _ : state) {
+        if (use_arena) {
+            RequestArena::Reset();
+            std::pmr::memory_resource* arena = RequestArena::Resource();
+            auto path_counters = counter.getPathCounters(arena);
+            auto& body = RequestArena::NewString(arena);
+            page.RenderTo(body, counter.getTotal(), [&](std::pmr::string& out) { fill(out, path_counters); });
+            benchmark::DoNotOptimize(body.data());
+        } else {
+            auto path_counters = counter.getPathCounters();
+            std::string body = page.Render(counter.getTotal(), [&](std::string& out) { fill(out, path_counters); });
+            benchmark::DoNotOptimize(body.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RenderStatsPage)->Arg(0)->Arg(1);
+
+// --- ID e contesto ---
+
+static void BM_NewTraceId(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(otel::IdGenerator::NewTraceId());
+    }
+}
+BENCHMARK(BM_NewTraceId)->ThreadRange(1, 8);
+
+static void BM_NewSpanId(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(otel::IdGenerator::NewSpanId());
+    }
+}
+BENCHMARK(BM_NewSpanId)->ThreadRange(1, 8);
+
+static void BM_SpanContextCreateRandom(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(otel::SpanContext::CreateRandom());
+    }
+}
+BENCHMARK(BM_SpanContextCreateRandom);
+
+// Round-trip dell'header traceparent (Inject lato client, Extract lato server).
+static void BM_TraceparentRoundTrip(benchmark::State& state) {
+    const otel::SpanContext context = otel::SpanContext::CreateRandom();
+    for (auto _ : state) {
+        std::string header = otel::TraceContext::Traceparent(context);
+        benchmark::DoNotOptimize(otel::TraceContext::Extract(header));
+    }
+}
+BENCHMARK(BM_TraceparentRoundTrip);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Addestramento PGO (target pgo-train): avvia il server compilato con WEBSERVER_PGO=generate,
+# lo carica con webserver_loadgen sugli endpoint principali e lo ferma con SIGTERM, così
+# l'arresto ordinato scrive i profili. Con Clang i profili .profraw vengono uniti in
+# default.profdata (llvm-profdata), come si aspetta WEBSERVER_PGO=use.
+#
+#   bench/pgo-train.sh <webserver> <webserver_loadgen>
+set -eu
+
+SERVER=$1
+LOADGEN=$2
+PORT=${PGO_TRAIN_PORT:-18080}
+DURATION=${PGO_TRAIN_DURATION:-20}
+PGO_DIR=${WEBSERVER_PGO_DIR:-pgo}
+
+mkdir -p "$PGO_DIR"
+LLVM_PROFILE_FILE="$PGO_DIR/webserver-%p.profraw" OTEL_TRACES_EXPORTER=none LOG_LEVEL=warn \
+    "$SERVER" --port="$PORT" &
+SERVER_PID=$!
+trap 'kill "$SERVER_PID" 2>/dev/null || true' EXIT
+
+sleep 1
+"$LOADGEN" --port="$PORT" --endpoints=/,/stats,/metrics --connections=16 --warmup=1 --duration="$DURATION"
+
+kill -TERM "$SERVER_PID"
+wait "$SERVER_PID" || true
+trap - EXIT
+
+if [ -n "${LLVM_PROFDATA:-}" ] && ls "$PGO_DIR"/*.profraw >/dev/null 2>&1; then
+    "$LLVM_PROFDATA" merge -output="$PGO_DIR/default.profdata" "$PGO_DIR"/*.profraw
+fi
+echo "Profili PGO in $PGO_DIR: riconfigurare con -DWEBSERVER_PGO=use e ricompilare"